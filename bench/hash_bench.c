@@ -0,0 +1,163 @@
+#define _XOPEN_SOURCE 500
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <ftw.h>
+
+#include <consts.h>
+#include <hash.h>
+#include <debug.h>
+
+/* the file name hashes on the paths under a directory, /usr if none
+   is given. The chains are what a table of 1 << bits buckets gets,
+   the lookups walk them comparing the names as the file table does */
+
+int debug = 0;
+
+#define BENCH_MAX_NAMES	200000
+#define BENCH_ROUNDS	10	/* of hashing every name */
+
+static char (*names)[MAX_NAME_LEN];
+static int name_n;
+static int root_len;
+
+/* the hash the file table had before, one byte at a time */
+static inline unsigned long ELFhash(const char *key)
+{
+	unsigned long h = 0, g;
+
+	while (*key) {
+		h = (h << 4) + *key++;
+		g = h & 0xf0000000L;
+		if (g)
+			h ^= g >> 24;
+		h &= ~g;
+	}
+	return h;
+}
+
+static uint32_t elf_hash(const char *name, uint32_t seed)
+{
+	return ELFhash(name);
+}
+
+struct bench_hash {
+	const char *name;
+	uint32_t (*fn)(const char *name, uint32_t seed);
+};
+
+static struct bench_hash hashes[] = {
+	{ "ELFhash", elf_hash },
+	{ "hash_str", hash_str },
+};
+
+static inline double now_sec()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* logic names are relative to the root, as in the file table */
+static int name_add(const char *path, const struct stat *st, int flag,
+		    struct FTW *ftw)
+{
+	if (ftw->level == 0)
+		return 0;
+	if (strlen(path + root_len) >= MAX_NAME_LEN)
+		return 0;
+	strcpy(names[name_n++], path + root_len);
+
+	return name_n == BENCH_MAX_NAMES;
+}
+
+/**
+ * hash every name into 1 << bits chains and look all of them up
+ */
+static void bench_run(struct bench_hash *bh, int bits)
+{
+	uint32_t seed = 0x2545f491, h;
+	int *heads, *next;
+	int i, j, r, len, longest = 0, empty = 0;
+	long probes = 0, sink = 0;
+	double start, hash_ns, lookup_ns;
+
+	heads = malloc((1 << bits) * sizeof(int));
+	next = malloc(name_n * sizeof(int));
+	for (i = 0; i < 1 << bits; i++)
+		heads[i] = -1;
+
+	start = now_sec();
+	for (r = 0; r < BENCH_ROUNDS; r++)
+		for (i = 0; i < name_n; i++)
+			sink += bh->fn(names[i], seed);
+	hash_ns = (now_sec() - start) * 1e9 / BENCH_ROUNDS / name_n;
+
+	for (i = 0; i < name_n; i++) {
+		h = hash_32(bh->fn(names[i], seed), bits);
+		next[i] = heads[h];
+		heads[h] = i;
+	}
+	for (i = 0; i < 1 << bits; i++) {
+		len = 0;
+		for (j = heads[i]; j >= 0; j = next[j])
+			len++;
+		if (len == 0)
+			empty++;
+		longest = max(longest, len);
+		/* the k-th entry of a chain takes k compares */
+		probes += (long)len * (len + 1) / 2;
+	}
+
+	start = now_sec();
+	for (i = 0; i < name_n; i++) {
+		h = hash_32(bh->fn(names[i], seed), bits);
+		for (j = heads[h]; j >= 0; j = next[j])
+			if (strcmp(names[j], names[i]) == 0)
+				break;
+		sink += j;
+	}
+	lookup_ns = (now_sec() - start) * 1e9 / name_n;
+
+	printf("%-9s %5d %8d %8d %8.2f %8.1f %9.1f\n", bh->name, bits,
+			empty, longest, (double)probes / name_n, hash_ns,
+			lookup_ns);
+	if (sink == 42)
+		printf("\n");
+
+	free(heads);
+	free(next);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *root = argc > 1 ? argv[1] : "/usr";
+	int i, fit;
+
+	names = malloc(BENCH_MAX_NAMES * sizeof(*names));
+	root_len = strlen(root) + 1;
+	if (nftw(root, name_add, 64, FTW_PHYS) < 0) {
+		perror("nftw() error");
+		return 1;
+	}
+	if (name_n == 0) {
+		_error("no file under '%s'\n", root);
+		return 1;
+	}
+
+	for (fit = 1; 1 << fit < name_n; fit++)
+		;
+	printf("%d names under %s\n", name_n, root);
+	printf("%-9s %5s %8s %8s %8s %8s %9s\n", "hash", "bits", "empty",
+			"longest", "probes", "hash ns", "lookup ns");
+	/* the old fixed table, then one grown to hold every name */
+	for (i = 0; i < ARRAY_SIZE(hashes); i++)
+		bench_run(hashes + i, 12);
+	for (i = 0; fit > 12 && i < ARRAY_SIZE(hashes); i++)
+		bench_run(hashes + i, fit);
+
+	return 0;
+}
@@ -0,0 +1,153 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <consts.h>
+#include <utility/segment.h>
+#include <debug.h>
+
+/* throughput of the segment framings over a local stream socket: the
+   old sentinel reader which takes one byte per recv(), and the
+   buffered reader on sentinel and on framed segments */
+
+int debug = 0;
+
+#define BENCH_BYTES	(64 << 20)	/* payload sent by every run */
+
+struct bench_writer {
+	int conn;
+	enum segment_mode mode;
+	int len;
+	int count;
+};
+
+static inline double now_sec()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *bench_writer_task(void *arg)
+{
+	struct bench_writer *w = arg;
+	char *buf;
+	int i;
+
+	/* no '!' in the payload, the sentinel framing does not escape */
+	buf = malloc(w->len);
+	memset(buf, 'x', w->len);
+	segment_set_mode(w->conn, w->mode);
+	for (i = 0; i < w->count; i++)
+		if (send_segment(w->conn, buf, w->len) < 0) {
+			_error("send_segment failed\n");
+			break;
+		}
+	free(buf);
+	segment_conn_close(w->conn);
+	shutdown(w->conn, SHUT_WR);
+
+	return NULL;
+}
+
+/**
+ * the reader the sentinel framing had before the receive buffer, one
+ * recv() per byte
+ * @return: -1, failed. Otherwise the bytes taken into buf
+ */
+static int recv_segment_bytewise(int conn, char *buf)
+{
+	char c;
+	int idx = 0, state = 0;
+
+	while (recv(conn, &c, 1, 0) > 0) {
+		if (state == 0) {
+			if (c == '!')
+				state = 1;
+		} else if (state == 1)
+			state = c == '&' ? 2 : 0;
+		else {
+			buf[idx++] = c;
+			if (state == 3 && c == '#')
+				return idx;
+			state = c == '!' ? 3 : 2;
+		}
+	}
+
+	return -1;
+}
+
+/**
+ * send count segments of len bytes in a mode and time their receiving
+ * @bytewise: receive them with the old one byte reader
+ */
+static void bench_run(const char *name, enum segment_mode mode,
+		      bool bytewise, int len, int count)
+{
+	struct bench_writer w;
+	pthread_t tid;
+	char *buf = NULL, *data;
+	double start, sec;
+	int fds[2], got = 0, ret;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+		perror("socketpair() error");
+		exit(1);
+	}
+	if (bytewise)
+		buf = malloc(len + 2);
+
+	w.conn = fds[0];
+	w.mode = mode;
+	w.len = len;
+	w.count = count;
+	start = now_sec();
+	pthread_create(&tid, NULL, bench_writer_task, &w);
+	while (got < count) {
+		if (bytewise)
+			ret = recv_segment_bytewise(fds[1], buf);
+		else
+			ret = recv_segment_view(fds[1], &data);
+		if (ret < 0)
+			break;
+		got++;
+	}
+	pthread_join(tid, NULL);
+	sec = now_sec() - start;
+
+	if (got < count)
+		_error("%s: only %d of %d segments came\n", name, got, count);
+	printf("%-10s %6d %9d %10.0f %9.1f\n", name, len, got,
+			got / sec, (double)got * len / sec / (1 << 20));
+
+	free(buf);
+	segment_conn_close(fds[1]);
+	close(fds[0]);
+	close(fds[1]);
+}
+
+int main(int argc, char *argv[])
+{
+	int lens[] = { 64, 512, 4096, MAX_PKT_DATA_LEN };
+	int i, count;
+
+	printf("%-10s %6s %9s %10s %9s\n", "framing", "len", "segments",
+			"seg/s", "MB/s");
+	for (i = 0; i < sizeof(lens) / sizeof(lens[0]); i++) {
+		count = BENCH_BYTES / lens[i];
+		/* a syscall a byte, a sixteenth of the data is plenty */
+		bench_run("bytewise", SEGMENT_SENTINEL, true, lens[i],
+				count / 16);
+		bench_run("sentinel", SEGMENT_SENTINEL, false, lens[i], count);
+		bench_run("framed", SEGMENT_FRAMED, false, lens[i], count);
+	}
+
+	return 0;
+}
@@ -0,0 +1,179 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <file_table.h>
+#include <utility/slab.h>
+#include <debug.h>
+
+/* the cost of the file entries: building and destroying a file table
+   the way the client does for a big tree, and the allocator alone,
+   calloc() against the slab pool, from one and from several threads */
+
+int debug = 0;
+
+#define BENCH_ENTRIES	200000
+#define BENCH_ROUNDS	5
+#define BENCH_THREADS	4
+
+enum bench_alloc {
+	BENCH_CALLOC,		/* calloc() and free() every object */
+	BENCH_SLAB,		/* slab_alloc() and slab_free() every one */
+	BENCH_SLAB_BULK,	/* slab_alloc(), the pool releases them */
+};
+
+static const char *alloc_names[] = { "calloc", "slab", "slab+bulk" };
+
+struct bench_worker {
+	enum bench_alloc how;
+	struct slab_pool *pool;
+	void **objs;
+	int n;
+};
+
+static inline double now_msec()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/**
+ * add the entries of a tree of 1000 files a directory, as
+ * get_file_table_r() does
+ */
+static void bench_table_build(struct file_table *ft)
+{
+	char name[MAX_NAME_LEN];
+	struct file_entry *fe;
+	int i;
+
+	for (i = 0; i < BENCH_ENTRIES; i++) {
+		fe = file_entry_alloc(ft);
+		if (fe == NULL) {
+			_error("file entry alloc failed\n");
+			exit(1);
+		}
+		sprintf(name, "1/dir%03d/file%06d", i / 1000, i);
+		fe->type = REGULAR;
+		fe->timestamp = i;
+		file_entry_set_name(fe, name);
+		file_entry_add_owner(fe, 0x0a090002, 6000);
+		file_entry_add(ft, fe);
+	}
+}
+
+static void bench_table()
+{
+	struct file_table ft;
+	double build = 0, destroy = 0, start;
+	int r;
+
+	for (r = 0; r < BENCH_ROUNDS; r++) {
+		file_table_init(&ft);
+		start = now_msec();
+		bench_table_build(&ft);
+		build += now_msec() - start;
+		start = now_msec();
+		file_table_destroy(&ft);
+		destroy += now_msec() - start;
+	}
+
+	printf("table of %d entries: build %.1f ms, destroy %.1f ms\n\n",
+			BENCH_ENTRIES, build / BENCH_ROUNDS,
+			destroy / BENCH_ROUNDS);
+}
+
+static void *bench_worker_task(void *arg)
+{
+	struct bench_worker *w = arg;
+	size_t size = sizeof(struct file_entry);
+	int i;
+
+	for (i = 0; i < w->n; i++) {
+		if (w->how == BENCH_CALLOC)
+			w->objs[i] = calloc(1, size);
+		else {
+			w->objs[i] = slab_alloc(w->pool);
+			if (w->objs[i] != NULL)
+				bzero(w->objs[i], size);
+		}
+		if (w->objs[i] == NULL) {
+			_error("object alloc failed\n");
+			exit(1);
+		}
+	}
+
+	if (w->how == BENCH_CALLOC)
+		for (i = 0; i < w->n; i++)
+			free(w->objs[i]);
+	else if (w->how == BENCH_SLAB)
+		for (i = 0; i < w->n; i++)
+			slab_free(w->pool, w->objs[i]);
+
+	return NULL;
+}
+
+/**
+ * allocate BENCH_ENTRIES file entry sized objects shared out among
+ * some threads, and free them again
+ * @return: msec it takes
+ */
+static double bench_alloc(enum bench_alloc how, int threads)
+{
+	struct bench_worker w[BENCH_THREADS];
+	pthread_t tids[BENCH_THREADS];
+	struct slab_pool pool;
+	void **objs;
+	double start;
+	int i;
+
+	objs = malloc(BENCH_ENTRIES * sizeof(void *));
+	if (how != BENCH_CALLOC && slab_pool_init(&pool,
+				sizeof(struct file_entry)) < 0)
+		exit(1);
+
+	start = now_msec();
+	for (i = 0; i < threads; i++) {
+		w[i].how = how;
+		w[i].pool = &pool;
+		w[i].n = BENCH_ENTRIES / threads;
+		w[i].objs = objs + i * w[i].n;
+		pthread_create(tids + i, NULL, bench_worker_task, w + i);
+	}
+	for (i = 0; i < threads; i++)
+		pthread_join(tids[i], NULL);
+	if (how != BENCH_CALLOC)
+		slab_pool_destroy(&pool);
+
+	free(objs);
+	return now_msec() - start;
+}
+
+int main(int argc, char *argv[])
+{
+	int threads[] = { 1, BENCH_THREADS };
+	double ms;
+	int i, how, r;
+
+	bench_table();
+
+	printf("%d objects of %zu bytes\n", BENCH_ENTRIES,
+			sizeof(struct file_entry));
+	printf("%-10s %8s %8s\n", "alloc", "threads", "ms");
+	for (i = 0; i < ARRAY_SIZE(threads); i++)
+		for (how = BENCH_CALLOC; how <= BENCH_SLAB_BULK; how++) {
+			ms = 0;
+			for (r = 0; r < BENCH_ROUNDS; r++)
+				ms += bench_alloc(how, threads[i]);
+			printf("%-10s %8d %8.1f\n", alloc_names[how],
+					threads[i], ms / BENCH_ROUNDS);
+		}
+
+	return 0;
+}
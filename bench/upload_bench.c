@@ -0,0 +1,246 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <debug.h>
+
+/* the ways an uploader sends a piece of a file to a loopback TCP
+   socket, a reader thread draining it: read() and send() through a
+   buffer as before, sendfile() at the piece's offset, and splice()
+   through a pipe as the fallback does. The sender's CPU is what an
+   upload costs besides the link */
+
+int debug = 0;
+
+#define BENCH_FILE_LEN	(64 << 20)	/* the file sent over and over */
+#define BENCH_BYTES	(512 << 20)	/* sent by every run */
+#define BENCH_PIECE_LEN	(128 << 10)
+
+typedef int (*send_fn)(int conn, int file_fd, off_t offset, int len);
+
+static inline double now_sec()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* user and system CPU of the calling thread */
+static inline double thread_cpu_sec()
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_THREAD, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+		ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+static void *bench_reader_task(void *arg)
+{
+	int conn = *(int *)arg;
+	char *buf = malloc(BENCH_PIECE_LEN);
+
+	while (recv(conn, buf, BENCH_PIECE_LEN, 0) > 0)
+		;
+	free(buf);
+
+	return NULL;
+}
+
+/* how the uploader sent a piece before: lseek(), read() and send() */
+static int read_piece(int conn, int file_fd, off_t offset, int len)
+{
+	static char buf[BENCH_PIECE_LEN];
+	int n = 0;
+	ssize_t ret;
+
+	if (lseek(file_fd, offset, SEEK_SET) < 0 ||
+			read(file_fd, buf, len) != len)
+		return 0;
+	while (n < len) {
+		ret = send(conn, buf + n, len - n, 0);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			break;
+		n += ret;
+	}
+
+	return n;
+}
+
+static int sendfile_piece(int conn, int file_fd, off_t offset, int len)
+{
+	int n = 0;
+	ssize_t ret;
+
+	while (n < len) {
+		ret = sendfile(conn, file_fd, &offset, len - n);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			break;
+		n += ret;
+	}
+
+	return n;
+}
+
+/* the pipe is the uploader's per piece one */
+static int splice_piece(int conn, int file_fd, off_t offset, int len)
+{
+	int pipefd[2], n = 0;
+	ssize_t in, out;
+
+	if (pipe(pipefd) < 0) {
+		perror("pipe error");
+		return 0;
+	}
+
+	while (n < len) {
+		in = splice(file_fd, &offset, pipefd[1], NULL, len - n,
+			    SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (in < 0 && errno == EINTR)
+			continue;
+		if (in <= 0)
+			break;
+		while (in > 0) {
+			out = splice(pipefd[0], NULL, conn, NULL, in,
+				     SPLICE_F_MOVE | SPLICE_F_MORE);
+			if (out < 0 && errno == EINTR)
+				continue;
+			if (out <= 0)
+				goto out;
+			in -= out;
+			n += out;
+		}
+	}
+
+out:
+	close(pipefd[0]);
+	close(pipefd[1]);
+	return n;
+}
+
+/**
+ * connect a pair of loopback TCP sockets
+ * @return: 0 if succeeds, -1 otherwise
+ */
+static int tcp_pair(int fds[2])
+{
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	int listener;
+
+	listener = socket(AF_INET, SOCK_STREAM, 0);
+	if (listener < 0)
+		return -1;
+	bzero(&addr, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+			listen(listener, 1) < 0 ||
+			getsockname(listener, (struct sockaddr *)&addr,
+				    &len) < 0)
+		goto fail;
+
+	fds[0] = socket(AF_INET, SOCK_STREAM, 0);
+	if (fds[0] < 0)
+		goto fail;
+	if (connect(fds[0], (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(fds[0]);
+		goto fail;
+	}
+	fds[1] = accept(listener, NULL, NULL);
+	if (fds[1] < 0) {
+		close(fds[0]);
+		goto fail;
+	}
+	close(listener);
+	return 0;
+
+fail:
+	close(listener);
+	return -1;
+}
+
+static void bench_run(const char *name, send_fn fn, int file_fd)
+{
+	pthread_t tid;
+	double start, cpu, sec;
+	long long sent = 0;
+	off_t offset = 0;
+	int fds[2], n;
+
+	if (tcp_pair(fds) < 0) {
+		perror("loopback connection error");
+		exit(1);
+	}
+	pthread_create(&tid, NULL, bench_reader_task, &fds[1]);
+
+	start = now_sec();
+	cpu = thread_cpu_sec();
+	while (sent < BENCH_BYTES) {
+		n = fn(fds[0], file_fd, offset, BENCH_PIECE_LEN);
+		if (n != BENCH_PIECE_LEN) {
+			_error("%s: piece at %lld came short\n", name,
+					(long long)offset);
+			break;
+		}
+		sent += n;
+		offset = (offset + n) % BENCH_FILE_LEN;
+	}
+	cpu = thread_cpu_sec() - cpu;
+	shutdown(fds[0], SHUT_WR);
+	pthread_join(tid, NULL);
+	sec = now_sec() - start;
+
+	printf("%-10s %9.0f %10.3f\n", name, sent / sec / (1 << 20), cpu);
+
+	close(fds[0]);
+	close(fds[1]);
+}
+
+int main(int argc, char *argv[])
+{
+	char path[] = "/tmp/upload_bench.XXXXXX";
+	char *buf;
+	int fd, i;
+
+	fd = mkstemp(path);
+	if (fd < 0) {
+		perror("mkstemp error");
+		return 1;
+	}
+	unlink(path);
+	buf = malloc(BENCH_PIECE_LEN);
+	memset(buf, 'x', BENCH_PIECE_LEN);
+	for (i = 0; i < BENCH_FILE_LEN / BENCH_PIECE_LEN; i++)
+		if (write(fd, buf, BENCH_PIECE_LEN) != BENCH_PIECE_LEN) {
+			perror("write error");
+			return 1;
+		}
+	free(buf);
+
+	printf("%-10s %9s %10s\n", "send", "MB/s", "cpu_sec");
+	/* the file is in the page cache for every run */
+	bench_run("read+send", read_piece, fd);
+	bench_run("sendfile", sendfile_piece, fd);
+	bench_run("splice", splice_piece, fd);
+
+	close(fd);
+	return 0;
+}
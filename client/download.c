@@ -1,22 +1,49 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <string.h>
 #include <strings.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <errno.h>
+#include <time.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/socket.h>
-#include <sys/file.h>
 #include <fcntl.h>
 
 #include <debug.h>
+#include <utility/segment.h>
 #include "packet.h"
+#include "link.h"
 #include "download.h"
 
 
 extern uint32_t my_ip;
 extern struct ttop_control_info ctr_info;
 
+/* the downloads going on, whose pieces are given to other peers as
+   soon as they are finished */
+static LIST(downloads);
+static pthread_mutex_t downloads_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* the files whose download has failed, the pieces of them here are not
+   given to other peers until they are downloaded again. With
+   downloads_mutex */
+struct download_failed {
+	struct list_head l;
+	char logic_name[MAX_NAME_LEN];
+};
+static LIST(failed_downloads);
+
+static inline uint64_t now_usec()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 static void download_obj_init(struct download_obj *obj,
 			      char *logic_name,
 			      char *sys_name)
@@ -25,133 +52,356 @@ static void download_obj_init(struct download_obj *obj,
 		return;
 
 	bzero(obj, sizeof(struct download_obj));
+	INIT_LIST_ELM(&obj->l);
+	INIT_LIST_HEAD(&obj->flight);
 	strcpy(obj->logic_name, logic_name);
 	strcpy(obj->sys_name, sys_name);
 	pthread_mutex_init(&obj->mutex, NULL);
+	pthread_cond_init(&obj->cond, NULL);
 }
 
-static uint32_t get_file_len_from(char *file_name, uint32_t ip, uint16_t port)
+/**
+ * You MUST lock downloads_mutex before calling it
+ */
+static struct download_obj *__download_find(const char *logic_name)
 {
-	struct p2p_packet pkt;
-	struct sockaddr_in servaddr;
-	int fd = socket(AF_INET, SOCK_STREAM, 0); 
-	uint32_t ret_len;
-
-	if (fd < 0) {
-		_error("socket create failed\n");
-		return -1; 
-	}   
-	bzero(&servaddr, sizeof(struct sockaddr_in));
-	servaddr.sin_family = AF_INET;
-	servaddr.sin_addr.s_addr = ip;
-	servaddr.sin_port = htons(port);
-	if (connect(fd, (struct sockaddr *) &servaddr, sizeof(servaddr)) < 0) {
-		perror("connect() error");
-		return -1; 
+	struct list_head *pos;
+
+	list_for_each(pos, &downloads) {
+		struct download_obj *obj =
+			list_entry(pos, struct download_obj, l);
+		if (strcmp(obj->logic_name, logic_name) == 0)
+			return obj;
 	}
 
-	p2p_packet_init(&pkt, P2P_FILE_LEN_REQ);
-	p2p_packet_fill(&pkt, file_name, strlen(file_name) + 1);
-	if (send_p2p_packet(fd, &pkt) < 0) {
-		_error("p2p packet send failed for '%s'\n", file_name);
-		return -1;
+	return NULL;
+}
+
+/**
+ * You MUST lock downloads_mutex before calling it
+ */
+static struct download_failed *__download_failed_find(const char *logic_name)
+{
+	struct list_head *pos;
+
+	list_for_each(pos, &failed_downloads) {
+		struct download_failed *df =
+			list_entry(pos, struct download_failed, l);
+		if (strcmp(df->logic_name, logic_name) == 0)
+			return df;
 	}
-	if (recv_p2p_packet(fd, &pkt) < 0) {
-		_error("p2p packet recv failed for '%s'\n", file_name);
-		return -1;
+
+	return NULL;
+}
+
+/**
+ * put a download on the list of the ones going on, its file is no
+ * longer one whose download has failed
+ */
+static void download_publish(struct download_obj *obj)
+{
+	struct download_failed *df;
+
+	pthread_mutex_lock(&downloads_mutex);
+	df = __download_failed_find(obj->logic_name);
+	if (df != NULL) {
+		list_del(&df->l);
+		free(df);
 	}
-	if (pkt.type != P2P_FILE_LEN_RET) {
-		_error("p2p packet type is not P2P_FILE_LEN_RET\n");
-		return -1;
+	list_add_tail(&downloads, &obj->l);
+	pthread_mutex_unlock(&downloads_mutex);
+}
+
+/**
+ * take a download off the list, the pieces of a file whose download
+ * has failed are not given any more
+ */
+static void download_unpublish(struct download_obj *obj, bool failed)
+{
+	struct download_failed *df = NULL;
+
+	if (failed) {
+		df = malloc(sizeof(struct download_failed));
+		if (df == NULL)
+			_error("failed download alloc failed\n");
+		else
+			strcpy(df->logic_name, obj->logic_name);
 	}
 
-	memcpy(&ret_len, pkt.data, sizeof(uint32_t));
-	close(fd);
+	pthread_mutex_lock(&downloads_mutex);
+	list_del(&obj->l);
+	if (df != NULL)
+		list_add_tail(&failed_downloads, &df->l);
+	pthread_mutex_unlock(&downloads_mutex);
+}
+
+/**
+ * fill the map of the pieces finished of a file being downloaded
+ * @max: bits the map has room for
+ * @return: number of pieces in the map, 0 if the length of the file is
+ *          not known yet or its download has failed, -1 if the file is
+ *          not being downloaded
+ */
+int download_piece_map(const char *logic_name, uint8_t *map, int max)
+{
+	struct download_obj *obj;
+	int i, n = -1;
+
+	pthread_mutex_lock(&downloads_mutex);
+	obj = __download_find(logic_name);
+	if (obj != NULL) {
+		pthread_mutex_lock(&obj->mutex);
+		n = min(obj->file_pieces, max);
+		bzero(map, (n + 7) / 8);
+		for (i = 0; i < n; i++)
+			if (obj->pieces[i].status == PIECE_FINISHED)
+				map[i / 8] |= 1 << (i % 8);
+		pthread_mutex_unlock(&obj->mutex);
+	} else if (__download_failed_find(logic_name) != NULL)
+		n = 0;
+	pthread_mutex_unlock(&downloads_mutex);
+
+	return n;
+}
 
-	return ret_len; 
+/**
+ * tell whether a piece of a file can be given, which is true unless
+ * the file is being downloaded and the piece is not finished, or the
+ * download of the file has failed
+ */
+bool download_has_piece(const char *logic_name, int piece_id)
+{
+	struct download_obj *obj;
+	bool has = true;
+
+	pthread_mutex_lock(&downloads_mutex);
+	obj = __download_find(logic_name);
+	if (obj != NULL) {
+		pthread_mutex_lock(&obj->mutex);
+		has = piece_id < obj->file_pieces &&
+			obj->pieces[piece_id].status == PIECE_FINISHED;
+		pthread_mutex_unlock(&obj->mutex);
+	} else if (__download_failed_find(logic_name) != NULL)
+		has = false;
+	pthread_mutex_unlock(&downloads_mutex);
+
+	return has;
 }
 
-static int connect_to_peer(uint32_t ip, uint16_t port)
+static inline int piece_length(struct download_obj *obj, int piece_id)
 {
-	struct sockaddr_in servaddr;
-	int fd = socket(AF_INET, SOCK_STREAM, 0); 
-
-	if (fd < 0) {
-		_error("socket create failed\n");
-		return -1; 
-	}   
-	bzero(&servaddr, sizeof(struct sockaddr_in));
-	servaddr.sin_family = AF_INET;
-	servaddr.sin_addr.s_addr = ip;
-	servaddr.sin_port = htons(port);
-	if (connect(fd, (struct sockaddr *) &servaddr, sizeof(servaddr)) < 0) {
-		perror("connect() error");
-		return -1; 
-	}   
-
-	return fd; 
+	int piece_len = ctr_info.piece_len;
+
+	if (piece_id == obj->file_pieces - 1)
+		return obj->file_len - piece_len * (obj->file_pieces - 1);
+	return piece_len;
 }
 
-static int get_p2p_download_port(int conn, struct download_thread_arg *targ)
+static inline bool owner_has(struct download_owner *own, int piece_id)
 {
-	struct p2p_packet pkt;
-	uint16_t port = -1;
+	return own->stream != NULL && p2p_stream_has(own->stream, piece_id);
+}
 
-	p2p_packet_init(&pkt, P2P_PORT_REQ);
-	p2p_packet_fill(&pkt, targ->obj->logic_name,
-			strlen(targ->obj->logic_name) + 1);
+/**
+ * move a piece to the list of its status, the available ones are kept
+ * in buckets by the number of owners having them and the ones asked
+ * for in the order they were first asked for
+ * You MUST lock obj->mutex before calling it
+ */
+static void __piece_set_status(struct download_obj *obj,
+			       struct piece_info *pi, int status)
+{
+	list_del(&pi->l);
+	pi->status = status;
+	if (status == PIECE_AVAILABLE)
+		list_add_tail(obj->avail + pi->have, &pi->l);
+	else if (status == PIECE_DOWNLOADNG)
+		list_add_tail(&obj->flight, &pi->l);
+}
 
-	if (send_p2p_packet(conn, &pkt) < 0) {
-		_error("p2p packet send error\n");
-		goto out;
-	}
-	if (recv_p2p_packet(conn, &pkt) < 0) {
-		_error("p2p packet recv error\n");
-		goto out;
+/**
+ * You MUST lock obj->mutex before calling it
+ */
+static void __piece_have(struct download_obj *obj, struct piece_info *pi,
+			 int n)
+{
+	pi->have += n;
+	if (pi->status == PIECE_AVAILABLE)
+		__piece_set_status(obj, pi, PIECE_AVAILABLE);
+}
+
+/**
+ * choose the next piece to ask an owner for. It is the rarest one
+ * among the owners nobody is asked for, so that a piece only a few
+ * owners have is not left to the end. The buckets are walked from the
+ * rarest, an owner with all the pieces takes the first one there.
+ * Once there is none, the pieces on the way from other owners are
+ * asked for again, the one asked for longest first, so that a slow
+ * owner can't hold up the end
+ * You MUST lock obj->mutex before calling it
+ * @return: the piece, -1 if there is nothing to ask the owner for
+ */
+static int __download_pick(struct download_obj *obj,
+			   struct download_owner *own)
+{
+	struct list_head *pos;
+	struct piece_info *pi;
+	uint32_t bit = 1U << own->idx;
+	int i, piece_id;
+
+	for (i = 1; i <= obj->owner_n; i++) {
+		list_for_each(pos, obj->avail + i) {
+			pi = list_entry(pos, struct piece_info, l);
+			piece_id = pi - obj->pieces;
+			if (owner_has(own, piece_id))
+				return piece_id;
+		}
 	}
-	if (pkt.type != P2P_PORT_RET) {
-		_error("p2p packet type is not P2P_PORT_RET\n");
-		goto out;
+
+	/* endgame */
+	list_for_each(pos, &obj->flight) {
+		pi = list_entry(pos, struct piece_info, l);
+		piece_id = pi - obj->pieces;
+		if ((pi->asked & bit) || __builtin_popcount(pi->asked) >=
+				DOWNLOAD_ENDGAME_DUPS || !owner_has(own, piece_id))
+			continue;
+		_debug("\tendgame: piece #%d asked from %u too\n",
+				piece_id, ip_string(own->ip));
+		return piece_id;
 	}
 
-	memcpy(&port, pkt.data, sizeof(uint16_t));
+	return -1;
+}
+
+/**
+ * You MUST lock obj->mutex before calling it
+ */
+static void __download_claim(struct download_obj *obj,
+			     struct download_owner *own, int piece_id)
+{
+	struct piece_info *pi = obj->pieces + piece_id;
 
-out:
-	return port;
+	if (pi->status == PIECE_AVAILABLE) {
+		pi->asked_at = now_usec();
+		__piece_set_status(obj, pi, PIECE_DOWNLOADNG);
+	}
+	pi->asked |= 1U << own->idx;
 }
 
-static int get_new_piece(struct download_obj *obj)
+/**
+ * tell whether some piece is left which no owner has, once the pieces
+ * of all the owners are known and none of them may get more
+ * You MUST lock obj->mutex before calling it
+ */
+static bool __download_stuck(struct download_obj *obj)
 {
-	int i, ret = -1;;
+	return obj->opening == 0 && obj->partial == 0 &&
+		!list_empty(obj->avail);
+}
 
-	if (obj == NULL)
-		return ret;
+/**
+ * count the pieces of an owner in, or out once it is given up
+ * You MUST lock obj->mutex before calling it
+ * @return: the number of pieces the owner has
+ */
+static int __download_owner_count(struct download_obj *obj,
+				  struct download_owner *own, int n)
+{
+	int i, has = 0;
 
-	pthread_mutex_lock(&obj->mutex);
 	for (i = 0; i < obj->file_pieces; i++) {
-		if (obj->piece_flags[i] == PIECE_AVAILABLE) {
-			ret = i;
-			obj->piece_flags[i] = PIECE_DOWNLOADNG;
-			break;
-		}
+		if (!owner_has(own, i))
+			continue;
+		__piece_have(obj, obj->pieces + i, n);
+		has++;
 	}
-	pthread_mutex_unlock(&obj->mutex);
+	pthread_cond_broadcast(&obj->cond);
 
-	return ret;
+	return has;
 }
 
-static inline void mark_piece_finished(struct download_obj *obj, int piece_id)
+/**
+ * You MUST lock obj->mutex before calling it
+ */
+static void __download_owner_settled(struct download_obj *obj,
+				     struct download_owner *own)
 {
-	pthread_mutex_lock(&obj->mutex);
-	obj->piece_flags[piece_id] = PIECE_FINISHED;
-	pthread_mutex_unlock(&obj->mutex);
+	if (!own->partial)
+		return;
+	own->partial = false;
+	obj->partial--;
+	pthread_cond_broadcast(&obj->cond);
 }
 
-static inline void mark_piece_failed(struct download_obj *obj, int piece_id)
+/**
+ * ask an owner which is downloading the file too for the pieces it
+ * has got since. One which gets none for DOWNLOAD_HAVE_TRIES times is
+ * not asked any more, so that owners waiting for each other don't
+ * keep a download which can't finish from failing
+ * You MUST lock obj->mutex before calling it, it is dropped meanwhile
+ */
+static void __download_owner_refresh(struct download_obj *obj,
+				     struct download_owner *own)
 {
-	pthread_mutex_lock(&obj->mutex);
-	obj->piece_flags[piece_id] = PIECE_AVAILABLE;
+	int before, after, ret;
+
+	/* only this thread looks at the map of the stream */
+	own->have_at = now_usec();
+	before = __download_owner_count(obj, own, -1);
 	pthread_mutex_unlock(&obj->mutex);
+	ret = p2p_stream_refresh(own->stream);
+	pthread_mutex_lock(&obj->mutex);
+	after = __download_owner_count(obj, own, 1);
+
+	if (ret < 0) {
+		own->failed = true;
+		return;
+	}
+	own->stale = after > before ? 0 : own->stale + 1;
+	if (own->stream->have == NULL || own->stale >= DOWNLOAD_HAVE_TRIES)
+		__download_owner_settled(obj, own);
+}
+
+/**
+ * hand the pieces still asked from an owner to the others
+ * You MUST lock obj->mutex before calling it
+ */
+static void __download_owner_release(struct download_obj *obj,
+				     struct download_owner *own)
+{
+	uint32_t bit = 1U << own->idx;
+	struct list_head *pos, *tmp;
+	struct piece_info *pi;
+
+	list_for_each_safe(pos, tmp, &obj->flight) {
+		pi = list_entry(pos, struct piece_info, l);
+		if (!(pi->asked & bit))
+			continue;
+		pi->asked &= ~bit;
+		if (pi->asked == 0)
+			__piece_set_status(obj, pi, PIECE_AVAILABLE);
+	}
+	pthread_cond_broadcast(&obj->cond);
+}
+
+/**
+ * wait for the pieces to change for at most a while
+ * You MUST lock obj->mutex before calling it
+ * @return: ETIMEDOUT once the while is over
+ */
+static int __download_wait(struct download_obj *obj, uint64_t usec)
+{
+	struct timespec deadline;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += usec / 1000000;
+	deadline.tv_nsec += (long)(usec % 1000000) * 1000;
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+
+	return pthread_cond_timedwait(&obj->cond, &obj->mutex, &deadline);
 }
 
 int my_read(int fd, char *buf, int len)
@@ -190,194 +440,416 @@ int my_write(int fd, char *buf, int len)
 	return n;
 }
 
-static void *piece_download_task(void *arg)
+/**
+ * write a whole buffer at an offset of a file, without moving the
+ * file position, so that threads can write pieces of the same file
+ * at once
+ * @return: bytes written
+ */
+static int my_pwrite(int fd, char *buf, int len, off_t offset)
 {
-	struct download_thread_arg *targ = arg;
-	struct p2p_packet pkt;
-	char *piece_buf;
-	int piece_len = ctr_info.piece_len;
-	struct p2p_piece_request req;
-	int file_fd;
-	int conn, download_conn;
-	uint16_t download_port;
-	long int ret = 0, ret_len;
-	int piece_id;
+	int n = 0;
+	ssize_t ret;
 
-	_enter("file = '%s', my = %u, ip = %u\n",
-			targ->obj->logic_name,
-			ip_string(my_ip), ip_string(targ->owner_ip));
+	while (n < len) {
+		ret = pwrite(fd, buf + n, len - n, offset + n);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			break;
+		n += ret;
+	}
 
-	if (targ->owner_ip == my_ip)
-		goto out;
+	return n;
+}
 
-       	conn = connect_to_peer(targ->owner_ip, targ->owner_port);
-	if (conn < 0) {
-		ret = -1;
-		goto out;
-	}
+/**
+ * reserve the blocks of the whole file up front, so that it is laid
+ * out in few extents instead of growing with every piece
+ */
+static void file_preallocate(int fd, int len)
+{
+	if (len <= 0)
+		return;
 
-	download_port = get_p2p_download_port(conn, targ);
-	if (download_port < 0) {
-		_error("get download port failed\n");
-		ret = -1;
-		goto close_conn;
-	}
+	if (fallocate(fd, 0, 0, len) == 0)
+		return;
+	/* at least set the size, the pieces fill it in then */
+	if (errno != EOPNOTSUPP && errno != ENOSYS)
+		perror("fallocate error");
+	if (ftruncate(fd, len) < 0)
+		perror("ftruncate error");
+}
 
-	_debug("\tdownload port = %u, from %u\n",
-			download_port, ip_string(targ->owner_ip));
+/**
+ * write an answered piece into the file, called by the reader of the
+ * link the piece comes from. The late answers to the pieces asked
+ * from more than one owner are dropped
+ * @buf: the piece, NULL if the owner failed to read it
+ */
+static int piece_write(struct p2p_stream *s, int piece_id, char *buf, int len)
+{
+	struct download_owner *own = s->arg;
+	struct download_obj *obj = own->obj;
+	struct piece_info *pi;
+	bool finished;
 
-	download_conn = connect_to_peer(targ->owner_ip, download_port);
-	if (download_conn < 0) {
-		ret = -1;
-		goto out;
-	}
+	if (piece_id < 0 || piece_id >= obj->file_pieces)
+		return -1;
+	pi = obj->pieces + piece_id;
 
-	piece_buf = calloc(1, piece_len);
-	if (piece_buf == NULL) {
-		_error("piece buf alloc failed\n");
-		ret = -1;
-		goto close_download_conn;
-	}
+	pthread_mutex_lock(&obj->mutex);
+	finished = pi->status == PIECE_FINISHED;
+	pthread_mutex_unlock(&obj->mutex);
+
+	if (buf != NULL && len != piece_length(obj, piece_id))
+		buf = NULL;
+	if (buf != NULL && !finished && my_pwrite(obj->fd, buf, len,
+			(off_t)piece_id * ctr_info.piece_len) != len)
+		buf = NULL;
 
-	file_fd = open(targ->obj->sys_name, O_RDWR);
-	if (file_fd < 0) {
-		_error("file open failed for '%s'\n", targ->obj->sys_name);
-		ret = -1;
-		goto free_piece_buf;
+	pthread_mutex_lock(&obj->mutex);
+	pi->asked &= ~(1U << own->idx);
+	if (buf == NULL) {
+		_error("piece #%d failed for '%s' from %u\n",
+				piece_id, obj->logic_name, ip_string(own->ip));
+		own->failed = true;
+		if (pi->status == PIECE_DOWNLOADNG && pi->asked == 0)
+			__piece_set_status(obj, pi, PIECE_AVAILABLE);
+	} else if (pi->status != PIECE_FINISHED) {
+		__piece_set_status(obj, pi, PIECE_FINISHED);
+		obj->left--;
+		own->bytes += len;
 	}
+	pthread_cond_broadcast(&obj->cond);
+	pthread_mutex_unlock(&obj->mutex);
 
-	p2p_packet_init(&pkt, P2P_PIECE_REQ);
-	while ((piece_id = get_new_piece(targ->obj)) >= 0) {
-		req.len = piece_len;
-		if (piece_id == targ->obj->file_pieces - 1)
-			req.len = targ->obj->file_len - piece_len *
-				(targ->obj->file_pieces - 1);
-		req.piece_id = piece_id;
+	return buf == NULL ? -1 : 0;
+}
 
-		_debug("\tdownload piece #%d, len = %d, peer = %u\n",
-				piece_id, req.len, ip_string(targ->owner_ip));
+/**
+ * open a stream of the file being downloaded on the link to an owner
+ */
+static struct p2p_stream *download_stream_open(struct download_owner *own)
+{
+	struct p2p_stream *s;
+	struct p2p_link *link;
 
-		p2p_packet_fill(&pkt, &req, sizeof(req));
-		if (send_p2p_packet(download_conn, &pkt) < 0) {
-			_error("piece req send failed for #%d\n", piece_id);
-			mark_piece_failed(targ->obj, piece_id);
-			ret = -1;
-			break;
-		}
+	link = p2p_link_get(own->ip, own->port);
+	if (link == NULL)
+		return NULL;
+	s = p2p_stream_open(link, own->obj->logic_name, piece_write, own);
+	p2p_link_put(link);
 
-		if ((ret_len = my_read(download_conn, piece_buf, req.len))
-				!= req.len) {
-			_error("download failed for '%s'\n",
-					targ->obj->logic_name);
-			mark_piece_failed(targ->obj, piece_id);
-			ret = -1;
-			break;
-		}
+	return s;
+}
 
-		_debug("\t\tread len = %ld, peer = %u\n",
-				ret_len, ip_string(targ->owner_ip));
+/**
+ * download pieces from an owner until the file is finished. Pieces
+ * are asked for as long as the window of the link has room, so that
+ * a faster owner is asked for more of them
+ * @return: -1 if the owner failed, 0 otherwise
+ */
+static int download_from_owner(struct download_owner *own)
+{
+	struct download_obj *obj = own->obj;
+	struct p2p_stream *s = own->stream;
+	uint64_t now;
+	int piece_id, ret;
 
-		flock(file_fd, LOCK_EX);
-		lseek(file_fd, piece_id * piece_len, SEEK_SET);
-		ret_len = my_write(file_fd, piece_buf, ret_len);
-		flock(file_fd, LOCK_UN);
+	_enter("file = '%s', my = %u, ip = %u\n",
+			obj->logic_name,
+			ip_string(my_ip), ip_string(own->ip));
 
-		mark_piece_finished(targ->obj, piece_id);
+	if (s == NULL && !own->failed)
+		s = download_stream_open(own);
+
+	pthread_mutex_lock(&obj->mutex);
+	own->stream = s;
+	if (s == NULL)
+		own->failed = true;
+	/* an owner downloading the file too is asked for its pieces
+	   again while it has nothing new to give */
+	if (s != NULL && s->have != NULL) {
+		own->partial = true;
+		own->have_at = now_usec();
+		obj->partial++;
 	}
+	__download_owner_count(obj, own, 1);
+	obj->opening--;
+
+	while (obj->left > 0 && !own->failed) {
+		piece_id = __download_pick(obj, own);
+		if (piece_id < 0) {
+			if (__download_stuck(obj))
+				break;
+			now = now_usec();
+			if (!own->partial)
+				pthread_cond_wait(&obj->cond, &obj->mutex);
+			else if (now < own->have_at + DOWNLOAD_HAVE_INTERVAL)
+				__download_wait(obj, own->have_at +
+						DOWNLOAD_HAVE_INTERVAL - now);
+			else
+				__download_owner_refresh(obj, own);
+			continue;
+		}
+		__download_claim(obj, own, piece_id);
+		pthread_mutex_unlock(&obj->mutex);
+
+		_debug("\tdownload piece #%d, len = %d, peer = %u\n",
+				piece_id, piece_length(obj, piece_id),
+				ip_string(own->ip));
+
+		ret = p2p_stream_request(s, piece_id,
+					 piece_length(obj, piece_id));
+		pthread_mutex_lock(&obj->mutex);
+		if (ret < 0)
+			own->failed = true;
+	}
+
+	/* no answer comes after the stream is closed */
+	__download_owner_settled(obj, own);
+	__download_owner_count(obj, own, -1);
+	pthread_mutex_unlock(&obj->mutex);
+	if (s != NULL)
+		p2p_stream_close(s);
+	pthread_mutex_lock(&obj->mutex);
+	own->stream = NULL;
+	__download_owner_release(obj, own);
+	ret = own->failed ? -1 : 0;
+	pthread_mutex_unlock(&obj->mutex);
+
+	_leave("onwer #%u, %lu bytes", ip_string(own->ip),
+			(unsigned long)own->bytes);
+	return ret;
+}
+
+/**
+ * put the next spare owner in the place of an owner given up
+ * You MUST lock obj->mutex before calling it
+ * @return: true if there was a spare
+ */
+static bool __download_owner_spare(struct download_obj *obj,
+				   struct download_owner *own)
+{
+	if (obj->spare_n == 0)
+		return false;
+
+	own->ip = obj->spares->ip;
+	own->port = obj->spares->port;
+	obj->spares++;
+	obj->spare_n--;
+	own->stream = NULL;
+	own->failed = own->ip == my_ip;
+	own->partial = false;
+	own->stale = 0;
+	own->bytes = 0;
+
+	return true;
+}
+
+/**
+ * go on with a spare owner once the one before failed, or has nothing
+ * more to give while some pieces are still missing
+ * You MUST lock obj->mutex before calling it
+ * @return: true if the place is taken by a spare
+ */
+static bool __download_owner_next(struct download_obj *obj,
+				  struct download_owner *own)
+{
+	if (obj->left == 0 || !__download_owner_spare(obj, own))
+		return false;
+	/* its pieces are not known until its stream is open */
+	obj->opening++;
+
+	return true;
+}
+
+/**
+ * download from the owner of a place, and from the spares which take
+ * it over one after another
+ * @arg: the owner
+ */
+static void *piece_download_task(void *arg)
+{
+	struct download_owner *own = arg;
+	struct download_obj *obj = own->obj;
+	long int ret;
+	bool next;
+
+	do {
+		ret = download_from_owner(own);
+		pthread_mutex_lock(&obj->mutex);
+		next = __download_owner_next(obj, own);
+		pthread_mutex_unlock(&obj->mutex);
+	} while (next);
 
-	close(file_fd);
-free_piece_buf:
-	free(piece_buf);
-close_download_conn:
-	close(download_conn);
-close_conn:
-	close(conn);
-out:
-	_leave("onwer #%u", ip_string(targ->owner_ip));
-	free(targ);
 	pthread_exit((void *)ret);
 }
 
-int do_download(struct file_entry *fe, char *sys_name)
+/**
+ * download a file from its owners
+ * @started: called once the pieces are known, they are given to other
+ *           peers as they come from then on
+ * @return: 0 if the whole file is downloaded, -1 otherwise
+ */
+int do_download(struct file_entry *fe, char *sys_name,
+		void (*started)(struct file_entry *fe))
 {
 	struct download_obj obj;
-	struct peer_id_list *a_owner;
-	struct list_head *pos;
+	struct download_owner *own;
+	struct peer_id *owners;
+	struct p2p_stream *s = NULL;
+	bool running[DOWNLOAD_MAX_OWNERS] = { false };
+	struct piece_info *pieces;
+	char name[MAX_NAME_LEN];
 	int piece_len = ctr_info.piece_len;
-	int fd;
-	int i, n, owner_n = 0;
+	int i, n, first, owner_n = 0;
 	long int ret = -1;
 
-	_enter("%s", fe->name);
+	/* _enter() evaluates its arguments only with debug on */
+	file_entry_name(fe, name);
+	_enter("%s", name);
 
-	fd = open(sys_name, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
-	if (fd < 0) {
+	download_obj_init(&obj, name, sys_name);
+	obj.fd = -1;
+	owners = file_entry_owners(fe, &owner_n);
+	if (owner_n == 0) {
+		_error("No owner for '%s'\n", name);
+		goto free_owners;
+	}
+	/* the asked bits limit the owners asked at once, the others wait
+	   to take the place of those which fail */
+	if (owner_n > DOWNLOAD_MAX_OWNERS) {
+		_debug("'%s' has %d owners, %d of them are spares\n", name,
+				owner_n, owner_n - DOWNLOAD_MAX_OWNERS);
+		obj.spares = owners + DOWNLOAD_MAX_OWNERS;
+		obj.spare_n = owner_n - DOWNLOAD_MAX_OWNERS;
+		owner_n = DOWNLOAD_MAX_OWNERS;
+	}
+
+	/* published before the file is truncated, so that no piece of
+	   it is served until it is written again */
+	download_publish(&obj);
+
+	obj.fd = open(sys_name, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+	if (obj.fd < 0) {
 		_error("open '%s' failed\n", sys_name);
-		goto out;
+		goto unpublish;
+	}
+
+	obj.owners = calloc(owner_n, sizeof(struct download_owner));
+	if (obj.owners == NULL) {
+		_error("download owners alloc failed\n");
+		goto unpublish;
+	}
+	for (i = 0; i < owner_n; i++) {
+		own = obj.owners + i;
+		own->obj = &obj;
+		own->idx = i;
+		own->ip = owners[i].ip;
+		own->port = owners[i].port;
+		own->failed = own->ip == my_ip;
 	}
-	close(fd);
 
-	if (list_empty(&fe->owner_head)) {
-		_error("No owner for '%s'\n", fe->name);
-		goto out;
+	/* the length comes from the first owner which opens a stream of
+	   the file */
+	for (first = 0; first < owner_n; first++) {
+		own = obj.owners + first;
+		if (!own->failed) {
+			s = download_stream_open(own);
+			if (s != NULL && s->file_len >= 0)
+				break;
+			if (s != NULL)
+				p2p_stream_close(s);
+			s = NULL;
+			own->failed = true;
+		}
+		/* a spare takes the place before the next one is tried */
+		pthread_mutex_lock(&obj.mutex);
+		if (__download_owner_spare(&obj, own))
+			first--;
+		pthread_mutex_unlock(&obj.mutex);
 	}
-	pthread_rwlock_rdlock(&fe->rwlock);
-	a_owner = list_entry(fe->owner_head.next, struct peer_id_list, l);
-	list_for_each(pos, &fe->owner_head)
-		owner_n++;
-	pthread_rwlock_unlock(&fe->rwlock);
-	
-	/* init download object */
-	download_obj_init(&obj, fe->name, sys_name);
-	obj.file_len = get_file_len_from(fe->name, a_owner->ip, a_owner->port);
-	obj.file_pieces = (obj.file_len + piece_len - 1) / piece_len;
-	obj.piece_flags = calloc(obj.file_pieces, sizeof(int));
-	if (obj.piece_flags == NULL) {
-		_error("obj piece flags alloc failed\n");
-		goto out;
+	if (s == NULL) {
+		_error("No owner serves '%s'\n", name);
+		goto unpublish;
 	}
+	obj.owners[first].stream = s;
+	file_preallocate(obj.fd, s->file_len);
+	n = (s->file_len + piece_len - 1) / piece_len;
+	pieces = calloc(n, sizeof(struct piece_info));
+	if (pieces == NULL) {
+		_error("obj pieces alloc failed\n");
+		p2p_stream_close(s);
+		goto unpublish;
+	}
+	obj.avail = malloc((owner_n + 1) * sizeof(struct list_head));
 	obj.tids = calloc(owner_n, sizeof(pthread_t));
-	if (obj.tids == NULL) {
+	if (obj.avail == NULL || obj.tids == NULL) {
 		_error("obj tids alloc failed\n");
-		goto free_piece_flags;
+		free(pieces);
+		p2p_stream_close(s);
+		goto unpublish;
 	}
-
-	/* assign download task to different threads */
-	n = 0;
-	pthread_rwlock_rdlock(&fe->rwlock);
-	list_for_each(pos, &fe->owner_head) {
-		struct download_thread_arg *targ = calloc(1, sizeof(*targ));
-		a_owner = list_entry(pos, struct peer_id_list, l);
-
-		if (targ == NULL) {
-			_error("download targ alloc failed\n");
-			goto wait_tasks;
+	for (i = 0; i <= owner_n; i++)
+		INIT_LIST_HEAD(obj.avail + i);
+	/* nobody has any piece until the owners are counted in */
+	for (i = 0; i < n; i++)
+		list_add_tail(obj.avail, &pieces[i].l);
+
+	/* the uploaders see the pieces from now on */
+	pthread_mutex_lock(&obj.mutex);
+	obj.file_len = s->file_len;
+	obj.file_pieces = n;
+	obj.pieces = pieces;
+	obj.left = n;
+	obj.owner_n = owner_n;
+	obj.opening = owner_n;
+	pthread_mutex_unlock(&obj.mutex);
+
+	/* the other peers may download the finished pieces from here */
+	if (started != NULL)
+		started(fe);
+
+	/* a thread for every owner, they share out the pieces */
+	for (i = 0; i < owner_n; i++) {
+		if (pthread_create(obj.tids + i, NULL, piece_download_task,
+				   obj.owners + i) == 0) {
+			running[i] = true;
+			continue;
 		}
-		targ->obj = &obj;
-		targ->owner_ip = a_owner->ip;
-		targ->owner_port = a_owner->port;
-
-		pthread_create(obj.tids + n, NULL, piece_download_task, targ);
-		n++;
+		_error("download task create failed\n");
+		if (i == first)
+			p2p_stream_close(s);
+		pthread_mutex_lock(&obj.mutex);
+		obj.opening--;
+		pthread_cond_broadcast(&obj.cond);
+		pthread_mutex_unlock(&obj.mutex);
 	}
-	pthread_rwlock_unlock(&fe->rwlock);
 
-wait_tasks:
-	for (i = 0; i < n; i++) {
-		void *status;
-		pthread_join(obj.tids[i], &status);
-		ret = (int *)status && ret;
-	}
+	for (i = 0; i < owner_n; i++)
+		if (running[i])
+			pthread_join(obj.tids[i], NULL);
 
+	ret = obj.left == 0 ? 0 : -1;
 	if (ret == 0)
-		_debug("{ Download OK! } '%s'\n", fe->name);
+		_debug("{ Download OK! } '%s'\n", name);
 	else
-		_debug("{ Download ERROR! } '%s'\n", fe->name);
-
+		_debug("{ Download ERROR! } '%s'\n", name);
 
+unpublish:
+	/* a truncated file is not given to anybody */
+	download_unpublish(&obj, ret < 0 && obj.fd >= 0);
 	free(obj.tids);
-free_piece_flags:
-	free(obj.piece_flags);
-out:
+	free(obj.avail);
+	free(obj.pieces);
+	free(obj.owners);
+	if (obj.fd >= 0)
+		close(obj.fd);
+free_owners:
+	free(owners);
+	pthread_cond_destroy(&obj.cond);
+	pthread_mutex_destroy(&obj.mutex);
 	return ret;
 }
@@ -2,7 +2,16 @@
 #define CLIENT_DOWNLOAD_H
 
 #include <stdint.h>
+#include <stdbool.h>
 #include <file_table.h>
+#include <list.h>
+
+#define DOWNLOAD_MAX_OWNERS	32	/* bits of piece_info.asked */
+#define DOWNLOAD_ENDGAME_DUPS	2	/* owners a piece is asked from at most */
+#define DOWNLOAD_HAVE_INTERVAL	500000	/* micro sec between map refreshes */
+#define DOWNLOAD_HAVE_TRIES	20	/* refreshes with no new piece */
+
+struct p2p_stream;
 
 enum piece_status {
 	PIECE_AVAILABLE,
@@ -10,23 +19,58 @@ enum piece_status {
 	PIECE_FINISHED
 };
 
+struct piece_info {
+	struct list_head l;	/* in obj->avail[have] or obj->flight */
+	int status;
+	int have;		/* owners which have the piece */
+	uint32_t asked;		/* owners it is asked from, by index */
+	uint64_t asked_at;	/* micro sec, when it was asked for first */
+};
+
+struct download_obj;
+
+/* an owner a file is downloaded from, by a thread of its own */
+struct download_owner {
+	struct download_obj *obj;
+	int idx;
+	uint32_t ip;
+	uint16_t port;
+	struct p2p_stream *stream;	/* opened already, or NULL */
+	bool failed;		/* it failed to give a piece */
+	bool partial;		/* it is downloading the file too */
+	int stale;		/* refreshes of its map with no new piece */
+	uint64_t have_at;	/* micro sec, when its map was asked for */
+	uint64_t bytes;		/* of the pieces taken from it */
+};
+
 struct download_obj {
+	struct list_head l;	/* in the downloads going on */
 	char logic_name[MAX_NAME_LEN];
 	char sys_name[MAX_NAME_LEN];
+	int fd;			/* shared by the download threads */
 	int file_len;
 	int file_pieces;
-	int *piece_flags;
+	int left;		/* pieces not finished */
+	int opening;		/* owners whose pieces are not known yet */
+	int partial;		/* owners whose pieces may still grow */
+	struct piece_info *pieces;
+	struct list_head *avail;	/* available pieces by owners having
+					   them, [0, owner_n] */
+	struct list_head flight;	/* pieces asked for, oldest first */
+	struct download_owner *owners;
+	int owner_n;
+	struct peer_id *spares;	/* owners past DOWNLOAD_MAX_OWNERS, which
+				   take the place of failed ones */
+	int spare_n;
 	pthread_t *tids;
 	pthread_mutex_t mutex;
+	pthread_cond_t cond;	/* pieces finished, failed or known */
 };
 
-struct download_thread_arg {
-	struct download_obj *obj;
-	uint32_t owner_ip;
-	uint16_t owner_port;
-};
-
-int do_download(struct file_entry *fe, char *sys_name);
+int do_download(struct file_entry *fe, char *sys_name,
+		void (*started)(struct file_entry *fe));
+int download_piece_map(const char *logic_name, uint8_t *map, int max);
+bool download_has_piece(const char *logic_name, int piece_id);
 int my_read(int fd, char *buf, int len);
 int my_write(int fd, char *buf, int len);
 
@@ -27,9 +27,23 @@ extern uint32_t my_ip;
 extern struct file_table ft;
 
 static struct monitor_table m_table;
-static struct ptot_packet pkt;
-static struct trans_file_table tft;
+static struct ptot_stream update_stream;
 
+/**
+ * join a directory and a file name into a MAX_NAME_LEN buffer
+ * @return: 0, or -1 if the path does not fit; it is refused rather
+ *          than cut into the name of some other file
+ */
+static int name_join(char *buf, const char *dir, const char *name)
+{
+	if (snprintf(buf, MAX_NAME_LEN, "%s/%s", dir, name) >= MAX_NAME_LEN) {
+		_error("'%s/%s' is longer than %d bytes, skipped\n",
+				dir, name, MAX_NAME_LEN - 1);
+		return -1;
+	}
+
+	return 0;
+}
 
 inline static int get_trans_timestamp(struct trans_file_entry *te, char *name)
 {
@@ -150,11 +164,12 @@ static int watch_target_add_dir(struct monitor_table *table,
 		if (d->d_type == DT_DIR) {
 			char new_dir[MAX_NAME_LEN];
 			char new_local_dir[MAX_NAME_LEN];
-			sprintf(new_dir, "%s/%s", dir, d->d_name);
-			sprintf(new_local_dir, "%s/%s", local_dir, d->d_name);
 			if (strcmp(d->d_name, ".") == 0 ||
 					strcmp(d->d_name, "..") == 0)
 				continue;
+			if (name_join(new_dir, dir, d->d_name) < 0 ||
+			    name_join(new_local_dir, local_dir, d->d_name) < 0)
+				continue;
 			ret = watch_target_add_dir(table, new_dir, new_local_dir)
 				|| ret;
 		}
@@ -244,7 +259,7 @@ static int handle_event(struct inotify_event *event,
 	/* update the file table */
 	switch (te->op_type) {
 	case FILE_ADD:
-		file_table_add(&ft, te);
+		file_entry_put(file_table_add(&ft, te));
 		break;
 	case FILE_MODIFY:
 		file_table_update(&ft, te);
@@ -280,20 +295,6 @@ static void print_tft()
 }
 */
 
-static int add_me_to_peer_id_list(struct list_head *head)
-{
-	struct peer_id_list *p = calloc(1, sizeof(struct peer_id_list));
-	if (p == NULL) {
-		_error("peer id list alloc failed\n");
-		return -1;
-	}
-	p->ip = my_ip;
-	p->port = P2P_PORT;
-	INIT_LIST_ELM(&p->l);
-	list_add(head, &p->l);
-	return 0;
-}
-
 static int get_file_table_r(struct file_table *ft,
 			    char *sys_name,
 			    char *logic_name)
@@ -308,31 +309,42 @@ static int get_file_table_r(struct file_table *ft,
 	}
 
 	while ((d = readdir(root)) != NULL) {
-		char new_sys_name[MAX_NAME_LEN];
-		struct file_entry *fe = file_entry_alloc();
+		char new_sys_name[MAX_NAME_LEN], new_logic_name[MAX_NAME_LEN];
+		struct file_entry *fe;
+
+		if (strcmp(d->d_name, ".") == 0 ||
+				strcmp(d->d_name, "..") == 0)
+			continue;
+		/* a path too long is left out, not cut into another name */
+		if (name_join(new_logic_name, logic_name, d->d_name) < 0 ||
+		    name_join(new_sys_name, sys_name, d->d_name) < 0) {
+			ret = -1;
+			continue;
+		}
+
+		fe = file_entry_alloc(ft);
 		if (fe == NULL) {
 			_error("file entry alloc failed\n");
+			closedir(root);
 			return -1;
 		}
 
-		if (strcmp(d->d_name, ".") != 0 &&
-				strcmp(d->d_name, "..") != 0) {
-			sprintf(fe->name, "%s/%s", logic_name, d->d_name);
-			sprintf(new_sys_name, "%s/%s", sys_name, d->d_name);
-			get_file_timestamp(fe, new_sys_name);
-			add_me_to_peer_id_list(&fe->owner_head);
-			file_entry_add(ft, fe);
+		/* the type is in the digest of the entry when it is added */
+		fe->type = d->d_type == DT_DIR ? DIRECTORY : REGULAR;
+		if (file_entry_set_name(fe, new_logic_name) < 0) {
+			file_entry_put(fe);
+			ret = -1;
+			continue;
 		}
+		get_file_timestamp(fe, new_sys_name);
+		file_entry_add_owner(fe, my_ip, P2P_PORT);
+		file_entry_add(ft, fe);
 
-		if (d->d_type == DT_DIR) {
-			fe->type = DIRECTORY;
-			if (strcmp(d->d_name, ".") == 0 ||
-					strcmp(d->d_name, "..") == 0)
-				continue;
-			ret = get_file_table_r(ft, new_sys_name, fe->name) || ret;
-		} else
-			fe->type = REGULAR;
+		if (d->d_type == DT_DIR)
+			ret = get_file_table_r(ft, new_sys_name,
+					new_logic_name) || ret;
 	}
+	closedir(root);
 
 	return ret;
 }
@@ -460,8 +472,12 @@ struct monitor_target *file_monitor_block(char *logic_name, bool del)
 			first_i != NULL;
 			p = first_i + 1, first_i = index(first_i + 1, '/')) {
 		*first_i = '\0';
-		sprintf(sys_dir, "%s/%s", t->sys_name, p);
-		sprintf(logic_dir, "%s/%s", t->logic_name, p);
+		if (name_join(sys_dir, t->sys_name, p) < 0 ||
+		    name_join(logic_dir, t->logic_name, p) < 0) {
+			*first_i = '/';
+			t = NULL;
+			break;
+		}
 
 		__file_monitor_block(t);
 		mkdir(sys_dir, S_IRWXU);
@@ -471,6 +487,8 @@ struct monitor_target *file_monitor_block(char *logic_name, bool del)
 		*first_i = '/';
 	}
 	pthread_mutex_unlock(&m_table.mutex);
+	if (t == NULL)
+		goto leave_return;
 
 out:
 	pthread_mutex_lock(&t->mutex);
@@ -523,7 +541,12 @@ char *get_sys_name(char *logic_name)
 		goto out;	
 	}
 
-	sprintf(sys_name, "%s%s", target->sys_name, file);
+	if (snprintf(sys_name, MAX_NAME_LEN, "%s%s", target->sys_name,
+		     file) >= MAX_NAME_LEN) {
+		_error("sys name of '%s' is too long\n", logic_name);
+		free(sys_name);
+		sys_name = NULL;
+	}
 out:
 	return sys_name;
 }
@@ -549,7 +572,12 @@ char *monitor_get_sys_name(char *logic_name, struct monitor_target *target)
 		return NULL;
 	}
 
-	sprintf(sys_name, "%s%s", target->sys_name, file);
+	if (snprintf(sys_name, MAX_NAME_LEN, "%s%s", target->sys_name,
+		     file) >= MAX_NAME_LEN) {
+		_error("sys name of '%s' is too long\n", logic_name);
+		free(sys_name);
+		sys_name = NULL;
+	}
 
 	return sys_name;
 }
@@ -652,42 +680,38 @@ void *file_monitor_task(void *arg)
 	pthread_wait_notify(&targ->wait, THREAD_RUNNING);
 	pthread_cleanup_push(file_monitor_cleanup, NULL);
 
-	bzero(&tft, sizeof(struct trans_file_table));
 	while (1) {
 		usleep(1000);
 		len = read(m_table.fd, event_buf, EVENT_BUF_LEN);
-		bzero(&tft, sizeof(tft));
-		
-		for (offset = 0;
-		     offset < len && tft.n < MAX_FILE_ENTRIES;
-		     offset += EVENT_LEN + event->len, tft.n++) {
+		ptot_stream_init(&update_stream, conn, PEER_FILE_UPDATE);
+
+		for (offset = 0; offset < len;
+		     offset += EVENT_LEN + event->len) {
 			char *sys_dir, *logic_dir, new_name[MAX_NAME_LEN];
-			struct trans_file_entry *te= tft.entries + tft.n;
+			struct trans_file_entry te;
 
 			event = (struct inotify_event *)(event_buf + offset);
-			if (m_table.targets[event->wd] == NULL) {
-				tft.n--;
+			if (m_table.targets[event->wd] == NULL)
 				continue;
-			}
+			bzero(&te, sizeof(te));
 			logic_dir = m_table.targets[event->wd]->logic_name;
 			sys_dir = m_table.targets[event->wd]->sys_name;
 			if (event->len) {
-				sprintf(te->name, "%s/%s",
-						logic_dir, event->name);
-				sprintf(new_name, "%s/%s",
-						sys_dir, event->name);
+				if (name_join(te.name, logic_dir,
+					      event->name) < 0 ||
+				    name_join(new_name, sys_dir,
+					      event->name) < 0)
+					continue;
 			} else {
-				strcpy(te->name, logic_dir);
+				strcpy(te.name, logic_dir);
 				strcpy(new_name, event->name);
 			}
 
-			if (handle_event(event, te, new_name) != 0)
-				tft.n--;
+			if (handle_event(event, &te, new_name) == 0)
+				trans_stream_add(&update_stream.ts, &te);
 		}
 
-		ptot_packet_init(&pkt, PEER_FILE_UPDATE);
-		ptot_packet_fill(&pkt, &tft, trans_table_len(&tft));
-		send_ptot_packet(conn, &pkt);
+		trans_stream_finish(&update_stream.ts);
 	}
 
 	pthread_cleanup_pop(0);
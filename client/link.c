@@ -0,0 +1,691 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <debug.h>
+#include <hash.h>
+#include <packet_def.h>
+#include <utility/segment.h>
+#include "packet.h"
+#include "link.h"
+
+extern struct ttop_control_info ctr_info;
+
+/* links by the ip of the owner, which also protects the references */
+static DEFINE_HASHTABLE(links, P2P_LINK_BITS);
+static pthread_mutex_t links_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static inline uint64_t now_usec()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int connect_to_peer(uint32_t ip, uint16_t port)
+{
+	struct sockaddr_in servaddr;
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+	if (fd < 0) {
+		_error("socket create failed\n");
+		return -1;
+	}
+	bzero(&servaddr, sizeof(struct sockaddr_in));
+	servaddr.sin_family = AF_INET;
+	servaddr.sin_addr.s_addr = ip;
+	servaddr.sin_port = htons(port);
+	if (connect(fd, (struct sockaddr *) &servaddr, sizeof(servaddr)) < 0) {
+		perror("connect() error");
+		close(fd);
+		return -1;
+	}
+	segment_set_role(fd, SEGMENT_CONTROL);
+	segment_set_mode(fd, SEGMENT_FRAMED);
+
+	return fd;
+}
+
+static struct p2p_link *p2p_link_alloc(uint32_t ip, uint16_t port, int conn)
+{
+	struct p2p_link *link = calloc(1, sizeof(struct p2p_link));
+
+	if (link == NULL) {
+		_error("p2p link alloc failed\n");
+		return NULL;
+	}
+	link->buf = malloc(ctr_info.piece_len);
+	if (link->buf == NULL) {
+		_error("p2p link buf alloc failed\n");
+		free(link);
+		return NULL;
+	}
+	INIT_HLIST_NODE(&link->hlist);
+	link->ip = ip;
+	link->port = port;
+	link->conn = conn;
+	INIT_LIST_HEAD(&link->streams);
+	link->window = P2P_WINDOW_INIT;
+	pthread_cond_init(&link->cond, NULL);
+	pthread_mutex_init(&link->mutex, NULL);
+
+	return link;
+}
+
+static void p2p_link_free(struct p2p_link *link)
+{
+	segment_conn_close(link->conn);
+	close(link->conn);
+	pthread_cond_destroy(&link->cond);
+	pthread_mutex_destroy(&link->mutex);
+	free(link->buf);
+	free(link);
+}
+
+void p2p_link_put(struct p2p_link *link)
+{
+	int ref;
+
+	if (link == NULL)
+		return;
+
+	pthread_mutex_lock(&links_mutex);
+	ref = --link->ref;
+	pthread_mutex_unlock(&links_mutex);
+
+	if (ref == 0)
+		p2p_link_free(link);
+}
+
+/**
+ * You MUST lock links_mutex before calling it
+ */
+static struct p2p_link *__p2p_link_find(uint32_t ip, uint16_t port)
+{
+	struct p2p_link *link;
+
+	hash_for_each_possible(links, link, hlist, ip)
+		if (link->ip == ip && link->port == port)
+			return link;
+
+	return NULL;
+}
+
+/**
+ * unhash a broken link and fail the piece requests of its streams, the
+ * later downloads from the owner connect again
+ */
+static void p2p_link_kill(struct p2p_link *link)
+{
+	struct p2p_inflight reqs[P2P_WINDOW_MAX];
+	struct list_head *pos;
+	struct p2p_stream *s;
+	bool hashed;
+	int i, n;
+
+	pthread_mutex_lock(&links_mutex);
+	pthread_mutex_lock(&link->mutex);
+	hashed = !link->dead;
+	if (hashed) {
+		link->dead = true;
+		hash_del(&link->hlist);
+	}
+	pthread_mutex_unlock(&links_mutex);
+	pthread_cond_broadcast(&link->cond);
+
+	/* no request is sent on a dead link, so the streams run out of
+	   them. Each is failed outside the lock, as the answers are */
+	while (1) {
+		s = NULL;
+		list_for_each(pos, &link->streams) {
+			struct p2p_stream *tmp =
+				list_entry(pos, struct p2p_stream, l);
+			tmp->failed = true;
+			pthread_cond_broadcast(&tmp->cond);
+			if (tmp->inflight > 0 && s == NULL)
+				s = tmp;
+		}
+		if (s == NULL)
+			break;
+		n = s->inflight;
+		memcpy(reqs, s->reqs, n * sizeof(reqs[0]));
+		link->inflight -= n;
+		s->inflight = 0;
+		s->calls++;
+		pthread_mutex_unlock(&link->mutex);
+
+		for (i = 0; i < n; i++)
+			s->piece_fn(s, reqs[i].piece_id, NULL, 0);
+
+		pthread_mutex_lock(&link->mutex);
+		s->calls--;
+	}
+	pthread_cond_broadcast(&link->cond);
+	pthread_mutex_unlock(&link->mutex);
+
+	/* the reference of the hash */
+	if (hashed)
+		p2p_link_put(link);
+}
+
+/**
+ * You MUST lock link->mutex before calling it
+ */
+static struct p2p_stream *__p2p_stream_find(struct p2p_link *link,
+					    uint32_t id)
+{
+	struct list_head *pos;
+
+	list_for_each(pos, &link->streams) {
+		struct p2p_stream *s = list_entry(pos, struct p2p_stream, l);
+		if (s->id == id)
+			return s;
+	}
+
+	return NULL;
+}
+
+/**
+ * take a piece request of a stream off the ones in flight
+ * You MUST lock link->mutex before calling it
+ * @return: when the request was sent, 0 if it is not in flight
+ */
+static uint64_t __p2p_inflight_del(struct p2p_stream *s, uint32_t piece_id)
+{
+	uint64_t sent_at;
+	int i;
+
+	for (i = 0; i < s->inflight; i++)
+		if (s->reqs[i].piece_id == piece_id)
+			break;
+	if (i == s->inflight)
+		return 0;
+
+	sent_at = s->reqs[i].sent_at;
+	s->reqs[i] = s->reqs[--s->inflight];
+	s->link->inflight--;
+
+	return sent_at;
+}
+
+/**
+ * size the window of a link to the pieces the link can carry in a
+ * round trip, with the round trip taken as the fastest recent answer
+ * and the bandwidth measured from the pieces arriving back to back
+ * You MUST lock link->mutex before calling it
+ * @sent_at: when the answered piece was asked for
+ */
+static void __p2p_link_sample(struct p2p_link *link, uint64_t sent_at,
+			      int len)
+{
+	uint64_t now = now_usec(), rtt = now - sent_at;
+	uint64_t start, rate, bdp;
+	int window;
+
+	if (link->min_rtt == 0 || rtt <= link->min_rtt ||
+			now - link->min_rtt_at > P2P_RTT_EXPIRE) {
+		link->min_rtt = rtt;
+		link->min_rtt_at = now;
+	}
+
+	/* the piece has been on the way since it was asked for, or since
+	   the one before it arrived if the link was busy */
+	start = max(sent_at, link->last_at);
+	link->last_at = now;
+	if (now > start) {
+		rate = (uint64_t)len * 1000000 / (now - start);
+		link->bw = link->bw ? (link->bw * 7 + rate) / 8 : rate;
+	}
+
+	/* one more than the link holds, to keep the owner busy while
+	   the next request is on the way */
+	bdp = link->bw * link->min_rtt / 1000000;
+	window = bdp / ctr_info.piece_len + 1;
+	window = min(max(window, P2P_WINDOW_MIN), P2P_WINDOW_MAX);
+	if (window != link->window)
+		_debug("p2p link to %u: window %d, rtt %lu us, %lu KB/s\n",
+				ip_string(link->ip), window,
+				(unsigned long)link->min_rtt,
+				(unsigned long)(link->bw >> 10));
+	link->window = window;
+}
+
+/**
+ * handle P2P_STREAM_OPEN_RET or P2P_HAVE_RET, both of which carry the
+ * pieces the owner has
+ * @return: -1 if the answer is malformed
+ */
+static int p2p_have_ret_handler(struct p2p_link *link,
+				struct p2p_packet *pkt)
+{
+	struct p2p_stream_open_ret ret;
+	struct p2p_stream *s;
+	uint8_t *have = NULL;
+	int have_len;
+
+	memcpy(&ret, pkt->data, sizeof(ret));
+	have_len = (ret.have_n + 7) / 8;
+	if (ret.have_n > P2P_HAVE_MAX ||
+			pkt->data_len < sizeof(ret) + have_len) {
+		_error("bad piece map of %u pieces\n", ret.have_n);
+		return -1;
+	}
+	if (ret.have_n > 0) {
+		have = malloc(have_len);
+		if (have == NULL) {
+			_error("piece map alloc failed\n");
+			ret.file_len = -1;
+		} else
+			memcpy(have, pkt->data + sizeof(ret), have_len);
+	}
+
+	pthread_mutex_lock(&link->mutex);
+	s = __p2p_stream_find(link, ret.stream);
+	if (s != NULL && pkt->type == P2P_STREAM_OPEN_RET && !s->opened) {
+		s->file_len = ret.file_len;
+		s->have = have;
+		s->have_n = ret.have_n;
+		s->opened = true;
+		have = NULL;
+		pthread_cond_broadcast(&s->cond);
+	} else if (s != NULL && pkt->type == P2P_HAVE_RET) {
+		/* the map in use is only replaced by the owner of s */
+		free(s->have_ret);
+		s->have_ret = have;
+		s->have_ret_n = ret.have_n;
+		s->have_ret_len = ret.file_len;
+		s->have_answered = true;
+		have = NULL;
+		pthread_cond_broadcast(&s->cond);
+	}
+	pthread_mutex_unlock(&link->mutex);
+	free(have);
+
+	return 0;
+}
+
+/**
+ * hand an answered piece to its stream. The raw piece is read even if
+ * the stream is closed already, or the link would be out of step
+ * @return: -1 if the link is broken
+ */
+static int p2p_piece_ret_handler(struct p2p_link *link,
+				 struct p2p_packet *pkt)
+{
+	struct p2p_piece_request req;
+	struct p2p_stream *s;
+	uint64_t sent_at;
+	int ret;
+
+	memcpy(&req, pkt->data, sizeof(req));
+	if (req.len > ctr_info.piece_len) {
+		_error("piece #%u of %u bytes is too long\n",
+				req.piece_id, req.len);
+		return -1;
+	}
+	if (req.len > 0 &&
+			recv_segment_raw(link->conn, link->buf, req.len) < 0) {
+		_error("piece #%u recv failed from %u\n",
+				req.piece_id, ip_string(link->ip));
+		return -1;
+	}
+
+	pthread_mutex_lock(&link->mutex);
+	s = __p2p_stream_find(link, req.stream);
+	if (s == NULL || (sent_at = __p2p_inflight_del(s, req.piece_id)) == 0) {
+		pthread_mutex_unlock(&link->mutex);
+		return 0;
+	}
+	/* the short last pieces would make the link look slow */
+	if (req.len == ctr_info.piece_len)
+		__p2p_link_sample(link, sent_at, req.len);
+	/* the window has room again, the requesters go on meanwhile */
+	pthread_cond_broadcast(&link->cond);
+	/* the piece is written without the lock, the stream is only
+	   kept from being closed. link->buf is the reader's own */
+	s->calls++;
+	pthread_mutex_unlock(&link->mutex);
+
+	ret = s->piece_fn(s, req.piece_id,
+			  req.len > 0 ? link->buf : NULL, req.len);
+
+	pthread_mutex_lock(&link->mutex);
+	if (ret < 0)
+		s->failed = true;
+	if (--s->calls == 0)
+		pthread_cond_broadcast(&link->cond);
+	pthread_mutex_unlock(&link->mutex);
+
+	return 0;
+}
+
+/**
+ * the only receiver of a link, it dispatches the answers to the
+ * streams until the connection breaks
+ * @arg: the link, the task owns a reference of it
+ */
+static void *p2p_link_reader(void *arg)
+{
+	struct p2p_link *link = arg;
+	struct p2p_packet *pkt;
+
+	pthread_detach(pthread_self());
+
+	while (recv_p2p_packet(link->conn, &pkt) > 0) {
+		switch (pkt->type) {
+		case P2P_STREAM_OPEN_RET:
+		case P2P_HAVE_RET:
+			if (pkt->data_len < sizeof(struct p2p_stream_open_ret))
+				goto out;
+			if (p2p_have_ret_handler(link, pkt) < 0)
+				goto out;
+			break;
+
+		case P2P_PIECE_RET:
+			if (pkt->data_len < sizeof(struct p2p_piece_request))
+				goto out;
+			if (p2p_piece_ret_handler(link, pkt) < 0)
+				goto out;
+			break;
+
+		default:
+			_error("unknown p2p packet type %u\n", pkt->type);
+			break;
+		}
+	}
+
+out:
+	_debug("p2p link to %u is broken\n", ip_string(link->ip));
+	p2p_link_kill(link);
+	p2p_link_put(link);
+	pthread_exit((void *)0);
+}
+
+/**
+ * get the link to an owner, it is connected if there is none yet
+ * @return: the link with a reference taken, drop it by p2p_link_put(),
+ *          or NULL
+ */
+struct p2p_link *p2p_link_get(uint32_t ip, uint16_t port)
+{
+	struct p2p_link *link, *new;
+	pthread_t tid;
+	int conn;
+
+	pthread_mutex_lock(&links_mutex);
+	link = __p2p_link_find(ip, port);
+	if (link != NULL)
+		link->ref++;
+	pthread_mutex_unlock(&links_mutex);
+	if (link != NULL)
+		return link;
+
+	/* not under the lock, a peer may take long to answer */
+	conn = connect_to_peer(ip, port);
+	if (conn < 0)
+		return NULL;
+	new = p2p_link_alloc(ip, port, conn);
+	if (new == NULL) {
+		segment_conn_close(conn);
+		close(conn);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&links_mutex);
+	link = __p2p_link_find(ip, port);
+	if (link != NULL) {
+		/* lost the race to another download */
+		link->ref++;
+		pthread_mutex_unlock(&links_mutex);
+		p2p_link_free(new);
+		return link;
+	}
+	/* the hash, the reader and the caller */
+	new->ref = 3;
+	hash_add(links, &new->hlist, ip);
+	pthread_mutex_unlock(&links_mutex);
+
+	if (pthread_create(&tid, NULL, p2p_link_reader, new) != 0) {
+		_error("p2p link reader create failed\n");
+		p2p_link_kill(new);
+		p2p_link_put(new);
+		p2p_link_put(new);
+		return NULL;
+	}
+	_debug("p2p link to %u connected\n", ip_string(ip));
+
+	return new;
+}
+
+/**
+ * the sending side failed, the reader then sees the connection closed
+ * and kills the link
+ */
+static inline void p2p_link_break(struct p2p_link *link)
+{
+	shutdown(link->conn, SHUT_RDWR);
+}
+
+/**
+ * open a stream of a file on a link and wait for its length
+ * @piece_fn: called for every answered piece request of the stream, by
+ *            the reader of the link and without the link locked
+ * @return: the stream, which holds a reference of the link, or NULL
+ */
+struct p2p_stream *p2p_stream_open(struct p2p_link *link, const char *name,
+				   p2p_piece_fn piece_fn, void *arg)
+{
+	struct p2p_stream_open req;
+	struct p2p_packet pkt;
+	struct p2p_stream *s;
+	struct timespec deadline;
+	int ret = 0;
+
+	/* a cut name would open some other file of the peer */
+	if (strnlen(name, MAX_NAME_LEN) == MAX_NAME_LEN) {
+		_error("'%.32s...' is too long to open\n", name);
+		return NULL;
+	}
+
+	s = calloc(1, sizeof(struct p2p_stream));
+	if (s == NULL) {
+		_error("p2p stream alloc failed\n");
+		return NULL;
+	}
+	INIT_LIST_ELM(&s->l);
+	pthread_cond_init(&s->cond, NULL);
+	s->link = link;
+	s->file_len = -1;
+	s->piece_fn = piece_fn;
+	s->arg = arg;
+
+	pthread_mutex_lock(&links_mutex);
+	link->ref++;
+	pthread_mutex_unlock(&links_mutex);
+
+	pthread_mutex_lock(&link->mutex);
+	s->id = link->next_id++;
+	list_add_tail(&link->streams, &s->l);
+	pthread_mutex_unlock(&link->mutex);
+
+	req.stream = s->id;
+	strcpy(req.name, name);
+	p2p_packet_init(&pkt, P2P_STREAM_OPEN);
+	p2p_packet_fill(&pkt, &req, offsetof(struct p2p_stream_open, name) +
+			strlen(req.name) + 1);
+	if (send_p2p_packet(link->conn, &pkt) < 0) {
+		_error("stream open send failed for '%s'\n", name);
+		p2p_link_break(link);
+		goto close_stream;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += P2P_OPEN_TIMEOUT;
+	pthread_mutex_lock(&link->mutex);
+	while (!s->opened && !link->dead && ret != ETIMEDOUT)
+		ret = pthread_cond_timedwait(&s->cond, &link->mutex,
+					     &deadline);
+	pthread_mutex_unlock(&link->mutex);
+	if (!s->opened) {
+		_error("stream open failed for '%s' from %u\n",
+				name, ip_string(link->ip));
+		goto close_stream;
+	}
+
+	return s;
+
+close_stream:
+	p2p_stream_close(s);
+	return NULL;
+}
+
+/**
+ * ask the owner for a piece, the answer is handed to the piece_fn of
+ * the stream by the reader of the link. It waits while the window of
+ * the link is full, the answers may come back in any order
+ * @return: 0, or -1 if the link is broken or the stream failed
+ */
+int p2p_stream_request(struct p2p_stream *s, int piece_id, int len)
+{
+	struct p2p_link *link = s->link;
+	struct p2p_piece_request req;
+	struct p2p_packet pkt;
+
+	pthread_mutex_lock(&link->mutex);
+	while (!link->dead && !s->failed &&
+			(link->inflight >= link->window ||
+			 s->inflight == P2P_WINDOW_MAX))
+		pthread_cond_wait(&link->cond, &link->mutex);
+	if (link->dead || s->failed) {
+		pthread_mutex_unlock(&link->mutex);
+		return -1;
+	}
+	/* before sending, the answer may come back at once */
+	s->reqs[s->inflight].piece_id = piece_id;
+	s->reqs[s->inflight].sent_at = now_usec();
+	s->inflight++;
+	link->inflight++;
+	pthread_mutex_unlock(&link->mutex);
+
+	req.stream = s->id;
+	req.piece_id = piece_id;
+	req.len = len;
+	p2p_packet_init(&pkt, P2P_PIECE_REQ);
+	p2p_packet_fill(&pkt, &req, sizeof(req));
+	if (send_p2p_packet(link->conn, &pkt) < 0) {
+		_error("piece req send failed for #%d\n", piece_id);
+		pthread_mutex_lock(&link->mutex);
+		__p2p_inflight_del(s, piece_id);
+		pthread_mutex_unlock(&link->mutex);
+		p2p_link_break(link);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * tell whether the owner of a stream has a piece
+ */
+bool p2p_stream_has(struct p2p_stream *s, int piece_id)
+{
+	if (s->have == NULL)
+		return true;
+	if (piece_id >= s->have_n)
+		return false;
+
+	return s->have[piece_id / 8] & (1 << (piece_id % 8));
+}
+
+/**
+ * ask the owner of a stream again which pieces it has, e.g. while it
+ * is downloading the file itself, and take them as the map of the
+ * stream. The map is only looked at by the caller then
+ * @return: 0, or -1 if the link is broken, the owner doesn't answer in
+ *          time or it has given up the file. The map is kept then
+ */
+int p2p_stream_refresh(struct p2p_stream *s)
+{
+	struct p2p_link *link = s->link;
+	struct p2p_stream_close req;
+	struct p2p_packet pkt;
+	struct timespec deadline;
+	int ret = 0;
+
+	pthread_mutex_lock(&link->mutex);
+	s->have_answered = false;
+	pthread_mutex_unlock(&link->mutex);
+
+	req.stream = s->id;
+	p2p_packet_init(&pkt, P2P_HAVE_REQ);
+	p2p_packet_fill(&pkt, &req, sizeof(req));
+	if (send_p2p_packet(link->conn, &pkt) < 0) {
+		_error("have req send failed for #%u\n", s->id);
+		p2p_link_break(link);
+		return -1;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += P2P_OPEN_TIMEOUT;
+	pthread_mutex_lock(&link->mutex);
+	while (!s->have_answered && !link->dead && ret != ETIMEDOUT)
+		ret = pthread_cond_timedwait(&s->cond, &link->mutex,
+					     &deadline);
+	ret = -1;
+	if (s->have_answered && s->have_ret_len >= 0) {
+		free(s->have);
+		s->have = s->have_ret;
+		s->have_n = s->have_ret_n;
+		s->have_ret = NULL;
+		ret = 0;
+	}
+	pthread_mutex_unlock(&link->mutex);
+
+	return ret;
+}
+
+/**
+ * close a stream, the link stays open for the later streams. The
+ * answers still on the way are dropped by the reader
+ */
+void p2p_stream_close(struct p2p_stream *s)
+{
+	struct p2p_link *link = s->link;
+	struct p2p_stream_close req;
+	struct p2p_packet pkt;
+	bool dead;
+
+	pthread_mutex_lock(&link->mutex);
+	list_del(&s->l);
+	dead = link->dead;
+	/* the answers still on the way don't hold the window */
+	link->inflight -= s->inflight;
+	pthread_cond_broadcast(&link->cond);
+	/* nor does piece_fn run once it is closed */
+	while (s->calls > 0)
+		pthread_cond_wait(&link->cond, &link->mutex);
+	pthread_mutex_unlock(&link->mutex);
+
+	if (!dead) {
+		req.stream = s->id;
+		p2p_packet_init(&pkt, P2P_STREAM_CLOSE);
+		p2p_packet_fill(&pkt, &req, sizeof(req));
+		if (send_p2p_packet(link->conn, &pkt) < 0)
+			p2p_link_break(link);
+	}
+
+	pthread_cond_destroy(&s->cond);
+	free(s->have);
+	free(s->have_ret);
+	free(s);
+	p2p_link_put(link);
+}
@@ -0,0 +1,85 @@
+#ifndef CLIENT_LINK_H
+#define CLIENT_LINK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include <list.h>
+
+#define P2P_LINK_BITS		6	/* buckets of the link hash */
+#define P2P_OPEN_TIMEOUT	5	/* sec to wait for a stream to open */
+#define P2P_WINDOW_INIT		4	/* piece requests in flight on a link */
+#define P2P_WINDOW_MIN		2
+#define P2P_WINDOW_MAX		32
+#define P2P_RTT_EXPIRE		10000000	/* micro sec a min rtt is kept */
+
+struct p2p_stream;
+
+/* called by the reader of the link for every answered piece request,
+   and for the ones never to be answered once the link breaks
+   @buf: the piece, NULL if the owner failed to read it */
+typedef int (*p2p_piece_fn)(struct p2p_stream *s, int piece_id,
+			    char *buf, int len);
+
+/* the connection to the P2P_PORT of an owner, kept open as long as it
+   works and shared by all the downloads from it */
+struct p2p_link {
+	struct hlist_node hlist;	/* by ip */
+	uint32_t ip;
+	uint16_t port;
+	int conn;
+	int ref;			/* hash, reader and streams */
+	bool dead;			/* connection broken, unhashed */
+	char *buf;			/* a piece read by the reader */
+	uint32_t next_id;
+	struct list_head streams;
+	int inflight;			/* piece requests not answered */
+	int window;			/* piece requests allowed in flight */
+	uint64_t min_rtt;		/* micro sec, of the recent answers */
+	uint64_t min_rtt_at;
+	uint64_t bw;			/* bytes per sec, smoothed */
+	uint64_t last_at;		/* when the last piece arrived */
+	pthread_cond_t cond;		/* window opened or link broken */
+	pthread_mutex_t mutex;		/* protects dead and all below buf */
+};
+
+/* a piece request not answered yet */
+struct p2p_inflight {
+	uint32_t piece_id;
+	uint64_t sent_at;		/* micro sec */
+};
+
+/* a file transferred on a link */
+struct p2p_stream {
+	struct list_head l;		/* in link->streams */
+	uint32_t id;
+	struct p2p_link *link;
+	pthread_cond_t cond;		/* opened or have answered */
+	bool opened;
+	int file_len;			/* -1 if the owner can't read it */
+	uint8_t *have;			/* pieces of the owner, NULL if all */
+	int have_n;			/* bits in have */
+	bool have_answered;		/* P2P_HAVE_RET came */
+	int have_ret_len;		/* its file_len */
+	uint8_t *have_ret;		/* its map, until taken into have */
+	int have_ret_n;
+	bool failed;			/* the owner failed to give a piece */
+	int inflight;
+	struct p2p_inflight reqs[P2P_WINDOW_MAX];
+	p2p_piece_fn piece_fn;
+	void *arg;
+	int calls;			/* piece_fn running, off the lock */
+};
+
+struct p2p_link *p2p_link_get(uint32_t ip, uint16_t port);
+void p2p_link_put(struct p2p_link *link);
+
+struct p2p_stream *p2p_stream_open(struct p2p_link *link, const char *name,
+				   p2p_piece_fn piece_fn, void *arg);
+int p2p_stream_request(struct p2p_stream *s, int piece_id, int len);
+bool p2p_stream_has(struct p2p_stream *s, int piece_id);
+int p2p_stream_refresh(struct p2p_stream *s);
+void p2p_stream_close(struct p2p_stream *s);
+
+#endif
@@ -6,6 +6,7 @@
 #include <sys/socket.h>
 
 #include <debug.h>
+#include <list.h>
 #include <utility/segment.h>
 #include "packet.h"
 
@@ -46,23 +47,49 @@ inline int send_ptot_packet(int conn, struct ptot_packet *pkt)
 /**
  * peer receives a ttop packet from a tracker
  * @conn: connection fd
- * @pkt: the ttop_packet which is going to be filled
+ * @pkt: set to the received ttop_packet, which lives in the receive
+ *       buffer of the connection until the next receive on it
  * @return: -1, failed. Otherwise indicates how many bytes have
  *          been received
  */
-int recv_ttop_packet(int conn, struct ttop_packet *pkt)
+int recv_ttop_packet(int conn, struct ttop_packet **pkt)
 {
-	int ret = -1;
-	char buf[sizeof(struct ttop_packet) + 2] = { 0 };
+	char *data;
+	int ret;
 
-	ret = recv_segment(conn, buf, sizeof(buf));
-	if (ret < 0)
+	ret = recv_segment_view(conn, &data);
+	if (ret < (int)sizeof(struct ttop_packet_header))
+		return -1;
+	*pkt = (struct ttop_packet *)data;
+	if (ttop_packet_len(*pkt) > ret)
 		return -1;
-	memcpy(pkt, buf, sizeof(struct ttop_packet));
 
 	return ret;
 }
 
+static int ptot_stream_flush(struct trans_stream *ts, int len)
+{
+	struct ptot_stream *ps = list_entry(ts, struct ptot_stream, ts);
+
+	ps->pkt.hdr.data_len = len;
+	return send_ptot_packet(ps->conn, &ps->pkt);
+}
+
+/**
+ * init a stream which sends a file table to the tracker as a sequence
+ * of ptot packets
+ * @ps: the ptot stream
+ * @conn: connection fd to the tracker
+ * @type: type of every packet, PEER_SYNC or PEER_FILE_UPDATE
+ */
+void ptot_stream_init(struct ptot_stream *ps, int conn,
+		      enum ptot_packet_type type)
+{
+	ptot_packet_init(&ps->pkt, type);
+	ps->conn = conn;
+	trans_stream_init(&ps->ts, ps->pkt.data, ptot_stream_flush);
+}
+
 int client_tcp_listen(uint16_t port)
 {
 	int listenfd, on = 1;
@@ -111,15 +138,25 @@ inline int send_p2p_packet(int conn, struct p2p_packet *pkt)
 	return send_segment(conn, (char *)pkt, p2p_packet_len(pkt));
 }
 
-inline int recv_p2p_packet(int conn, struct p2p_packet *pkt)
+/**
+ * peer receives a p2p packet from another peer
+ * @conn: connection fd
+ * @pkt: set to the received p2p_packet, which lives in the receive
+ *       buffer of the connection until the next receive on it
+ * @return: -1, failed. Otherwise indicates how many bytes have
+ *          been received
+ */
+int recv_p2p_packet(int conn, struct p2p_packet **pkt)
 {
-	int ret = -1;
-	char buf[sizeof(struct p2p_packet) + 2] = { 0 };
+	char *data;
+	int ret;
 
-	ret = recv_segment(conn, buf, sizeof(buf));
-	if (ret < 0)
+	ret = recv_segment_view(conn, &data);
+	if (ret < (int)P2P_HEADER_LEN)
+		return -1;
+	*pkt = (struct p2p_packet *)data;
+	if (p2p_packet_len(*pkt) > ret)
 		return -1;
-	memcpy(pkt, buf, sizeof(struct ttop_packet));
 
 	return ret;
 }
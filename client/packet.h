@@ -2,20 +2,23 @@
 #define CLIENT_PACKET_H
 
 #include <packet_def.h>
+#include <trans_file_table.h>
 
-#define p2p_packet_len(ptr) (sizeof(uint16_t) + sizeof(uint16_t) +	\
-				(ptr)->data_len)
+#define P2P_HEADER_LEN (sizeof(uint16_t) + sizeof(uint16_t))
+#define p2p_packet_len(ptr) (P2P_HEADER_LEN + (ptr)->data_len)
 #define piece_req_len(ptr) (MAX_NAME_LEN * sizeof(char) + sizeof(uint16_t) +	\
 				(ptr)->piece_n * sizeof(uint16_t))
 
+/* all the transfers from a peer share one connection to its P2P_PORT,
+   each file is a stream on it tagged by an id the downloader picks */
 enum p2p_packet_type {
-	P2P_FILE_LEN_REQ,
-	P2P_PORT_REQ,
+	P2P_STREAM_OPEN = 7,	/* 0 - 6 were the per-file port protocol */
+	P2P_STREAM_OPEN_RET,
 	P2P_PIECE_REQ,
-	P2P_FINISH,
-	P2P_FILE_LEN_RET,
-	P2P_PORT_RET,
-	P2P_PIECE_RET,
+	P2P_PIECE_RET,		/* followed by the raw piece */
+	P2P_STREAM_CLOSE,
+	P2P_HAVE_REQ,		/* the pieces the owner has by now */
+	P2P_HAVE_RET,
 };
 
 struct p2p_packet {
@@ -24,20 +27,56 @@ struct p2p_packet {
 	char data[MAX_PKT_DATA_LEN];
 };
 
+struct p2p_stream_open {
+	uint32_t stream;
+	char name[MAX_NAME_LEN];	/* only sent up to the NUL */
+};
+
+/* the pieces the owner can give, an owner which is downloading the
+   file itself has only some of them. It is also the answer to
+   P2P_HAVE_REQ, whose file_len is -1 once the owner has given up
+   downloading the file */
+struct p2p_stream_open_ret {
+	uint32_t stream;
+	int32_t file_len;		/* -1 if the file can't be read */
+	uint32_t have_n;		/* bits in have, 0 if it has all */
+	uint8_t have[];
+};
+
+#define P2P_HAVE_MAX ((MAX_PKT_DATA_LEN -				\
+		       sizeof(struct p2p_stream_open_ret)) * 8)
+
+/* a piece request, and the header of the answer to it. The answer
+   has len 0 and no raw bytes if the piece can't be read */
 struct p2p_piece_request {
+	uint32_t stream;
 	uint32_t piece_id;
 	uint32_t len;
 };
 
+/* also P2P_HAVE_REQ */
+struct p2p_stream_close {
+	uint32_t stream;
+};
+
+/* streams a file table to the tracker in ptot packets */
+struct ptot_stream {
+	struct trans_stream ts;
+	int conn;
+	struct ptot_packet pkt;
+};
+
 void ptot_packet_init(struct ptot_packet *pkt, enum ptot_packet_type type);
 void ptot_packet_fill(struct ptot_packet *pkt, void *buf, int len);
 int send_ptot_packet(int conn, struct ptot_packet *pkt);
-int recv_ttop_packet(int conn, struct ttop_packet *pkt);
+int recv_ttop_packet(int conn, struct ttop_packet **pkt);
+void ptot_stream_init(struct ptot_stream *ps, int conn,
+		      enum ptot_packet_type type);
 
 void p2p_packet_init(struct p2p_packet *pkt, enum p2p_packet_type type);
 void p2p_packet_fill(struct p2p_packet *pkt, void *buf, int len);
 int send_p2p_packet(int conn, struct p2p_packet *pkt);
-int recv_p2p_packet(int conn, struct p2p_packet *pkt);
+int recv_p2p_packet(int conn, struct p2p_packet **pkt);
 
 int client_tcp_listen(uint16_t port);
 
@@ -1,18 +1,23 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <pthread.h>
 #include <signal.h>
 #include <unistd.h>
 #include <netdb.h>
+#include <time.h>
 #include <sys/time.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
 #include <sys/file.h>
+#include <sys/sendfile.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <net/if.h>
@@ -21,6 +26,7 @@
 #include <consts.h>
 #include <packet_def.h>
 #include <file_table.h>
+#include <utility/segment.h>
 #include "start.h"
 #include "packet.h"
 #include "file_monitor.h"
@@ -37,9 +43,6 @@ static pthread_t ttop_receiver_tid;
 static pthread_t ptop_listening_tid;
 static struct client_thread_arg targ;
 
-static uint16_t p2p_ports[MAX_P2P_PORT] = { 0 };
-static pthread_mutex_t p2p_port_mutex = PTHREAD_MUTEX_INITIALIZER;
-
 
 static void get_my_ip(char *if_name)
 {
@@ -124,31 +127,6 @@ static int parse_conf_files(struct client_conf_info *conf)
 	return 0;
 }
 
-static int16_t get_free_p2p_port()
-{
-	int i = 0;
-	int16_t port = -1;
-
-	pthread_mutex_lock(&p2p_port_mutex);
-	for (i = 0; i < MAX_P2P_PORT; i++) {
-		if (p2p_ports[i] == 0) {
-			p2p_ports[i] = 1;
-			port = i + BASE_P2P_PORT;
-			break;
-		}
-	}
-	pthread_mutex_unlock(&p2p_port_mutex);
-
-	return port;
-}
-
-static void put_p2p_port(uint16_t port)
-{
-	pthread_mutex_lock(&p2p_port_mutex);
-	p2p_ports[port - BASE_P2P_PORT] = 0;
-	pthread_mutex_unlock(&p2p_port_mutex);
-}
-
 static int connect_tracker()
 {
 	struct sockaddr_in servaddr;
@@ -166,6 +144,7 @@ static int connect_tracker()
 		perror("connect() error");
 		return -1;
 	}
+	segment_set_role(fd, SEGMENT_CONTROL);
 
 	return fd;
 }
@@ -173,10 +152,12 @@ static int connect_tracker()
 static int register_to_tracker(int conn)
 {
 	struct ptot_packet ptot_pkt;
-	struct ttop_packet ttop_pkt;
+	struct ttop_packet *ttop_pkt;
 	int ret;
 
+	/* ask for framed segments, legacy trackers just ignore it */
 	ptot_packet_init(&ptot_pkt, PEER_REGISTER);
+	strcpy(ptot_pkt.hdr.protocol_name, PROTOCOL_FRAMED);
 	ret = send_ptot_packet(conn, &ptot_pkt);
 	if (ret < 0)
 		return ret;
@@ -184,10 +165,14 @@ static int register_to_tracker(int conn)
 	ret = recv_ttop_packet(conn, &ttop_pkt);
 	if (ret < 0)
 		return ret;
-	if (ttop_pkt.hdr.type != TRACKER_ACCEPT)
+	if (ttop_pkt->hdr.type != TRACKER_ACCEPT)
 		return -1;
 
-	memcpy(&ctr_info, ttop_pkt.data, ttop_pkt.hdr.data_len);
+	bzero(&ctr_info, sizeof(ctr_info));
+	memcpy(&ctr_info, ttop_pkt->data,
+			min(ttop_pkt->hdr.data_len, sizeof(ctr_info)));
+	if (ctr_info.features & FEATURE_FRAMED)
+		segment_set_mode(conn, SEGMENT_FRAMED);
 
 	return 0;
 }
@@ -231,57 +216,50 @@ unblock:
 
 static void notify_tracker_add_me(struct file_entry *fe)
 {
-	struct ptot_packet *pkt;
-	struct trans_file_table *tft;
-	struct trans_file_entry *te;
+	struct ptot_stream *ps;
+	struct trans_file_entry te;
 
-	pkt = calloc(1, sizeof(*pkt));
-	if (pkt == NULL) {
-		_error("pkt alloc failed\n");
-		goto out;
-	}
-	tft = calloc(1, sizeof(*tft));
-	if (tft == NULL) {
-		_error("tft alloc failed\n");
-		goto free_pkt;
+	ps = calloc(1, sizeof(*ps));
+	if (ps == NULL) {
+		_error("ptot stream alloc failed\n");
+		return;
 	}
 
-	te = tft->entries + tft->n;
+	bzero(&te, sizeof(te));
 	pthread_rwlock_rdlock(&fe->rwlock);
-	strcpy(te->name, fe->name);
-	te->timestamp = fe->timestamp;
+	file_entry_name(fe, te.name);
+	te.timestamp = fe->timestamp;
 	pthread_rwlock_unlock(&fe->rwlock);
-	te->file_type = fe->type;
-	te->op_type = FILE_MODIFY;
-	te->owners[te->owner_n].ip = my_ip;
-	te->owners[te->owner_n].port = P2P_PORT;
-	te->owner_n++;
-	tft->n++;
-
-	ptot_packet_init(pkt, PEER_FILE_UPDATE);
-	ptot_packet_fill(pkt, tft, trans_table_len(tft));
-	if (send_ptot_packet(targ.conn, pkt) < 0)
+	te.file_type = fe->type;
+	te.op_type = FILE_MODIFY;
+	te.owners[te.owner_n].ip = my_ip;
+	te.owners[te.owner_n].port = P2P_PORT;
+	te.owner_n++;
+
+	ptot_stream_init(ps, targ.conn, PEER_FILE_UPDATE);
+	trans_stream_add(&ps->ts, &te);
+	if (trans_stream_finish(&ps->ts) < 0)
 		_error("send ptot packet failed\n");
 
-free_pkt:
-	free(pkt);
-out:
-	return;
+	free(ps);
 }
 
 /**
  * peer download a file from some owners
- * @arg: file entry related to the file to be downloaded
+ * @arg: file entry related to the file to be downloaded, the task owns
+ *       a reference of it
  * @return: return 1 if succeeds, -1 if fails
  */
 static void *ptop_download_task(void *arg)
 {
 	struct file_entry *fe = arg;
-	char *logic_name = fe->name;
+	char logic_name[MAX_NAME_LEN];
 	char *sys_name;
 	struct monitor_target *target;
 	long int ret = 0;
 
+	file_entry_name(fe, logic_name);
+
 	/* block file monitor */
 	target = file_monitor_block(logic_name, false);
 	if (target == NULL) {
@@ -300,16 +278,17 @@ static void *ptop_download_task(void *arg)
 
 	if (fe->type == DIRECTORY) {
 		ret = file_monitor_mkdir(sys_name, logic_name);
-		if (ret == 0)
+		if (ret == 0) {
 			file_change_modtime(sys_name, fe->timestamp);
+			notify_tracker_add_me(fe);
+		}
 	} else {
-		ret = do_download(fe, sys_name);
+		/* the tracker is told as soon as the download starts, the
+		   finished pieces are given to other peers on the way */
+		ret = do_download(fe, sys_name, notify_tracker_add_me);
 		if (ret == 0)
 			file_change_modtime(sys_name, fe->timestamp);
 	}
-	
-	if (ret == 0)
-		notify_tracker_add_me(fe);
 
 	_debug("~~~~~~~~~~~~~ dowload finished\n");
 
@@ -317,256 +296,390 @@ static void *ptop_download_task(void *arg)
 unblock_file_monitor:
 	file_monitor_unblock(target);
 out:
+	file_entry_put(fe);
 	pthread_exit((void *)ret);
 }
 
-static void do_upload(int listenfd, const char *sys_name)
+/**
+ * start a download task, the reference of the file entry is handed
+ * over to the task
+ */
+static void ptop_download_start(struct file_entry *fe)
 {
-	struct sockaddr_in cliaddr;
-	socklen_t clilen;
-	int file_fd, conn;
-	struct p2p_packet *pkt;
-	char *piece_buf;
-	int ret_len;
-
-	file_fd = open(sys_name, O_RDWR);
-	if (file_fd < 0) {
-		_error("'%s' open failed\n", sys_name);
+	char name[MAX_NAME_LEN];
+	pthread_t new_tid;
+
+	if (fe == NULL)
 		return;
-	}
 
-	pkt = calloc(1, sizeof(struct p2p_packet));
-	if (pkt == NULL) {
-		_error("pkt alloc failed\n");
-		goto close_fd;
-	}
-	piece_buf = calloc(1, ctr_info.piece_len);
-	if (piece_buf == NULL) {
-		_error("piece buf alloc failed\n");
-		goto free_pkt;
+	if (pthread_create(&new_tid, NULL, ptop_download_task, fe) != 0) {
+		_error("download task of '%s' create failed\n",
+				file_entry_name(fe, name));
+		file_entry_put(fe);
 	}
+}
 
-do_agin:
-	conn = accept(listenfd, (struct sockaddr*)&cliaddr, &clilen);
-	if (conn < 0) {
-		if (errno == EINTR)
-			goto do_agin;
-		else {
-			perror("accept error");
-			goto free_piece_buf;
-		}   
-	}   
-
-	
-	while (recv_p2p_packet(conn, pkt) > 0) {
-		struct p2p_piece_request req;
-		if (pkt->type != P2P_PIECE_REQ) {
-			_error("is not P2P_PIECE_REQ\n");
-			goto out;
-		}
+/**
+ * send a range of a file to a socket with splice() through a pipe,
+ * for the files sendfile() can't read from
+ * @return: bytes sent
+ */
+static int splice_piece(int conn, int file_fd, off_t offset, int len)
+{
+	int pipefd[2], n = 0;
+	ssize_t in, out;
 
-		memcpy(&req, pkt->data, pkt->data_len);
+	if (pipe(pipefd) < 0) {
+		perror("pipe error");
+		return 0;
+	}
 
-		flock(file_fd, LOCK_EX);
-		lseek(file_fd, req.piece_id * ctr_info.piece_len, SEEK_SET);
-		ret_len = my_read(file_fd, piece_buf, req.len);
-		flock(file_fd, LOCK_UN);
-		if (ret_len != req.len) {
-			_error("'%s' read failed, (%d/%d)\n",
-					sys_name, ret_len, req.len);
-			goto out;
+	while (n < len) {
+		in = splice(file_fd, &offset, pipefd[1], NULL, len - n,
+			    SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (in < 0 && errno == EINTR)
+			continue;
+		if (in <= 0)
+			break;
+		while (in > 0) {
+			out = splice(pipefd[0], NULL, conn, NULL, in,
+				     SPLICE_F_MOVE | SPLICE_F_MORE);
+			if (out < 0 && errno == EINTR)
+				continue;
+			if (out <= 0)
+				goto out;
+			in -= out;
+			n += out;
 		}
-		_debug("\t^_^ ^_^ UPLOADING... piece_id = %d, read = %d\n",
-				req.piece_id, ret_len);
-		ret_len = my_write(conn, piece_buf, ret_len);
-		_debug("\tsend = %d\n", ret_len);
 	}
 
 out:
-	close(conn);
-free_piece_buf:
-	free(piece_buf);
-free_pkt:
-	free(pkt);
-close_fd:
-	close(file_fd);
-	return;
+	close(pipefd[0]);
+	close(pipefd[1]);
+	return n;
 }
 
 /**
- * peer upload a file to another peer
- * @arg: socket description for communicating with the particular peer
- * @return: return 1 if succeeds, -1 if fails
+ * send a piece of a file to a socket without copying it through user
+ * space. The offset is explicit, so that uploaders of the same file
+ * don't share a file position and need no lock
+ * @return: bytes sent
  */
-static void *ptop_upload_task(void *arg)
+static int send_piece(int conn, int file_fd, off_t offset, int len)
 {
-	long int p2p_conn = (long int)arg;
-	struct p2p_packet pkt;
-	char logic_name[MAX_NAME_LEN];
-	char *sys_name;
-	struct stat st;
-	uint16_t new_port;
-	int listenfd;
+	int n = 0;
+	ssize_t ret;
 
-	while (recv_p2p_packet(p2p_conn, &pkt) > 0) {
+	while (n < len) {
+		ret = sendfile(conn, file_fd, &offset, len - n);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0 && n == 0 && (errno == EINVAL || errno == ENOSYS))
+			return splice_piece(conn, file_fd, offset, len);
+		if (ret <= 0)
+			break;
+		n += ret;
+	}
 
-		if (pkt.type == P2P_FILE_LEN_REQ || pkt.type == P2P_PORT_REQ) {
-			memcpy(logic_name, pkt.data, pkt.data_len);
-			sys_name = get_sys_name(logic_name);
-			if (sys_name == NULL) {
-				_error("can't get sys name for '%s'\n",
-						logic_name);
-				goto close_out;
-			}
-		}
+	return n;
+}
 
-		switch (pkt.type) {
-		case P2P_FILE_LEN_REQ:
-			_debug("{ P2P_FILE_LEN_REQ }\n");
+/* a file some peer downloads on the connection to P2P_PORT */
+struct upload_stream {
+	struct list_head l;
+	uint32_t id;
+	int fd;
+	char name[MAX_NAME_LEN];
+};
 
-			if (stat(sys_name, &st) < 0) {
-				_error("stat error for '%s'\n", logic_name);
-				goto free_sys_name;
-			}
-			p2p_packet_init(&pkt, P2P_FILE_LEN_RET);
-			p2p_packet_fill(&pkt, &st.st_size, sizeof(st.st_size));
-			if (send_p2p_packet(p2p_conn, &pkt) < 0) {
-				_error("P2P_FILE_LEN_RET send failed\n");
-				goto free_sys_name;
-			}
+struct piece_send_arg {
+	int fd;
+	off_t offset;
+	int len;
+};
 
-			_debug("\t'%s(%u bytes)'\n",
-					sys_name, (unsigned int)st.st_size);
-			break;
+static int piece_send_raw(int conn, void *arg)
+{
+	struct piece_send_arg *psa = arg;
 
-		case P2P_PORT_REQ:
-			_debug("{ P2P_PORT_REQ } %s\n", logic_name);
+	if (send_piece(conn, psa->fd, psa->offset, psa->len) != psa->len)
+		return -1;
+	return 0;
+}
 
-			new_port = get_free_p2p_port();
-			p2p_packet_init(&pkt, P2P_PORT_RET);
-			p2p_packet_fill(&pkt, &new_port, sizeof(new_port));
-			if (send_p2p_packet(p2p_conn, &pkt) < 0) {
-				_error("P2P_FILE_PORT_RET send failed\n");
-				goto free_sys_name;
-			}
+static struct upload_stream *upload_stream_find(struct list_head *streams,
+						uint32_t id)
+{
+	struct list_head *pos;
 
-			_debug("\t new port = %u\n", new_port);
+	list_for_each(pos, streams) {
+		struct upload_stream *us =
+			list_entry(pos, struct upload_stream, l);
+		if (us->id == id)
+			return us;
+	}
 
-			listenfd = client_tcp_listen(new_port);
-			if (listenfd < 0) {
-				_error("listen fd create failed\n");
-				goto free_sys_name;
-			}
+	return NULL;
+}
 
-			do_upload(listenfd, sys_name);
-			close(listenfd);
-			put_p2p_port(new_port);
+static void upload_stream_free(struct upload_stream *us)
+{
+	list_del(&us->l);
+	close(us->fd);
+	free(us);
+}
 
-			break;
+/**
+ * open a file for a stream and tell its length, -1 if it can't be read,
+ * along with the pieces of it which are here if it is being downloaded
+ * @return: -1 if the connection is broken
+ */
+static int upload_stream_open(int conn, struct list_head *streams,
+			      struct p2p_packet *req)
+{
+	struct p2p_stream_open so;
+	struct p2p_stream_open_ret *ret;
+	struct upload_stream *us = NULL;
+	struct p2p_packet pkt;
+	struct stat st;
+	char *sys_name;
+	int n;
 
-		default:
-			break;
-		}
+	bzero(&so, sizeof(so));
+	memcpy(&so, req->data, min(req->data_len, sizeof(so)));
+	so.name[MAX_NAME_LEN - 1] = '\0';
+	p2p_packet_init(&pkt, P2P_STREAM_OPEN_RET);
+	ret = (struct p2p_stream_open_ret *)pkt.data;
+	ret->stream = so.stream;
+	ret->file_len = -1;
+	ret->have_n = 0;
+
+	_debug("{ P2P_STREAM_OPEN } #%u %s\n", so.stream, so.name);
+
+	sys_name = get_sys_name(so.name);
+	if (sys_name == NULL) {
+		_error("can't get sys name for '%s'\n", so.name);
+		goto send_ret;
 	}
+	us = calloc(1, sizeof(struct upload_stream));
+	if (us == NULL) {
+		_error("upload stream alloc failed\n");
+		goto free_sys_name;
+	}
+	us->fd = open(sys_name, O_RDONLY);
+	if (us->fd < 0 || fstat(us->fd, &st) < 0) {
+		_error("'%s' open failed\n", sys_name);
+		if (us->fd >= 0)
+			close(us->fd);
+		free(us);
+		goto free_sys_name;
+	}
+	us->id = so.stream;
+	strcpy(us->name, so.name);
+	/* a file being downloaded here is served only once its length is
+	   known, the pieces finished so far along with it */
+	n = download_piece_map(so.name, ret->have, P2P_HAVE_MAX);
+	if (n == 0) {
+		_debug("\t'%s' is not here yet\n", sys_name);
+		close(us->fd);
+		free(us);
+		goto free_sys_name;
+	}
+	if (n > 0)
+		ret->have_n = n;
+	list_add_tail(streams, &us->l);
+	ret->file_len = st.st_size;
+
+	_debug("\t'%s(%u bytes)'\n", sys_name, (unsigned int)st.st_size);
 
 free_sys_name:
 	free(sys_name);
-close_out:
-	close(p2p_conn);
-	_leave();
-	pthread_exit((void *)0);
-}
+send_ret:
+	pkt.data_len = sizeof(*ret) + (ret->have_n + 7) / 8;
+	if (send_p2p_packet(conn, &pkt) < 0) {
+		_error("P2P_STREAM_OPEN_RET send failed\n");
+		return -1;
+	}
 
+	return 0;
+}
 
-static void peer_id_list_remove_myself(struct file_entry *fe)
+/**
+ * tell which pieces of the file of a stream are here by now, the file
+ * length is -1 once it can't be given any more, e.g. the download of
+ * it here has failed
+ * @return: -1 if the connection is broken
+ */
+static int upload_have(int conn, struct list_head *streams,
+		       struct p2p_packet *req)
 {
-	struct list_head *pos;
-	pthread_rwlock_wrlock(&fe->rwlock);
-	list_for_each(pos, &fe->owner_head) {
-		struct peer_id_list *p = list_entry(pos, struct peer_id_list, l);
-		if (p->ip == my_ip) {
-			list_del(&p->l);
-			free(p);
-			break;
-		}
+	struct p2p_stream_close hr;
+	struct p2p_stream_open_ret *ret;
+	struct upload_stream *us;
+	struct p2p_packet pkt;
+	struct stat st;
+	int n;
+
+	memcpy(&hr, req->data, sizeof(hr));
+	p2p_packet_init(&pkt, P2P_HAVE_RET);
+	ret = (struct p2p_stream_open_ret *)pkt.data;
+	ret->stream = hr.stream;
+	ret->file_len = -1;
+	ret->have_n = 0;
+
+	us = upload_stream_find(streams, hr.stream);
+	if (us != NULL && fstat(us->fd, &st) == 0) {
+		n = download_piece_map(us->name, ret->have, P2P_HAVE_MAX);
+		if (n != 0)
+			ret->file_len = st.st_size;
+		if (n > 0)
+			ret->have_n = n;
 	}
-	pthread_rwlock_unlock(&fe->rwlock);
+
+	pkt.data_len = sizeof(*ret) + (ret->have_n + 7) / 8;
+	if (send_p2p_packet(conn, &pkt) < 0) {
+		_error("P2P_HAVE_RET send failed\n");
+		return -1;
+	}
+
+	return 0;
 }
 
-static void file_table_sync(struct file_table *ft, struct trans_file_table *tft)
+/**
+ * answer a piece request with the piece right behind the answer. If
+ * it can't be read, e.g. the file has shrunk since the stream was
+ * opened or the piece is not downloaded here yet, the answer has len 0
+ * and nothing follows
+ * @return: -1 if the connection is broken
+ */
+static int upload_piece(int conn, struct list_head *streams,
+			struct p2p_packet *req)
 {
-	struct file_entry *fe;
-	pthread_t new_tid;
-	int i;
+	struct p2p_piece_request pr;
+	struct piece_send_arg psa;
+	struct upload_stream *us;
+	struct p2p_packet pkt;
+	struct stat st;
 
-	for (i = 0; i < tft->n; i++) {
-		struct trans_file_entry *te = tft->entries + i;
-		fe = file_table_find(ft, te);
-		if (fe == NULL) {
-			fe = file_table_add(ft, te);
-			pthread_create(&new_tid, NULL, ptop_download_task, fe);
-		} else {
-			peer_id_list_replace(fe, te);
-			peer_id_list_remove_myself(fe);
-			if (te->timestamp > fe->timestamp) {
-				file_entry_update_timestamp(fe, te->timestamp);
-				pthread_create(&new_tid, NULL,
-						ptop_download_task, fe);
-			}
-		}
+	memcpy(&pr, req->data, sizeof(pr));
+	us = upload_stream_find(streams, pr.stream);
+	psa.offset = (off_t)pr.piece_id * ctr_info.piece_len;
+	psa.len = pr.len;
+	if (us == NULL || pr.len > ctr_info.piece_len ||
+			fstat(us->fd, &st) < 0 ||
+			psa.offset + pr.len > st.st_size ||
+			!download_has_piece(us->name, pr.piece_id))
+		pr.len = 0;
+
+	p2p_packet_init(&pkt, P2P_PIECE_RET);
+	p2p_packet_fill(&pkt, &pr, sizeof(pr));
+	if (pr.len == 0) {
+		_error("piece #%u of stream #%u can't be read\n",
+				pr.piece_id, pr.stream);
+		return send_p2p_packet(conn, &pkt) < 0 ? -1 : 0;
 	}
+
+	psa.fd = us->fd;
+	if (send_segment_raw(conn, (char *)&pkt, p2p_packet_len(&pkt),
+			     piece_send_raw, &psa) < 0) {
+		_error("piece #%u of stream #%u send failed\n",
+				pr.piece_id, pr.stream);
+		return -1;
+	}
+	_debug("\t^_^ ^_^ UPLOADING... piece_id = %d, send = %d\n",
+			pr.piece_id, pr.len);
+
+	return 0;
 }
 
-static int sync_files(int conn, char **target, int n)
+/**
+ * peer upload files to another peer, all of them on one connection
+ * @arg: socket description for communicating with the particular peer
+ * @return: return 1 if succeeds, -1 if fails
+ */
+static void *ptop_upload_task(void *arg)
 {
-	struct trans_file_table tft;
-	struct ptot_packet ptot_pkt;
-	struct ttop_packet ttop_pkt;
-	int ret;
+	long int p2p_conn = (long int)arg;
+	struct p2p_packet *req;
+	struct p2p_stream_close sc;
+	struct upload_stream *us;
+	struct list_head *pos, *tmp;
+	LIST(streams);
+
+	/* the stream protocol is framed, the peers speaking the per-file
+	   port protocol are dropped at their first request */
+	segment_set_mode(p2p_conn, SEGMENT_FRAMED);
+
+	while (recv_p2p_packet(p2p_conn, &req) > 0) {
+		switch (req->type) {
+		case P2P_STREAM_OPEN:
+			if (upload_stream_open(p2p_conn, &streams, req) < 0)
+				goto close_out;
+			break;
 
-	/* get local file table */
-	file_table_init(&ft);
-	ret = get_file_table(&ft, target, n);
-	if (ret != 0) {
-		_error("getting file table failed\n");
-		return ret;
-	}
-	file_table_print(&ft);
+		case P2P_PIECE_REQ:
+			if (req->data_len < sizeof(struct p2p_piece_request))
+				goto close_out;
+			if (upload_piece(p2p_conn, &streams, req) < 0)
+				goto close_out;
+			break;
 
-	/* trans local file table to trans file table */
-	trans_table_fill_from(&tft, &ft);
+		case P2P_HAVE_REQ:
+			if (req->data_len < sizeof(sc))
+				goto close_out;
+			if (upload_have(p2p_conn, &streams, req) < 0)
+				goto close_out;
+			break;
 
-	/* send sync request to tracker */
-	ptot_packet_init(&ptot_pkt, PEER_SYNC);
-	ptot_packet_fill(&ptot_pkt, &tft, trans_table_len(&tft));
-	ret = send_ptot_packet(conn, &ptot_pkt);
-	if (ret < 0) {
-		_error("send packet failed\n");
-		return ret;
-	}
+		case P2P_STREAM_CLOSE:
+			if (req->data_len < sizeof(sc))
+				goto close_out;
+			memcpy(&sc, req->data, sizeof(sc));
+			us = upload_stream_find(&streams, sc.stream);
+			if (us != NULL)
+				upload_stream_free(us);
+			break;
 
-	/* get file_table which contains the items that we need to update */
-	ret = recv_ttop_packet(conn, &ttop_pkt);
-	if (ret < 0) {
-		_error("recv ttop packet failed\n");
-		return ret;
-	}
-	if (ttop_pkt.hdr.type != TRACKER_SYNC) {
-		_error("packet type is not correct\n");
-		return -1;
+		default:
+			_error("unknown p2p packet type %u\n", req->type);
+			goto close_out;
+		}
+		/* the end of an answer, e.g. a whole piece */
+		segment_push(p2p_conn);
 	}
 
-	_debug("NEED TO SYNC FILE LOCALLY!!!\n");
-	memcpy(&tft, ttop_pkt.data, ttop_pkt.hdr.data_len);
-	file_table_sync(&ft, &tft);
+close_out:
+	list_for_each_safe(pos, tmp, &streams)
+		upload_stream_free(list_entry(pos, struct upload_stream, l));
+	segment_conn_close(p2p_conn);
+	close(p2p_conn);
+	_leave();
+	pthread_exit((void *)0);
+}
 
-	return 0;
+
+static void file_entry_sync(struct file_table *ft, struct trans_file_entry *te)
+{
+	struct file_entry *fe;
+
+	fe = file_table_find(ft, te);
+	if (fe == NULL) {
+		fe = file_table_add(ft, te);
+		ptop_download_start(fe);
+	} else {
+		file_entry_replace_owners(fe, te);
+		file_entry_delete_owner(fe, my_ip);
+		if (te->timestamp > fe->timestamp) {
+			file_entry_update_timestamp(fe, te->timestamp);
+			ptop_download_start(fe);
+		} else
+			file_entry_put(fe);
+	}
 }
 
 static void broadcast_entry_handler(struct trans_file_entry *te)
 {
 	struct file_entry *fe = NULL;
-	pthread_t new_tid;
 
 	if (te == NULL) {
 		_error("trans_file_entry is NULL\n");
@@ -580,20 +693,20 @@ static void broadcast_entry_handler(struct trans_file_entry *te)
 		fe = file_table_find(&ft, te);
 		if (fe != NULL) {
 			_debug("\tOLD File\n");
-			peer_id_list_replace(fe, te);
-			peer_id_list_remove_myself(fe);
+			file_entry_replace_owners(fe, te);
+			file_entry_delete_owner(fe, my_ip);
 			if (te->timestamp > fe->timestamp) {
 				_debug("te timestamp = %lu, fe timestamp = %lu\n",
 						te->timestamp, fe->timestamp);
 				/* create a file add task to download the file */
 				file_entry_update_timestamp(fe, te->timestamp);
-				pthread_create(&new_tid, NULL,
-						ptop_download_task, fe);
-			}
+				ptop_download_start(fe);
+			} else
+				file_entry_put(fe);
 		} else {
 			_debug("\tNEW File\n");
 			fe = file_table_add(&ft, te);
-			pthread_create(&new_tid, NULL, ptop_download_task, fe);
+			ptop_download_start(fe);
 		}
 
 		break;
@@ -616,16 +729,16 @@ static void broadcast_entry_handler(struct trans_file_entry *te)
 			_debug("\t'%s' not exists, conflict!\n", te->name);
 			fe = file_table_add(&ft, te);
 			/* create a file add task to download the file */
-			pthread_create(&new_tid, NULL, ptop_download_task, fe);
+			ptop_download_start(fe);
 		} else {
-			peer_id_list_replace(fe, te);
-			peer_id_list_remove_myself(fe);
+			file_entry_replace_owners(fe, te);
+			file_entry_delete_owner(fe, my_ip);
 			if (te->timestamp > fe->timestamp) {
 				/* create a file add task to download the file */
 				file_entry_update_timestamp(fe, te->timestamp);
-				pthread_create(&new_tid, NULL,
-						ptop_download_task, fe);
-			}
+				ptop_download_start(fe);
+			} else
+				file_entry_put(fe);
 		}
 		/*
 		file_table_print(&ft);
@@ -643,20 +756,283 @@ static void broadcast_entry_handler(struct trans_file_entry *te)
 }
 
 /**
- * peer handles a single broadcast entry received from tracker
- * @arg: trans file entry related to the file to be downloaded
- * @return: return 1 if succeeds, -1 if fails
+ * peer handles a broadcast chunk received from tracker
+ * @pkt: the TRACKER_BROADCAST packet
  */
-void *broadcast_handler_task(void *arg)
+static void broadcast_chunk_handler(struct ttop_packet *pkt)
 {
-	struct trans_file_table *tft = arg;
-	int i;
+	struct trans_chunk_reader tr;
+	struct trans_file_entry te;
 
-	for (i = 0; i < tft->n; i++)
-		broadcast_entry_handler(tft->entries + i);
+	if (trans_chunk_open(&tr, pkt->data, pkt->hdr.data_len) < 0) {
+		_error("bad broadcast chunk\n");
+		return;
+	}
 
-	free(tft);
-	pthread_exit(0);
+	_debug("\tbroadcast entry number: %d\n", tr.left);
+	while (trans_chunk_next(&tr, &te) > 0)
+		broadcast_entry_handler(&te);
+}
+
+static int sync_state_load(struct sync_state *st)
+{
+	FILE *fp;
+	int ret;
+
+	fp = fopen(CLIENT_STATE_FILE, "r");
+	if (fp == NULL)
+		return -1;
+	ret = fscanf(fp, "%lu %lu %lu", &st->gen, &st->seq, &st->synced_at);
+	fclose(fp);
+
+	return ret == 3 ? 0 : -1;
+}
+
+static void sync_state_save(struct sync_state *st)
+{
+	char tmp[MAX_NAME_LEN];
+	FILE *fp;
+
+	/* replaced at once, a crash leaves the old state or the new */
+	sprintf(tmp, "%s.tmp", CLIENT_STATE_FILE);
+	fp = fopen(tmp, "w");
+	if (fp == NULL) {
+		_error("open '%s' failed\n", tmp);
+		return;
+	}
+	fprintf(fp, "%lu %lu %lu\n", st->gen, st->seq, st->synced_at);
+	if (fclose(fp) != 0 || rename(tmp, CLIENT_STATE_FILE) < 0)
+		_error("save '%s' failed\n", CLIENT_STATE_FILE);
+}
+
+struct resync_arg {
+	uint64_t synced_at;
+	uint64_t digest;			/* of the files not changed */
+	struct trans_file_table changed;	/* since synced_at */
+};
+
+static void resync_fn(struct file_entry *fe, void *arg)
+{
+	struct resync_arg *ra = arg;
+	struct trans_file_entry te, *new_te;
+
+	trans_entry_fill_from(&te, fe);
+	if (te.timestamp < ra->synced_at) {
+		ra->digest += trans_entry_digest(te.name, te.timestamp,
+						 te.file_type);
+		return;
+	}
+	new_te = trans_table_append(&ra->changed);
+	if (new_te != NULL)
+		*new_te = te;
+}
+
+/**
+ * stream local file table to tracker as the sync request
+ * @st: where the peer synced to last, NULL to send the whole table,
+ *      which starts with the directory summaries if the tracker can
+ * @return: 0 if succeeds, -1 otherwise
+ */
+static int send_sync(int conn, struct sync_state *st)
+{
+	bool summary = st == NULL && (ctr_info.features & FEATURE_SUMMARY);
+	struct trans_file_table dirs;
+	struct ptot_stream *ps;
+	struct ptot_packet pkt;
+	struct resync_arg ra;
+	struct sync_point sp;
+	int ret = 0;
+
+	ps = calloc(1, sizeof(*ps));
+	if (ps == NULL) {
+		_error("ptot stream alloc failed\n");
+		return -1;
+	}
+	ptot_stream_init(ps, conn, summary ? PEER_SUMMARY : PEER_SYNC);
+	ps->ts.reply = true;
+
+	/* the entries follow once the tracker tells which directories
+	   differ, see send_sync_scope() */
+	if (summary) {
+		trans_table_init(&dirs);
+		ret = file_table_summary(&ft, &dirs);
+		if (ret == 0)
+			ret = trans_stream_add_table(&ps->ts, &dirs);
+		_debug("summary of %d directories\n", dirs.n);
+		trans_table_destroy(&dirs);
+		goto finish;
+	}
+	if (st == NULL) {
+		ret = file_table_stream(&ft, &ps->ts, FILE_NONE, NULL);
+		goto finish;
+	}
+
+	/* only the files changed since the last sync are sent, the
+	   tracker still has the others from then */
+	bzero(&ra, sizeof(ra));
+	ra.synced_at = st->synced_at;
+	file_table_for_each(&ft, resync_fn, &ra);
+	_debug("resync from %lu, %d files changed\n", st->seq, ra.changed.n);
+
+	bzero(&sp, sizeof(sp));
+	sp.gen = st->gen;
+	sp.seq = st->seq;
+	sp.digest = ra.digest;
+	ptot_packet_init(&pkt, PEER_RESYNC);
+	ptot_packet_fill(&pkt, &sp, sizeof(sp));
+	if (send_ptot_packet(conn, &pkt) < 0)
+		ret = -1;
+	else
+		ret = trans_stream_add_table(&ps->ts, &ra.changed);
+	trans_table_destroy(&ra.changed);
+
+finish:
+	if (ret == 0 && trans_stream_finish(&ps->ts) < 0)
+		ret = -1;
+	free(ps);
+	if (ret < 0)
+		_error("send packet failed\n");
+
+	return ret;
+}
+
+/**
+ * stream the local entries under the directories which differ from
+ * the tracker's, the rest of a full sync started with summaries
+ * @dirs: the directories the tracker told in TRACKER_SUMMARY
+ * @return: 0 if succeeds, -1 otherwise
+ */
+static int send_sync_scope(int conn, struct trans_file_table *dirs)
+{
+	struct ptot_stream *ps;
+	struct dir_set ds;
+	int ret;
+
+	if (dir_set_init(&ds, &ft, dirs) < 0)
+		return -1;
+	ps = calloc(1, sizeof(*ps));
+	if (ps == NULL) {
+		_error("ptot stream alloc failed\n");
+		dir_set_destroy(&ds, &ft);
+		return -1;
+	}
+	ptot_stream_init(ps, conn, PEER_SYNC);
+	ps->ts.reply = true;
+
+	ret = file_table_stream(&ft, &ps->ts, FILE_NONE, &ds);
+	if (ret == 0 && trans_stream_finish(&ps->ts) < 0)
+		ret = -1;
+	_debug("%d directories differ, %d files sent\n", dirs->n,
+			ps->ts.total);
+	free(ps);
+	dir_set_destroy(&ds, &ft);
+	if (ret < 0)
+		_error("send packet failed\n");
+
+	return ret;
+}
+
+static int sync_files(int conn, char **target, int n)
+{
+	struct ttop_packet *ttop_pkt;
+	struct trans_chunk_reader tr;
+	struct trans_file_entry te;
+	struct trans_file_table dirs;
+	struct sync_state st;
+	struct sync_point sp;
+	bool more = true, resync = false, synced = false;
+	uint64_t scanned_at = time(NULL);
+	int ret;
+
+	/* get local file table */
+	file_table_init(&ft);
+	ret = get_file_table(&ft, target, n);
+	if (ret != 0) {
+		_error("getting file table failed\n");
+		return ret;
+	}
+	file_table_print(&ft);
+
+	/* catch up from where the last sync left, if the tracker can */
+	if ((ctr_info.features & FEATURE_RESYNC) && sync_state_load(&st) == 0)
+		resync = true;
+	ret = send_sync(conn, resync ? &st : NULL);
+	if (ret < 0)
+		return ret;
+
+	_debug("NEED TO SYNC FILE LOCALLY!!!\n");
+	trans_table_init(&dirs);
+
+	/* get the chunks which contain the items that we need to update,
+	   broadcasts from other peers may come in between */
+	while (more) {
+		ret = recv_ttop_packet(conn, &ttop_pkt);
+		if (ret < 0) {
+			_error("recv ttop packet failed\n");
+			return ret;
+		}
+		if (ttop_pkt->hdr.type == TRACKER_BROADCAST) {
+			broadcast_chunk_handler(ttop_pkt);
+			continue;
+		}
+		if (ttop_pkt->hdr.type == TRACKER_RESYNC) {
+			bzero(&sp, sizeof(sp));
+			memcpy(&sp, ttop_pkt->data,
+					min(ttop_pkt->hdr.data_len, sizeof(sp)));
+			if (sp.accepted) {
+				synced = true;
+				continue;
+			}
+			_debug("tracker asks for the whole file table\n");
+			resync = false;
+			ret = send_sync(conn, NULL);
+			if (ret < 0)
+				return ret;
+			continue;
+		}
+		if (ttop_pkt->hdr.type == TRACKER_SUMMARY) {
+			if (trans_chunk_open(&tr, ttop_pkt->data,
+						ttop_pkt->hdr.data_len) < 0 ||
+					trans_chunk_read_table(&tr, &dirs) < 0) {
+				_error("bad summary chunk\n");
+				return -1;
+			}
+			if (tr.more)
+				continue;
+			ret = send_sync_scope(conn, &dirs);
+			trans_table_destroy(&dirs);
+			if (ret < 0)
+				return ret;
+			continue;
+		}
+		if (ttop_pkt->hdr.type != TRACKER_SYNC) {
+			_error("packet type is not correct\n");
+			return -1;
+		}
+
+		if (trans_chunk_open(&tr, ttop_pkt->data,
+					ttop_pkt->hdr.data_len) < 0) {
+			_error("bad sync chunk\n");
+			return -1;
+		}
+		/* the changes missed may be deletions */
+		while (trans_chunk_next(&tr, &te) > 0) {
+			if (resync)
+				broadcast_entry_handler(&te);
+			else
+				file_entry_sync(&ft, &te);
+		}
+		more = tr.more;
+	}
+
+	if (synced) {
+		st.gen = sp.gen;
+		st.seq = sp.seq;
+		st.synced_at = scanned_at;
+		sync_state_save(&st);
+	}
+
+	return 0;
 }
 
 static void client_cleanup()
@@ -700,34 +1076,15 @@ static void *keep_alive_task(void *arg)
 static void *ttop_receiver_task(void *arg)
 {
 	struct client_thread_arg *targ = arg;
-	int i, conn = targ->conn;
-	struct ttop_packet pkt;
-	struct trans_file_table *tft;
-	/* pthread_t broadcast_handler_tid; */
+	int conn = targ->conn;
+	struct ttop_packet *pkt;
 
 	pthread_wait_notify(&targ->wait, THREAD_RUNNING);
 	while (recv_ttop_packet(conn, &pkt) > 0) {
-		switch (pkt.hdr.type) {
+		switch (pkt->hdr.type) {
 		case TRACKER_BROADCAST:
 			_debug("[ TRACKER_BROADCAST ] from tracker\n");
-			tft = calloc(1, sizeof(*tft));
-			if (tft == NULL) {
-				_error("ftf alloc failed\n");
-				break;
-			}
-			memcpy(tft, pkt.data, pkt.hdr.data_len);
-
-			_debug("\tbroadcast entry number: %d\n", tft->n);
-			/*
-			pthread_create(&broadcast_handler_tid,
-					NULL, broadcast_handler_task, tft);
-					*/
-
-			for (i = 0; i < tft->n; i++)
-				broadcast_entry_handler(tft->entries + i);
-
-			free(tft);
-
+			broadcast_chunk_handler(pkt);
 			break;
 
 		case TRACKER_SYNC:
@@ -764,6 +1121,7 @@ static void *ptop_listening_task(void *arg)
 		return 0;
 
 	while(1) {
+		cliaddr_len = sizeof(cliaddr);
 		ptop_conn = accept(listenfd, (struct sockaddr*)&cliaddr,
 				   &cliaddr_len);
 		if (ptop_conn < 0) {
@@ -771,6 +1129,10 @@ static void *ptop_listening_task(void *arg)
 			continue;
 		}
 
+		/* only the answers go out on it, the pieces are corked
+		   into full TCP segments and pushed at their ends */
+		segment_set_role(ptop_conn, SEGMENT_BULK);
+
 		/* create a ptop_upload_task to handle this connection */
 		pthread_create(&ptop_upload_tid, NULL, ptop_upload_task,
 				(void *)ptop_conn);
@@ -789,7 +1151,11 @@ void client_start()
 	get_my_ip(targ.conf.device_name);
 	get_server_ip(targ.conf.tracker_host);
 
-	signal(SIGPIPE, client_cleanup);
+	/* a peer or the tracker going away fails the write with EPIPE,
+	   the link it was on is torn down instead of the whole client */
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGINT, client_cleanup);
+	signal(SIGTERM, client_cleanup);
 
 	/* connect to tracker */
 	targ.conn = connect_tracker();
@@ -8,6 +8,7 @@
 
 #define CLIENT_CONF_FILE	"./client/client.conf"
 #define CLIENT_TARGET_FILE	"./client/target.conf"
+#define CLIENT_STATE_FILE	"./client/sync.state"
 
 struct client_conf_info {
 	char tracker_host[MAX_NAME_LEN];
@@ -16,6 +17,14 @@ struct client_conf_info {
 	char *target_dirs[MAX_TARGET_DIR];
 };
 
+/* where the peer synced to last, kept in CLIENT_STATE_FILE across
+   restarts */
+struct sync_state {
+	uint64_t gen;		/* of the tracker's file table */
+	uint64_t seq;		/* last change of it seen */
+	uint64_t synced_at;	/* when the files were scanned, in seconds */
+};
+
 struct client_thread_arg {
 	struct client_conf_info conf;
 	struct pthread_wait_t wait;
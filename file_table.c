@@ -1,7 +1,10 @@
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
 #include <pthread.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <hash.h>
 #include <debug.h>
@@ -9,453 +12,1957 @@
 #include "file_table.h"
 
 
-static bool already_in_owners(struct list_head *head, struct peer_id_list *owner)
+/**
+ * file set operations, You MUST lock the mutex of the registry before
+ * calling them
+ */
+
+static inline int file_set_slot(struct file_set *fs, struct file_entry *fe)
+{
+	return hash_mix_64((uintptr_t)fe) & (fs->size - 1);
+}
+
+static int __file_set_grow(struct file_set *fs)
 {
-	struct list_head *pos;
-	list_for_each(pos, head) {
-		struct peer_id_list *p = list_entry(pos, struct peer_id_list, l);
-		if (p->ip == owner->ip)
-			return true;
+	struct file_entry **old = fs->slots;
+	int old_size = fs->size, i;
+
+	fs->size = old_size ? old_size * 2 : FILE_SET_INIT_SIZE;
+	fs->slots = calloc(fs->size, sizeof(struct file_entry *));
+	if (fs->slots == NULL) {
+		_error("file set grow to %d failed\n", fs->size);
+		fs->slots = old;
+		fs->size = old_size;
+		return -1;
+	}
+	for (i = 0; i < old_size; i++) {
+		int j;
+		if (old[i] == NULL)
+			continue;
+		j = file_set_slot(fs, old[i]);
+		while (fs->slots[j] != NULL)
+			j = (j + 1) & (fs->size - 1);
+		fs->slots[j] = old[i];
 	}
-	return false;
+	free(old);
+
+	return 0;
 }
 
-/**
- * add all the owners in trans_file_entry *te to a linked list head
- * @owner_h: the linked list head to be added
- * @te: the trans_file_entry in which the owners would be added to
- *      the new list
- */
-static void __peer_id_list_add(struct list_head *owner_h,
-			     struct trans_file_entry *te)
+static void __file_set_add(struct file_set *fs, struct file_entry *fe)
 {
 	int i;
 
-	if (owner_h == NULL || te == NULL)
+	if ((fs->n + 1) * 2 > fs->size && __file_set_grow(fs) < 0)
 		return;
 
-	for (i = 0; i < te->owner_n; i++) {
-		struct peer_id_list *p = calloc(1, sizeof(struct peer_id_list));
-		if (p == NULL) {
-			_error("peer_id_list alloc failed\n");
-			break;
-		}
-		INIT_LIST_ELM(&p->l);
-		p->ip = te->owners[i].ip;
-		p->port = te->owners[i].port;
-		if (!already_in_owners(owner_h, p))
-			list_add_tail(owner_h, &p->l);
+	i = file_set_slot(fs, fe);
+	while (fs->slots[i] != NULL) {
+		if (fs->slots[i] == fe)
+			return;
+		i = (i + 1) & (fs->size - 1);
 	}
+	fs->slots[i] = fe;
+	fs->n++;
 }
 
-/**
- * unlink and free all the owners in the linked list
- * @head: the linked list head that points to all the woners
- */
-static inline void __peer_id_list_destroy(struct list_head *head)
+static void __file_set_del(struct file_set *fs, struct file_entry *fe)
 {
-	struct list_head *pos, *tmp;
+	int i, j;
 
-	if (head == NULL)
+	if (fs->n == 0)
 		return;
 
-	list_for_each_safe(pos, tmp, head) {
-		struct peer_id_list *p = list_entry(pos, struct peer_id_list, l);
-		list_del(&p->l);
-		free(p);
+	i = file_set_slot(fs, fe);
+	while (fs->slots[i] != fe) {
+		if (fs->slots[i] == NULL)
+			return;
+		i = (i + 1) & (fs->size - 1);
 	}
-}
 
-static inline void __peer_id_list_replace(struct file_entry *fe,
-					  struct trans_file_entry *te)
-{
-	__peer_id_list_destroy(&fe->owner_head);
-	__peer_id_list_add(&fe->owner_head, te);
+	/* shift the following entries back to keep the probe chains
+	   unbroken */
+	for (j = (i + 1) & (fs->size - 1); fs->slots[j] != NULL;
+			j = (j + 1) & (fs->size - 1)) {
+		int k = file_set_slot(fs, fs->slots[j]);
+		if ((j > i && (k <= i || k > j)) ||
+				(j < i && (k <= i && k > j))) {
+			fs->slots[i] = fs->slots[j];
+			i = j;
+		}
+	}
+	fs->slots[i] = NULL;
+	fs->n--;
 }
 
-inline void peer_id_list_replace(struct file_entry *fe,
-			  	 struct trans_file_entry *te)
+/**
+ * owner registry operations, You MUST lock the mutex of the registry
+ * before calling them
+ */
+
+static struct file_owner *__owner_find(struct owner_registry *reg,
+				       uint32_t ip)
 {
-	pthread_rwlock_wrlock(&fe->rwlock);
-	__peer_id_list_replace(fe, te);
-	pthread_rwlock_unlock(&fe->rwlock);
-}
+	struct file_owner *o;
 
+	hlist_for_each_entry(o, &reg->by_ip[hash_min(ip, FILE_OWNER_BITS)],
+			     hlist)
+		if (o->peer.ip == ip)
+			return o;
 
-/**
- * file entry operations
- */
+	return NULL;
+}
 
 /**
- * file entry allocation which would do some default initialization
+ * @return: the owner of the ip, which is created if it is new
  */
-struct file_entry *file_entry_alloc()
+static struct file_owner *__owner_intern(struct owner_registry *reg,
+					 uint32_t ip, uint16_t port)
 {
-	struct file_entry *fe = calloc(1, sizeof(struct file_entry));
-	if (fe == NULL)
+	struct file_owner *o = __owner_find(reg, ip);
+
+	if (o != NULL) {
+		o->peer.port = port;
+		return o;
+	}
+
+	if (reg->n == reg->size) {
+		int size = reg->size ? reg->size * 2 : FILE_SET_INIT_SIZE;
+		struct file_owner **owners;
+		owners = realloc(reg->owners, size * sizeof(*owners));
+		if (owners == NULL) {
+			_error("owner registry grow to %d failed\n", size);
+			return NULL;
+		}
+		reg->owners = owners;
+		reg->size = size;
+	}
+
+	o = calloc(1, sizeof(struct file_owner));
+	if (o == NULL) {
+		_error("file owner alloc failed\n");
 		return NULL;
-	INIT_LIST_HEAD(&fe->owner_head);
-	INIT_HLIST_NODE(&fe->hlist);
-	pthread_rwlock_init(&fe->rwlock, NULL);
+	}
+	o->peer.ip = ip;
+	o->peer.port = port;
+	o->id = reg->n;
+	hash_add(reg->by_ip, &o->hlist, ip);
+	reg->owners[reg->n++] = o;
 
-	return fe;
+	return o;
+}
+
+static void owner_registry_init(struct owner_registry *reg)
+{
+	pthread_mutex_init(&reg->mutex, NULL);
+	hash_init(reg->by_ip);
+	reg->owners = NULL;
+	reg->n = 0;
+	reg->size = 0;
 }
 
 /**
- * link the file entry to the file table
- * You MUST lock the mutex of the table before calling it
- * @table: the file table that would be added to
- * @fe: the file entry than would be added to the tale
+ * number a change of the file entry, if its table keeps a change log
  */
-inline void file_entry_add(struct file_table *table, struct file_entry *fe)
+static void file_entry_changed(struct file_entry *fe)
 {
-	if (table == NULL || fe == NULL)
+	struct file_log *log = &fe->table->log;
+	struct path_node *old;
+	struct file_change *c;
+
+	if (log->changes == NULL || fe->path == NULL)
 		return;
 
-	pthread_rwlock_wrlock(&fe->rwlock);
-	hash_add(table->file_htable, &fe->hlist, ELFhash(fe->name));
-	pthread_rwlock_unlock(&fe->rwlock);
-	table->n++;
+	path_hold(&fe->table->paths, fe->path);
+	pthread_mutex_lock(&log->mutex);
+	c = log->changes + (++log->seq & (FILE_LOG_LEN - 1));
+	old = c->path;
+	c->seq = log->seq;
+	c->path = fe->path;
+	c->type = fe->type;
+	pthread_mutex_unlock(&log->mutex);
+
+	if (old != NULL)
+		path_put(&fe->table->paths, old);
 }
 
 /**
- * fill the file entry from trans file entry
- * @fe: the file entry which to be filled
- * @te: the trans file entry which would be fill from
+ * keep the digest of the file entry in the sum of its directory, so
+ * that a directory is compared with the one of a peer by its sum only
+ * You MUST write lock the file entry before calling it
+ * @linked: false if the entry is leaving its directory
  */
-void file_entry_fill_from(struct file_entry *fe, struct trans_file_entry *te)
+static void __file_entry_sum(struct file_entry *fe, bool linked)
 {
-	if (fe == NULL || te == NULL)
+	char name[MAX_NAME_LEN];
+	uint64_t digest = 0;
+
+	if (fe->path == NULL || fe->path->parent == NULL)
 		return;
 
-	pthread_rwlock_wrlock(&fe->rwlock);
-	strcpy(fe->name, te->name);
-	fe->timestamp = te->timestamp;
-	fe->type = te->file_type;
-	__peer_id_list_add(&fe->owner_head, te);
-	pthread_rwlock_unlock(&fe->rwlock);
+	if (linked)
+		digest = trans_entry_digest(file_entry_name(fe, name),
+					    fe->timestamp, fe->type);
+	__atomic_add_fetch(&fe->path->parent->sum, digest - fe->digest,
+			   __ATOMIC_RELAXED);
+	fe->digest = digest;
 }
 
 /**
- * fill the trans file entry from file entry
- * @fe: the trans file entry which to be filled
- * @te: the file entry which would be fill from
+ * owner operations of a file entry, You MUST write lock the file entry
+ * before calling the ones changing the owners
  */
-void trans_entry_fill_from(struct trans_file_entry *te, struct file_entry *fe)
-{
-	struct list_head *pos;
 
-	if (te == NULL || fe == NULL)
-		return;
+/**
+ * add all the owners in trans_file_entry *te to a file entry
+ * @fe: the file entry whose owners to be added to
+ * @te: the trans_file_entry in which the owners would be added
+ */
+static void __file_entry_add_owners(struct file_entry *fe,
+				    struct trans_file_entry *te)
+{
+	struct owner_registry *reg = &fe->table->registry;
+	int i;
 
-	pthread_rwlock_rdlock(&fe->rwlock);
-	bzero(te, sizeof(struct trans_file_entry));
-	strcpy(te->name, fe->name);
-	te->timestamp = fe->timestamp;
-	te->file_type = fe->type;
-	list_for_each(pos, &fe->owner_head) {
-		struct peer_id_list *p = list_entry(pos, struct peer_id_list, l);
-		te->owners[te->owner_n].ip = p->ip;
-		te->owners[te->owner_n].port = p->port;
-		te->owner_n++;
+	pthread_mutex_lock(&reg->mutex);
+	for (i = 0; i < te->owner_n; i++) {
+		struct file_owner *o = __owner_intern(reg, te->owners[i].ip,
+						      te->owners[i].port);
+		if (o != NULL && id_set_add(&fe->owners, o->id) > 0)
+			__file_set_add(&o->files, fe);
 	}
-	pthread_rwlock_unlock(&fe->rwlock);
+	pthread_mutex_unlock(&reg->mutex);
 }
 
 /**
- * update file entry according to the trans file entry information
- * @fe: the file entry which is going to be updated
- * @te: the trans file entry which is used to do the update
- * return: 0 if succeds, otherwise -1
+ * make the owners in trans_file_entry *te the only owners of a file
+ * entry, the index is changed only for the owners which come or go
  */
-int file_entry_update(struct file_entry *fe, struct trans_file_entry *te)
+static void __file_entry_replace_owners(struct file_entry *fe,
+					struct trans_file_entry *te)
 {
-	int ret = 0;
+	struct owner_registry *reg = &fe->table->registry;
+	struct id_set owners = ID_SET_INIT;
+	int i, id;
 
-	if (fe == NULL || te == NULL)
-		return -1;
+	pthread_mutex_lock(&reg->mutex);
+	for (i = 0; i < te->owner_n; i++) {
+		struct file_owner *o = __owner_intern(reg, te->owners[i].ip,
+						      te->owners[i].port);
+		if (o != NULL)
+			id_set_add(&owners, o->id);
+	}
+	id_set_for_each(id, &fe->owners)
+		if (!id_set_test(&owners, id))
+			__file_set_del(&reg->owners[id]->files, fe);
+	id_set_for_each(id, &owners)
+		if (!id_set_test(&fe->owners, id))
+			__file_set_add(&reg->owners[id]->files, fe);
+	pthread_mutex_unlock(&reg->mutex);
+
+	id_set_clear(&fe->owners);
+	fe->owners = owners;
+}
 
-	pthread_rwlock_wrlock(&fe->rwlock);
-	if (te->timestamp > fe->timestamp) {
-		fe->timestamp = te->timestamp;
-		__peer_id_list_replace(fe, te);
-	} else if (te->timestamp == fe->timestamp)
-		__peer_id_list_add(&fe->owner_head, te);
-	else
-		ret = -1;
-	pthread_rwlock_unlock(&fe->rwlock);
+/**
+ * drop all the owners of a file entry
+ */
+static void __file_entry_clear_owners(struct file_entry *fe)
+{
+	struct owner_registry *reg = &fe->table->registry;
+	int id;
 
-	return ret;
+	pthread_mutex_lock(&reg->mutex);
+	id_set_for_each(id, &fe->owners)
+		__file_set_del(&reg->owners[id]->files, fe);
+	pthread_mutex_unlock(&reg->mutex);
+
+	id_set_clear(&fe->owners);
 }
 
-inline void file_entry_update_timestamp(struct file_entry *fe,
-					uint64_t timestamp)
+void file_entry_replace_owners(struct file_entry *fe,
+			       struct trans_file_entry *te)
 {
 	pthread_rwlock_wrlock(&fe->rwlock);
-	fe->timestamp = timestamp;
+	__file_entry_replace_owners(fe, te);
 	pthread_rwlock_unlock(&fe->rwlock);
+	file_entry_changed(fe);
 }
 
 /**
- * delete the file entry from the file table
- * @table: the file table which the file entry would be deleted from
- * @fe: the file entry which would be deleted
+ * add an owner to the file entry
+ * @return: 0 if succeeds, -1 otherwise
  */
-inline void file_entry_delete(struct file_table *table, struct file_entry *fe)
+int file_entry_add_owner(struct file_entry *fe, uint32_t ip, uint16_t port)
 {
-	if (table == NULL || fe == NULL)
-		return;
+	struct trans_file_entry te;
+
+	te.owner_n = 1;
+	te.owners[0].ip = ip;
+	te.owners[0].port = port;
 
 	pthread_rwlock_wrlock(&fe->rwlock);
-	__peer_id_list_destroy(&fe->owner_head);
-	hash_del(&fe->hlist);
+	__file_entry_add_owners(fe, &te);
 	pthread_rwlock_unlock(&fe->rwlock);
-	pthread_rwlock_destroy(&fe->rwlock);
-	free(fe);
+	file_entry_changed(fe);
 
-	table->n--;
+	return 0;
 }
 
 /**
- * file table operations
+ * remove an owner from the file entry
+ * @fe: the file entry whose owner would be removed
+ * @ip: ip of the owner
+ * @return: 0 if the owner is removed, -1 if it is not an owner
  */
-static inline
-struct file_entry *__file_table_search(struct file_table *table, char *name)
+int file_entry_delete_owner(struct file_entry *fe, uint32_t ip)
 {
-	struct file_entry *fe;
-	int key = ELFhash(name);
+	struct owner_registry *reg = &fe->table->registry;
+	struct file_owner *o;
+	int ret = -1;
 
-	hash_for_each_possible(table->file_htable, fe, hlist, key)
-		if (strcmp(fe->name, name) == 0)
-			return fe;
+	pthread_rwlock_wrlock(&fe->rwlock);
+	pthread_mutex_lock(&reg->mutex);
+	o = __owner_find(reg, ip);
+	if (o != NULL && id_set_del(&fe->owners, o->id)) {
+		__file_set_del(&o->files, fe);
+		ret = 0;
+	}
+	pthread_mutex_unlock(&reg->mutex);
+	pthread_rwlock_unlock(&fe->rwlock);
+	if (ret == 0)
+		file_entry_changed(fe);
 
-	return NULL;
+	return ret;
 }
 
 /**
- * init a file table
- * @table: the file table which would be inited
+ * get the owners of the file entry
+ * @n: returns the number of the owners
+ * @return: an array of the owners, which the caller frees, or NULL
  */
-inline void file_table_init(struct file_table *table)
+struct peer_id *file_entry_owners(struct file_entry *fe, int *n)
 {
-	if (table == NULL)
-		return;
+	struct owner_registry *reg = &fe->table->registry;
+	struct peer_id *owners;
+	int id, i = 0;
+
+	pthread_rwlock_rdlock(&fe->rwlock);
+	*n = id_set_count(&fe->owners);
+	owners = calloc(*n ? *n : 1, sizeof(struct peer_id));
+	if (owners == NULL) {
+		pthread_rwlock_unlock(&fe->rwlock);
+		_error("owners alloc failed\n");
+		*n = 0;
+		return NULL;
+	}
+	pthread_mutex_lock(&reg->mutex);
+	id_set_for_each(id, &fe->owners)
+		owners[i++] = reg->owners[id]->peer;
+	pthread_mutex_unlock(&reg->mutex);
+	pthread_rwlock_unlock(&fe->rwlock);
 
-	table->n = 0;
-	pthread_mutex_init(&table->mutex, NULL);
-	hash_init(table->file_htable);
+	return owners;
 }
 
+
 /**
- * find a file entry from the file table
- * @table: the file table which the file entry would be search from
- * @te: the trans file entry that would be searched
- * @return: the corresponding file entry with the trans file entry
+ * file entry operations
  */
-inline struct file_entry *file_table_find(struct file_table *table,
-					  struct trans_file_entry *te)
-{
-	struct file_entry *fe;
 
-	pthread_mutex_lock(&table->mutex);
-	fe = __file_table_search(table, te->name);
-	pthread_mutex_unlock(&table->mutex);
+/**
+ * file entry allocation which would do some default initialization,
+ * the entry starts with one reference, which is handed over to the
+ * file table when it is linked
+ * @table: the file table whose registry keeps the owners of the entry
+ */
+struct file_entry *file_entry_alloc(struct file_table *table)
+{
+	struct file_entry *fe = slab_alloc(&table->entry_pool);
+	if (fe == NULL)
+		return NULL;
+	bzero(fe, sizeof(struct file_entry));
+	id_set_init(&fe->owners);
+	INIT_HLIST_NODE(&fe->hlist);
+	fe->table = table;
+	pthread_rwlock_init(&fe->rwlock, NULL);
+	fe->ref = 1;
 
 	return fe;
 }
 
+inline void file_entry_get(struct file_entry *fe)
+{
+	__atomic_add_fetch(&fe->ref, 1, __ATOMIC_RELAXED);
+}
+
 /**
- * add a file entry to the file table. if the entry is already there,
- * it would update it.
- * @table: the file table which the file entry would be search from
- * @te: the trans file entry that would be added to
- * @return: the newly created file entry
+ * take a reference of an entry found without the shard locked, it
+ * fails if the last reference is gone already
  */
-struct file_entry *file_table_add(struct file_table *table,
-				  struct trans_file_entry *te)
+static bool file_entry_get_unless_zero(struct file_entry *fe)
 {
-	struct file_entry *fe = NULL;
-	
-	if (table == NULL || te == NULL)
-		return fe;
+	int ref = __atomic_load_n(&fe->ref, __ATOMIC_RELAXED);
 
-	pthread_mutex_lock(&table->mutex);
-	fe = __file_table_search(table, te->name);
-	if (fe == NULL) {
-		fe = file_entry_alloc();
-		if (fe == NULL) {
-			_error("file entry alloc failed\n");
-			goto out;
-		}
-		file_entry_fill_from(fe, te);
-		file_entry_add(table, fe);
-	} else
-		file_entry_update(fe, te);
-out:
-	pthread_mutex_unlock(&table->mutex);
+	do {
+		if (ref == 0)
+			return false;
+	} while (!__atomic_compare_exchange_n(&fe->ref, &ref, ref + 1, true,
+					      __ATOMIC_ACQUIRE,
+					      __ATOMIC_RELAXED));
 
-	return fe;
+	return true;
 }
 
-/**
- * update a file entry in the file table
- * @table: the file table which the file entry would be update from
- * @te: the trans file entry that would be updated
- * @return: 0 success, -1 otherwise
- */
-int file_table_update(struct file_table *table, struct trans_file_entry *te)
+static void file_entry_free(struct epoch_head *eh)
 {
-	struct file_entry *fe;
-	int ret = -1;
+	struct file_entry *fe = list_entry(eh, struct file_entry, eh);
 
-	if (table == NULL || te == NULL)
-		return ret;
+	__file_entry_clear_owners(fe);
+	path_put(&fe->table->paths, fe->path);
+	pthread_rwlock_destroy(&fe->rwlock);
+	slab_free(&fe->table->entry_pool, fe);
+}
 
-	pthread_mutex_lock(&table->mutex);
-	fe = __file_table_search(table, te->name);
+/**
+ * drop a reference of the file entry, the last one frees it once no
+ * lockless reader can see it any more
+ */
+void file_entry_put(struct file_entry *fe)
+{
 	if (fe == NULL)
-		_error("file '%s' does not exist!\n", te->name);
-	else {
-		file_entry_update(fe, te);
-		ret = 0;
-	}
-	pthread_mutex_unlock(&table->mutex);
+		return;
 
-	return ret;
+	if (__atomic_sub_fetch(&fe->ref, 1, __ATOMIC_ACQ_REL) == 0)
+		epoch_defer(&fe->eh, file_entry_free);
 }
 
 /**
- * delete a file entry from the file table
- * @table: the file table which the file entry would be deleted from
- * @te: the trans file entry that would be deleted
- * @return: 0 success, -1 otherwise
+ * build the name of the file entry
+ * @buf: MAX_NAME_LEN bytes at least, every interned name fits
+ * @return: buf
  */
-int file_table_delete(struct file_table *table, struct trans_file_entry *te)
+char *file_entry_name(struct file_entry *fe, char *buf)
 {
-	struct file_entry *fe;
-	int ret = -1;
+	if (fe->path == NULL)
+		buf[0] = '\0';
+	else
+		path_name(fe->path, buf, MAX_NAME_LEN);
 
-	if (table == NULL || te == NULL)
-		return ret;
+	return buf;
+}
 
-	pthread_mutex_lock(&table->mutex);
-	fe = __file_table_search(table, te->name);
-	if (fe != NULL) {
-		file_entry_delete(table, fe);
-		ret = 0;
+/**
+ * intern the name of the file entry into the paths of its table
+ * You MUST set it before the entry is linked to the table
+ * @return: 0 if succeeds, -1 otherwise. A name which does not fit in
+ *          MAX_NAME_LEN is refused, it would be cut into another one
+ *          on the wire
+ */
+int file_entry_set_name(struct file_entry *fe, const char *name)
+{
+	struct path_node *path;
+
+	if (strnlen(name, MAX_NAME_LEN) == MAX_NAME_LEN) {
+		_error("'%.32s...' is longer than %d bytes\n", name,
+				MAX_NAME_LEN - 1);
+		return -1;
 	}
-	pthread_mutex_unlock(&table->mutex);
+	path = path_get(&fe->table->paths, name);
+	if (path == NULL)
+		return -1;
+	path_put(&fe->table->paths, fe->path);
+	fe->path = path;
 
-	return ret;
+	return 0;
+}
+
+/**
+ * file shard operations, You MUST lock the mutex of the shard before
+ * calling them, except __file_shard_lookup() which is lockless
+ */
+
+static inline uint32_t file_name_hash(struct file_table *table,
+				      const char *name)
+{
+	return hash_str(name, table->seed);
 }
 
-void file_table_delete_owner(struct file_table *table, uint32_t ip)
+static inline struct file_shard *file_shard_of(struct file_table *table,
+					       uint32_t hash)
 {
-	struct file_entry *fe;
-	struct hlist_node *htmp;
-	struct list_head *pos, *tmp;
+	return table->shards + (hash & (FILE_SHARDS - 1));
+}
+
+static struct file_buckets *file_buckets_alloc(int bits)
+{
+	struct file_buckets *fb;
 	int i;
 
-	pthread_mutex_lock(&table->mutex);
-	hash_for_each_safe(table->file_htable, i, htmp, fe, hlist) {
-		pthread_rwlock_wrlock(&fe->rwlock);
-		list_for_each_safe(pos, tmp, &fe->owner_head) {
-			struct peer_id_list *p = list_entry(pos,
-					struct peer_id_list, l);
-			if (p->ip == ip) {
-				list_del(&p->l);
-				free(p);
-			}
-		}
-		pthread_rwlock_unlock(&fe->rwlock);
+	fb = malloc(sizeof(struct file_buckets) +
+			(1 << bits) * sizeof(struct hlist_head));
+	if (fb == NULL)
+		return NULL;
+	fb->bits = bits;
+	for (i = 0; i < 1 << bits; i++)
+		INIT_HLIST_HEAD(fb->heads + i);
 
-		if (list_empty(&fe->owner_head)) {
-			hash_del(&fe->hlist);
-			free(fe);
-		}
-	}
-	pthread_mutex_unlock(&table->mutex);
+	return fb;
 }
 
-void file_table_destroy(struct file_table *table)
+static void file_buckets_free(struct epoch_head *eh)
 {
-	struct file_entry *fe;
-	struct hlist_node *tmp;
-	int i;
+	free(list_entry(eh, struct file_buckets, eh));
+}
 
-	pthread_mutex_lock(&table->mutex);
-	hash_for_each_safe(table->file_htable, i, tmp, fe, hlist) {
-		if (fe == NULL)
-			continue;
-		file_entry_delete(table, fe);
-	}
-	pthread_mutex_unlock(&table->mutex);
+static inline struct hlist_head *file_bucket(struct file_buckets *fb,
+					     uint32_t hash)
+{
+	return fb->heads + hash_32(hash, fb->bits);
 }
 
-/**
- * destroy a file table
- * @table: the file table which would be destroyed
- */
-void file_table_print(struct file_table *table)
+/* readers retry when entries are moved between buckets under them */
+static inline void file_shard_write_begin(struct file_shard *sh)
 {
-	struct file_entry *fe;
-	struct hlist_node *tmp;
-	int i;
+	__atomic_store_n(&sh->seq, sh->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
 
-	printf("\n");
-	_debug("-------- File Table -------\n");
-	pthread_mutex_lock(&table->mutex);
-	hash_for_each_safe(table->file_htable, i, tmp, fe, hlist) {
-		_debug("%-60s %lu\n", fe->name, fe->timestamp);
-	}
-	pthread_mutex_unlock(&table->mutex);
-	_debug("----------- END ----------\n\n");
+static inline void file_shard_write_end(struct file_shard *sh)
+{
+	__atomic_store_n(&sh->seq, sh->seq + 1, __ATOMIC_RELEASE);
+}
+
+static inline unsigned int file_shard_read_begin(struct file_shard *sh)
+{
+	return __atomic_load_n(&sh->seq, __ATOMIC_ACQUIRE);
+}
+
+static inline bool file_shard_read_retry(struct file_shard *sh,
+					 unsigned int seq)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return (seq & 1) || __atomic_load_n(&sh->seq, __ATOMIC_RELAXED) != seq;
 }
 
 /**
- * fill a trans file table from the file table
- * @tft: the trans file table which would be filled
- * @ft: trans file table which would be filled from
+ * move up to @steps buckets of the old table into the new one
  */
-void trans_table_fill_from(struct trans_file_table *tft, struct file_table *ft)
+static void __file_shard_migrate(struct file_shard *sh, int steps)
 {
+	struct file_buckets *old = sh->old_buckets;
 	struct file_entry *fe;
 	struct hlist_node *tmp;
-	int i;
 
-	if (tft == NULL || ft == NULL)
+	if (old == NULL)
 		return;
 
-	bzero(tft, sizeof(struct trans_file_table));
-	pthread_mutex_lock(&ft->mutex);
-	hash_for_each_safe(ft->file_htable, i, tmp, fe, hlist) {
-		trans_entry_fill_from(tft->entries + tft->n, fe);
-		tft->n++;
+	file_shard_write_begin(sh);
+	while (steps-- > 0) {
+		struct hlist_head *head = old->heads + sh->migrated;
+		hlist_for_each_entry_safe(fe, tmp, head, hlist) {
+			hlist_del_rcu(&fe->hlist);
+			hlist_add_head_rcu(&fe->hlist, file_bucket(sh->buckets,
+						fe->hash));
+		}
+		if (++sh->migrated == 1 << old->bits) {
+			__atomic_store_n(&sh->old_buckets, NULL,
+					__ATOMIC_RELEASE);
+			epoch_defer(&old->eh, file_buckets_free);
+			break;
+		}
 	}
-	pthread_mutex_unlock(&ft->mutex);
+	file_shard_write_end(sh);
 }
- 
-bool has_same_owners(struct file_entry *fe, struct trans_file_entry *te)
+
+/**
+ * double the buckets of a shard, the entries are moved later
+ */
+static void __file_shard_grow(struct file_shard *sh)
+{
+	struct file_buckets *fb;
+
+	/* the last growing must have finished first */
+	if (sh->old_buckets != NULL)
+		__file_shard_migrate(sh, 1 << sh->old_buckets->bits);
+
+	fb = file_buckets_alloc(sh->buckets->bits + 1);
+	if (fb == NULL) {
+		_error("file shard grow to %d buckets failed\n",
+				1 << (sh->buckets->bits + 1));
+		return;
+	}
+	file_shard_write_begin(sh);
+	sh->migrated = 0;
+	__atomic_store_n(&sh->old_buckets, sh->buckets, __ATOMIC_RELEASE);
+	__atomic_store_n(&sh->buckets, fb, __ATOMIC_RELEASE);
+	file_shard_write_end(sh);
+}
+
+static void __file_shard_add(struct file_shard *sh, struct file_entry *fe,
+			     uint32_t hash)
+{
+	__file_shard_migrate(sh, FILE_SHARD_MIGRATE);
+	fe->hash = hash;
+	hlist_add_head_rcu(&fe->hlist, file_bucket(sh->buckets, hash));
+	sh->n++;
+	if (sh->n > FILE_SHARD_LOAD << sh->buckets->bits &&
+			sh->old_buckets == NULL)
+		__file_shard_grow(sh);
+	pthread_rwlock_wrlock(&fe->rwlock);
+	__file_entry_sum(fe, true);
+	pthread_rwlock_unlock(&fe->rwlock);
+	file_entry_changed(fe);
+}
+
+/**
+ * search a shard without locking it
+ * You MUST be inside an epoch, and check seq of the shard around it
+ */
+static struct file_entry *__file_shard_lookup(struct file_shard *sh,
+					      uint32_t hash, const char *name)
+{
+	struct file_buckets *fb;
+	struct file_entry *fe;
+	int len = strlen(name);
+
+	fb = __atomic_load_n(&sh->buckets, __ATOMIC_ACQUIRE);
+	hlist_for_each_entry_rcu(fe, file_bucket(fb, hash), hlist)
+		if (fe->hash == hash && path_equal(fe->path, name, len))
+			return fe;
+
+	fb = __atomic_load_n(&sh->old_buckets, __ATOMIC_ACQUIRE);
+	if (fb == NULL)
+		return NULL;
+	hlist_for_each_entry_rcu(fe, file_bucket(fb, hash), hlist)
+		if (fe->hash == hash && path_equal(fe->path, name, len))
+			return fe;
+
+	return NULL;
+}
+
+static struct file_entry *__file_shard_search(struct file_shard *sh,
+					      uint32_t hash, const char *name)
+{
+	__file_shard_migrate(sh, FILE_SHARD_MIGRATE);
+	return __file_shard_lookup(sh, hash, name);
+}
+
+/**
+ * call fn on every entry of a shard, fn may unlink the entry
+ */
+static void __file_shard_walk(struct file_shard *sh,
+			      void (*fn)(struct file_entry *fe, void *arg),
+			      void *arg)
+{
+	struct file_buckets *old = sh->old_buckets;
+	struct file_entry *fe;
+	struct hlist_node *tmp;
+	int i;
+
+	for (i = 0; i < 1 << sh->buckets->bits; i++)
+		hlist_for_each_entry_safe(fe, tmp, sh->buckets->heads + i, hlist)
+			fn(fe, arg);
+
+	if (old == NULL)
+		return;
+	for (i = sh->migrated; i < 1 << old->bits; i++)
+		hlist_for_each_entry_safe(fe, tmp, old->heads + i, hlist)
+			fn(fe, arg);
+}
+
+/**
+ * link the file entry to the file table
+ * @table: the file table that would be added to
+ * @fe: the file entry than would be added to the tale
+ */
+void file_entry_add(struct file_table *table, struct file_entry *fe)
+{
+	char name[MAX_NAME_LEN];
+	struct file_shard *sh;
+	uint32_t hash;
+
+	if (table == NULL || fe == NULL || fe->path == NULL)
+		return;
+
+	hash = file_name_hash(table, file_entry_name(fe, name));
+	sh = file_shard_of(table, hash);
+	pthread_mutex_lock(&sh->mutex);
+	__file_shard_add(sh, fe, hash);
+	pthread_mutex_unlock(&sh->mutex);
+}
+
+/**
+ * fill the file entry from trans file entry
+ * @fe: the file entry which to be filled
+ * @te: the trans file entry which would be fill from
+ */
+void file_entry_fill_from(struct file_entry *fe, struct trans_file_entry *te)
+{
+	if (fe == NULL || te == NULL)
+		return;
+
+	pthread_rwlock_wrlock(&fe->rwlock);
+	if (file_entry_set_name(fe, te->name) < 0)
+		_error("name of '%s' intern failed\n", te->name);
+	fe->timestamp = te->timestamp;
+	fe->type = te->file_type;
+	__file_entry_add_owners(fe, te);
+	pthread_rwlock_unlock(&fe->rwlock);
+}
+
+/**
+ * fill the trans file entry from file entry, with MAX_PEER_ENTRIES
+ * owners at most
+ * @fe: the trans file entry which to be filled
+ * @te: the file entry which would be fill from
+ */
+void trans_entry_fill_from(struct trans_file_entry *te, struct file_entry *fe)
+{
+	struct owner_registry *reg;
+	int id;
+
+	if (te == NULL || fe == NULL)
+		return;
+
+	reg = &fe->table->registry;
+	pthread_rwlock_rdlock(&fe->rwlock);
+	bzero(te, sizeof(struct trans_file_entry));
+	file_entry_name(fe, te->name);
+	te->timestamp = fe->timestamp;
+	te->file_type = fe->type;
+	pthread_mutex_lock(&reg->mutex);
+	id_set_for_each(id, &fe->owners) {
+		if (te->owner_n == MAX_PEER_ENTRIES)
+			break;
+		te->owners[te->owner_n++] = reg->owners[id]->peer;
+	}
+	pthread_mutex_unlock(&reg->mutex);
+	pthread_rwlock_unlock(&fe->rwlock);
+}
+
+/**
+ * update file entry according to the trans file entry information
+ * @fe: the file entry which is going to be updated
+ * @te: the trans file entry which is used to do the update
+ * return: 0 if succeds, otherwise -1
+ */
+int file_entry_update(struct file_entry *fe, struct trans_file_entry *te)
+{
+	int ret = 0;
+
+	if (fe == NULL || te == NULL)
+		return -1;
+
+	pthread_rwlock_wrlock(&fe->rwlock);
+	if (te->timestamp > fe->timestamp) {
+		fe->timestamp = te->timestamp;
+		__file_entry_replace_owners(fe, te);
+	} else if (te->timestamp == fe->timestamp)
+		__file_entry_add_owners(fe, te);
+	else
+		ret = -1;
+	if (ret == 0 && fe->digest != 0)
+		__file_entry_sum(fe, true);
+	pthread_rwlock_unlock(&fe->rwlock);
+	if (ret == 0)
+		file_entry_changed(fe);
+
+	return ret;
+}
+
+inline void file_entry_update_timestamp(struct file_entry *fe,
+					uint64_t timestamp)
+{
+	pthread_rwlock_wrlock(&fe->rwlock);
+	fe->timestamp = timestamp;
+	if (fe->digest != 0)
+		__file_entry_sum(fe, true);
+	pthread_rwlock_unlock(&fe->rwlock);
+	file_entry_changed(fe);
+}
+
+/**
+ * unlink the file entry from its shard and drop the reference of the
+ * table, it is freed when its other holders are done with it
+ * You MUST lock the mutex of the shard before calling it
+ * @sh: the shard which the file entry would be deleted from
+ * @fe: the file entry which would be deleted
+ */
+static void __file_entry_delete(struct file_shard *sh, struct file_entry *fe)
+{
+	hlist_del_rcu(&fe->hlist);
+	sh->n--;
+	pthread_rwlock_wrlock(&fe->rwlock);
+	__file_entry_sum(fe, false);
+	pthread_rwlock_unlock(&fe->rwlock);
+	file_entry_changed(fe);
+	file_entry_put(fe);
+}
+
+/**
+ * file table operations
+ */
+
+/**
+ * init a file table
+ * @table: the file table which would be inited
+ */
+void file_table_init(struct file_table *table)
+{
+	struct timespec ts;
+	int i;
+
+	if (table == NULL)
+		return;
+
+	/* names are hashed only inside this process, any seed works */
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	table->seed = (uint32_t)hash_mix_64((uint64_t)ts.tv_nsec ^
+			((uint64_t)getpid() << 32) ^ (uintptr_t)table);
+
+	for (i = 0; i < FILE_SHARDS; i++) {
+		struct file_shard *sh = table->shards + i;
+		pthread_mutex_init(&sh->mutex, NULL);
+		sh->seq = 0;
+		sh->n = 0;
+		sh->buckets = file_buckets_alloc(FILE_SHARD_INIT_BITS);
+		if (sh->buckets == NULL)
+			_error("file shard alloc failed\n");
+		sh->old_buckets = NULL;
+		sh->migrated = 0;
+	}
+	owner_registry_init(&table->registry);
+	if (slab_pool_init(&table->entry_pool, sizeof(struct file_entry)) < 0)
+		_error("file entry pool init failed\n");
+	if (path_trie_init(&table->paths) < 0)
+		_error("file path trie init failed\n");
+	pthread_mutex_init(&table->log.mutex, NULL);
+	table->log.gen = 0;
+	table->log.seq = 0;
+	table->log.changes = NULL;
+}
+
+/**
+ * find a file entry from the file table without locking it
+ * @table: the file table which the file entry would be search from
+ * @te: the trans file entry that would be searched
+ * @return: the corresponding file entry with the trans file entry,
+ *          with a reference taken, drop it by file_entry_put()
+ */
+struct file_entry *file_table_find(struct file_table *table,
+				   struct trans_file_entry *te)
+{
+	uint32_t hash = file_name_hash(table, te->name);
+	struct file_shard *sh = file_shard_of(table, hash);
+	struct file_entry *fe;
+	unsigned int seq;
+	int i;
+
+	epoch_enter();
+	for (i = 0; i < FILE_FIND_RETRIES; i++) {
+		seq = file_shard_read_begin(sh);
+		if (seq & 1)
+			continue;
+		fe = __file_shard_lookup(sh, hash, te->name);
+		if (file_shard_read_retry(sh, seq))
+			continue;
+		/* an entry being deleted counts as not found */
+		if (fe != NULL && !file_entry_get_unless_zero(fe))
+			fe = NULL;
+		epoch_exit();
+		return fe;
+	}
+	epoch_exit();
+
+	/* the shard keeps being rebuilt, wait for its writers */
+	pthread_mutex_lock(&sh->mutex);
+	fe = __file_shard_search(sh, hash, te->name);
+	if (fe != NULL)
+		file_entry_get(fe);
+	pthread_mutex_unlock(&sh->mutex);
+
+	return fe;
+}
+
+/**
+ * add a file entry to the file table. if the entry is already there,
+ * it would update it.
+ * @table: the file table which the file entry would be search from
+ * @te: the trans file entry that would be added to
+ * @return: the added or updated file entry with a reference taken,
+ *          drop it by file_entry_put()
+ */
+struct file_entry *file_table_add(struct file_table *table,
+				  struct trans_file_entry *te)
+{
+	struct file_entry *fe = NULL;
+	struct file_shard *sh;
+	uint32_t hash;
+
+	if (table == NULL || te == NULL)
+		return fe;
+
+	hash = file_name_hash(table, te->name);
+	sh = file_shard_of(table, hash);
+	pthread_mutex_lock(&sh->mutex);
+	fe = __file_shard_search(sh, hash, te->name);
+	if (fe == NULL) {
+		fe = file_entry_alloc(table);
+		if (fe == NULL) {
+			_error("file entry alloc failed\n");
+			goto out;
+		}
+		file_entry_fill_from(fe, te);
+		if (fe->path == NULL) {
+			file_entry_put(fe);
+			fe = NULL;
+			goto out;
+		}
+		__file_shard_add(sh, fe, hash);
+	} else
+		file_entry_update(fe, te);
+	file_entry_get(fe);
+out:
+	pthread_mutex_unlock(&sh->mutex);
+
+	return fe;
+}
+
+/**
+ * update a file entry in the file table
+ * @table: the file table which the file entry would be update from
+ * @te: the trans file entry that would be updated
+ * @return: 0 success, -1 otherwise
+ */
+int file_table_update(struct file_table *table, struct trans_file_entry *te)
+{
+	struct file_entry *fe;
+	struct file_shard *sh;
+	uint32_t hash;
+	int ret = -1;
+
+	if (table == NULL || te == NULL)
+		return ret;
+
+	hash = file_name_hash(table, te->name);
+	sh = file_shard_of(table, hash);
+	pthread_mutex_lock(&sh->mutex);
+	fe = __file_shard_search(sh, hash, te->name);
+	if (fe == NULL)
+		_error("file '%s' does not exist!\n", te->name);
+	else {
+		file_entry_update(fe, te);
+		ret = 0;
+	}
+	pthread_mutex_unlock(&sh->mutex);
+
+	return ret;
+}
+
+/**
+ * delete a file entry from the file table
+ * @table: the file table which the file entry would be deleted from
+ * @te: the trans file entry that would be deleted
+ * @return: 0 success, -1 otherwise
+ */
+int file_table_delete(struct file_table *table, struct trans_file_entry *te)
+{
+	struct file_entry *fe;
+	struct file_shard *sh;
+	uint32_t hash;
+	int ret = -1;
+
+	if (table == NULL || te == NULL)
+		return ret;
+
+	hash = file_name_hash(table, te->name);
+	sh = file_shard_of(table, hash);
+	pthread_mutex_lock(&sh->mutex);
+	fe = __file_shard_search(sh, hash, te->name);
+	if (fe != NULL) {
+		__file_entry_delete(sh, fe);
+		ret = 0;
+	}
+	pthread_mutex_unlock(&sh->mutex);
+
+	return ret;
+}
+
+/**
+ * call fn on every entry of the file table, one shard locked at a time
+ * You MUST NOT call other file table operations from fn
+ */
+void file_table_for_each(struct file_table *table,
+			 void (*fn)(struct file_entry *fe, void *arg),
+			 void *arg)
+{
+	int i;
+
+	for (i = 0; i < FILE_SHARDS; i++) {
+		struct file_shard *sh = table->shards + i;
+		pthread_mutex_lock(&sh->mutex);
+		__file_shard_walk(sh, fn, arg);
+		pthread_mutex_unlock(&sh->mutex);
+	}
+}
+
+/* the entries of a trans file table hashed as the file table does, so
+   that they can be probed by the cached hash of a file entry */
+struct join_index {
+	struct trans_file_table *tft;
+	uint32_t *hashes;	/* of the entries of tft */
+	int *slots;		/* index into tft, -1 if empty */
+	int mask;
+	struct file_entry **matched;
+	void (*fn)(struct file_entry *fe, struct trans_file_entry *te,
+		   void *arg);
+	void *arg;
+};
+
+static int join_index_init(struct join_index *ji, struct file_table *table,
+			   struct trans_file_table *tft)
+{
+	int i, j, size = FILE_SET_INIT_SIZE;
+
+	while (size < tft->n * 2)
+		size <<= 1;
+	ji->tft = tft;
+	ji->mask = size - 1;
+	ji->hashes = malloc((tft->n ? tft->n : 1) * sizeof(uint32_t));
+	ji->slots = malloc(size * sizeof(int));
+	if (ji->hashes == NULL || ji->slots == NULL) {
+		free(ji->hashes);
+		free(ji->slots);
+		return -1;
+	}
+	memset(ji->slots, 0xff, size * sizeof(int));
+
+	for (i = 0; i < tft->n; i++) {
+		const char *name = tft->entries[i].name;
+		uint32_t hash = file_name_hash(table, name);
+
+		ji->hashes[i] = hash;
+		for (j = hash & ji->mask; ji->slots[j] >= 0;
+				j = (j + 1) & ji->mask)
+			if (ji->hashes[ji->slots[j]] == hash &&
+					strcmp(tft->entries[ji->slots[j]].name,
+						name) == 0)
+				break;
+		/* the first of duplicated names wins */
+		if (ji->slots[j] < 0)
+			ji->slots[j] = i;
+	}
+
+	return 0;
+}
+
+static void join_index_destroy(struct join_index *ji)
+{
+	free(ji->hashes);
+	free(ji->slots);
+}
+
+static int join_index_probe(struct join_index *ji, struct file_entry *fe)
+{
+	int i, j;
+
+	for (j = fe->hash & ji->mask; (i = ji->slots[j]) >= 0;
+			j = (j + 1) & ji->mask) {
+		const char *name = ji->tft->entries[i].name;
+		if (ji->hashes[i] == fe->hash &&
+				path_equal(fe->path, name, strlen(name)))
+			return i;
+	}
+
+	return -1;
+}
+
+static void join_fn(struct file_entry *fe, void *arg)
+{
+	struct join_index *ji = arg;
+	int i = join_index_probe(ji, fe);
+
+	if (i < 0) {
+		ji->fn(fe, NULL, ji->arg);
+		return;
+	}
+	ji->fn(fe, ji->tft->entries + i, ji->arg);
+	file_entry_get(fe);
+	ji->matched[i] = fe;
+}
+
+/**
+ * join a trans file table with the file table in a single walk, the
+ * trans entries are hashed once instead of being searched per entry
+ * @fn: called on every file entry with its trans entry or NULL, with
+ *      the shard locked. You MUST NOT call other file table operations
+ *      from fn
+ * @matched: tft->n slots, filled with the file entry of every trans
+ *           entry with a reference taken, or NULL
+ * @return: 0 if succeeds, -1 otherwise
+ */
+int file_table_join(struct file_table *table, struct trans_file_table *tft,
+		    void (*fn)(struct file_entry *fe,
+			       struct trans_file_entry *te, void *arg),
+		    void *arg, struct file_entry **matched)
+{
+	struct join_index ji;
+
+	if (join_index_init(&ji, table, tft) < 0) {
+		_error("join index alloc failed\n");
+		return -1;
+	}
+	bzero(matched, tft->n * sizeof(struct file_entry *));
+	ji.matched = matched;
+	ji.fn = fn;
+	ji.arg = arg;
+	file_table_for_each(table, join_fn, &ji);
+	join_index_destroy(&ji);
+
+	return 0;
+}
+
+int file_table_count(struct file_table *table)
+{
+	int i, n = 0;
+
+	for (i = 0; i < FILE_SHARDS; i++) {
+		pthread_mutex_lock(&table->shards[i].mutex);
+		n += table->shards[i].n;
+		pthread_mutex_unlock(&table->shards[i].mutex);
+	}
+
+	return n;
+}
+
+static void parked_release(struct parked_file *parked, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		file_entry_put(parked[i].fe);
+	free(parked);
+}
+
+/**
+ * take the parked files out of an owner
+ * You MUST lock the mutex of the registry before calling it
+ */
+static struct parked_file *__owner_unpark(struct file_owner *o, int *n)
 {
-	struct list_head *pos;
-	int n = 0;
+	struct parked_file *parked = o->parked;
 
-	if (fe == NULL || te == NULL)
-		return false;
+	*n = o->parked_n;
+	o->parked = NULL;
+	o->parked_n = 0;
+
+	return parked;
+}
+
+/**
+ * release the parked files of the owners which left too long ago to
+ * catch up with the change log
+ */
+static void owner_registry_expire(struct file_table *table)
+{
+	struct owner_registry *reg = &table->registry;
+	uint64_t seq = file_table_seq(table, NULL);
+	struct parked_file *parked;
+	int i = 0, n;
+
+	while (1) {
+		pthread_mutex_lock(&reg->mutex);
+		for (; i < reg->n; i++)
+			if (reg->owners[i]->parked != NULL &&
+					reg->owners[i]->parked_seq +
+					FILE_LOG_LEN < seq)
+				break;
+		if (i == reg->n) {
+			pthread_mutex_unlock(&reg->mutex);
+			break;
+		}
+		parked = __owner_unpark(reg->owners[i], &n);
+		pthread_mutex_unlock(&reg->mutex);
+		parked_release(parked, n);
+	}
+}
+
+/**
+ * remove a peer from the owners of all its files, the entries left
+ * without owners are deleted
+ * @ip: ip of the peer
+ * @park: keep the files it had for file_table_restore_owner()
+ * @fn: called without locks on every entry which is still in the table
+ *      and has lost the owner
+ * @return: number of the entries the peer owned
+ */
+int file_table_delete_owner(struct file_table *table, uint32_t ip,
+			    bool park,
+			    void (*fn)(struct file_entry *fe, void *arg),
+			    void *arg)
+{
+	struct owner_registry *reg = &table->registry;
+	struct parked_file *parked = NULL, *old;
+	struct file_entry **files;
+	struct file_owner *o;
+	bool changed, empty;
+	int i, files_n = 0, parked_n = 0, old_n, n = 0;
+	uint64_t seq = file_table_seq(table, NULL);
+
+	/* take the files owned, the ones being freed drop themselves
+	   from the set anyway */
+	pthread_mutex_lock(&reg->mutex);
+	o = __owner_find(reg, ip);
+	if (o == NULL || o->files.n == 0) {
+		pthread_mutex_unlock(&reg->mutex);
+		return 0;
+	}
+	files = malloc(o->files.n * sizeof(struct file_entry *));
+	if (files == NULL) {
+		pthread_mutex_unlock(&reg->mutex);
+		_error("owned files alloc failed\n");
+		return -1;
+	}
+	for (i = 0; i < o->files.size; i++) {
+		struct file_entry *fe = o->files.slots[i];
+		if (fe != NULL && file_entry_get_unless_zero(fe))
+			files[files_n++] = fe;
+	}
+	pthread_mutex_unlock(&reg->mutex);
+
+	if (park) {
+		parked = malloc((files_n ? files_n : 1) *
+				sizeof(struct parked_file));
+		if (parked == NULL) {
+			_error("parked files alloc failed\n");
+			park = false;
+		}
+	}
+
+	for (i = 0; i < files_n; i++) {
+		struct file_entry *fe = files[i];
+		struct file_shard *sh = file_shard_of(table, fe->hash);
+		uint64_t timestamp;
+
+		pthread_mutex_lock(&sh->mutex);
+		changed = file_entry_delete_owner(fe, ip) == 0;
+		if (changed)
+			n++;
+		pthread_rwlock_rdlock(&fe->rwlock);
+		empty = id_set_empty(&fe->owners);
+		timestamp = fe->timestamp;
+		pthread_rwlock_unlock(&fe->rwlock);
+		if (hlist_unhashed(&fe->hlist))
+			changed = false;
+		else if (empty) {
+			__file_entry_delete(sh, fe);
+			changed = false;
+		}
+		pthread_mutex_unlock(&sh->mutex);
+
+		if (changed && fn != NULL)
+			fn(fe, arg);
+		if (park) {
+			/* the reference is kept by the parked file */
+			char name[MAX_NAME_LEN];
+			struct parked_file *pf = parked + parked_n++;
+			pf->fe = fe;
+			pf->timestamp = timestamp;
+			pf->digest = trans_entry_digest(file_entry_name(fe,
+						name), timestamp, fe->type);
+		} else
+			file_entry_put(fe);
+	}
+	free(files);
+
+	if (park) {
+		pthread_mutex_lock(&reg->mutex);
+		old = __owner_unpark(o, &old_n);
+		o->parked = parked;
+		o->parked_n = parked_n;
+		o->parked_seq = seq;
+		pthread_mutex_unlock(&reg->mutex);
+		parked_release(old, old_n);
+		owner_registry_expire(table);
+	}
+
+	return n;
+}
+
+/**
+ * give a returning owner back the files it had when it left, if the
+ * digest of the ones it has not changed since is still the same
+ * @peer: the returning owner
+ * @digest: sum of trans_entry_digest() of the files not changed
+ * @changed: the files changed since, they are not restored
+ * @fn: called without locks on every entry the owner is back to
+ * @return: number of the entries restored, -1 if the owner has to sync
+ *          in full
+ */
+int file_table_restore_owner(struct file_table *table, struct peer_id *peer,
+			     uint64_t digest, struct trans_file_table *changed,
+			     void (*fn)(struct file_entry *fe, void *arg),
+			     void *arg)
+{
+	struct owner_registry *reg = &table->registry;
+	struct parked_file *parked = NULL;
+	struct file_owner *o;
+	struct join_index ji;
+	uint64_t sum = 0;
+	int i, parked_n = 0, n = 0;
+
+	pthread_mutex_lock(&reg->mutex);
+	o = __owner_find(reg, peer->ip);
+	if (o != NULL)
+		parked = __owner_unpark(o, &parked_n);
+	pthread_mutex_unlock(&reg->mutex);
+	if (parked == NULL)
+		return -1;
+
+	if (join_index_init(&ji, table, changed) < 0) {
+		_error("join index alloc failed\n");
+		parked_release(parked, parked_n);
+		return -1;
+	}
+	for (i = 0; i < parked_n; i++) {
+		struct parked_file *pf = parked + i;
+		if (join_index_probe(&ji, pf->fe) < 0)
+			sum += pf->digest;
+		else {
+			file_entry_put(pf->fe);
+			pf->fe = NULL;
+		}
+	}
+	join_index_destroy(&ji);
+	if (sum != digest) {
+		parked_release(parked, parked_n);
+		return -1;
+	}
+
+	for (i = 0; i < parked_n; i++) {
+		struct parked_file *pf = parked + i;
+		struct file_entry *fe = pf->fe;
+		struct file_shard *sh;
+		bool linked, same;
+
+		if (fe == NULL)
+			continue;
+
+		sh = file_shard_of(table, fe->hash);
+		pthread_mutex_lock(&sh->mutex);
+		linked = !hlist_unhashed(&fe->hlist);
+		pthread_mutex_unlock(&sh->mutex);
+
+		if (!linked) {
+			/* deleted when it lost its last owner */
+			struct trans_file_entry te;
+			bzero(&te, sizeof(te));
+			file_entry_name(fe, te.name);
+			te.timestamp = pf->timestamp;
+			te.file_type = fe->type;
+			te.owner_n = 1;
+			te.owners[0] = *peer;
+			fe = file_table_add(table, &te);
+			if (fe == NULL)
+				continue;
+		} else {
+			/* a newer version comes to the owner from the log */
+			pthread_rwlock_rdlock(&fe->rwlock);
+			same = fe->timestamp == pf->timestamp;
+			pthread_rwlock_unlock(&fe->rwlock);
+			if (!same)
+				continue;
+			file_entry_add_owner(fe, peer->ip, peer->port);
+			file_entry_get(fe);
+		}
 
-	list_for_each(pos, &fe->owner_head)
 		n++;
+		if (fn != NULL)
+			fn(fe, arg);
+		file_entry_put(fe);
+	}
+	parked_release(parked, parked_n);
+
+	return n;
+}
+
+/**
+ * drop the files kept for the return of an owner
+ */
+void file_table_unpark_owner(struct file_table *table, uint32_t ip)
+{
+	struct owner_registry *reg = &table->registry;
+	struct parked_file *parked = NULL;
+	struct file_owner *o;
+	int n = 0;
+
+	pthread_mutex_lock(&reg->mutex);
+	o = __owner_find(reg, ip);
+	if (o != NULL)
+		parked = __owner_unpark(o, &n);
+	pthread_mutex_unlock(&reg->mutex);
+	parked_release(parked, n);
+}
+
+/**
+ * start to keep the change log of the file table, in a new generation
+ * @return: 0 if succeeds, -1 otherwise
+ */
+int file_table_log_init(struct file_table *table)
+{
+	struct file_log *log = &table->log;
+	struct timespec ts;
+
+	log->changes = calloc(FILE_LOG_LEN, sizeof(struct file_change));
+	if (log->changes == NULL) {
+		_error("file change log alloc failed\n");
+		return -1;
+	}
+	clock_gettime(CLOCK_REALTIME, &ts);
+	log->gen = hash_mix_64(((uint64_t)ts.tv_sec << 32 ^ ts.tv_nsec) ^
+			       (uint64_t)getpid());
+	log->seq = 0;
+
+	return 0;
+}
+
+/**
+ * @gen: returns the generation of the change log if not NULL
+ * @return: seq of the last change of the file table
+ */
+uint64_t file_table_seq(struct file_table *table, uint64_t *gen)
+{
+	struct file_log *log = &table->log;
+	uint64_t seq;
+
+	pthread_mutex_lock(&log->mutex);
+	seq = log->seq;
+	if (gen != NULL)
+		*gen = log->gen;
+	pthread_mutex_unlock(&log->mutex);
+
+	return seq;
+}
+
+/* by path, the newest change of a path first */
+static int change_path_cmp(const void *a, const void *b)
+{
+	const struct file_change *x = a, *y = b;
+
+	if (x->path != y->path)
+		return (uintptr_t)x->path < (uintptr_t)y->path ? -1 : 1;
+	return x->seq > y->seq ? -1 : x->seq < y->seq;
+}
+
+static int change_seq_cmp(const void *a, const void *b)
+{
+	const struct file_change *x = a, *y = b;
+
+	return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+/**
+ * replay the entries changed after a seq, each one once in the order
+ * of its last change. The entries still in the table come as
+ * FILE_MODIFY, the ones gone as FILE_DELETE
+ * @since: seq of the last change seen
+ * @fn: called without locks on every entry
+ * @return: number of the entries, -1 if the log doesn't reach back to
+ *          @since any more
+ */
+int file_table_changes(struct file_table *table, uint64_t since,
+		       void (*fn)(struct trans_file_entry *te, void *arg),
+		       void *arg)
+{
+	struct file_log *log = &table->log;
+	struct file_change *changes;
+	struct trans_file_entry te;
+	struct file_entry *fe;
+	int i, j, n;
+
+	pthread_mutex_lock(&log->mutex);
+	if (log->changes == NULL || since > log->seq ||
+			since + FILE_LOG_LEN < log->seq) {
+		pthread_mutex_unlock(&log->mutex);
+		return -1;
+	}
+	n = log->seq - since;
+	changes = malloc((n ? n : 1) * sizeof(struct file_change));
+	if (changes == NULL) {
+		pthread_mutex_unlock(&log->mutex);
+		_error("file changes alloc failed\n");
+		return -1;
+	}
+	for (i = 0; i < n; i++) {
+		changes[i] = log->changes[(since + 1 + i) & (FILE_LOG_LEN - 1)];
+		path_hold(&table->paths, changes[i].path);
+	}
+	pthread_mutex_unlock(&log->mutex);
+
+	/* only the last change of an entry matters */
+	qsort(changes, n, sizeof(struct file_change), change_path_cmp);
+	for (i = j = 0; i < n; i++) {
+		if (j > 0 && changes[j - 1].path == changes[i].path)
+			path_put(&table->paths, changes[i].path);
+		else
+			changes[j++] = changes[i];
+	}
+	n = j;
+	qsort(changes, n, sizeof(struct file_change), change_seq_cmp);
+
+	for (i = 0; i < n; i++) {
+		bzero(&te, sizeof(te));
+		path_name(changes[i].path, te.name, MAX_NAME_LEN);
+		fe = file_table_find(table, &te);
+		if (fe != NULL) {
+			trans_entry_fill_from(&te, fe);
+			te.op_type = FILE_MODIFY;
+			file_entry_put(fe);
+		} else {
+			te.file_type = changes[i].type;
+			te.op_type = FILE_DELETE;
+		}
+		fn(&te, arg);
+		path_put(&table->paths, changes[i].path);
+	}
+	free(changes);
+
+	return n;
+}
+
+/**
+ * directory summaries, every directory is summed up by the digests of
+ * the entries right under it, see __file_entry_sum(). Two tables have
+ * the same entries under a directory if its sums are the same in both
+ */
+
+/* directories collected from a walk of the table */
+struct dir_list {
+	struct path_trie *paths;
+	struct path_node **nodes;	/* references held */
+	int n;
+	int size;
+	bool failed;
+};
+
+static void dir_list_fn(struct file_entry *fe, void *arg)
+{
+	struct dir_list *dl = arg;
+	struct path_node **nodes, *dir = fe->path ? fe->path->parent : NULL;
+
+	/* siblings come mostly apart, duplicates are dropped later */
+	if (dir == NULL || dl->failed ||
+			(dl->n > 0 && dl->nodes[dl->n - 1] == dir))
+		return;
+
+	if (dl->n == dl->size) {
+		int size = dl->size ? dl->size * 2 : FILE_SET_INIT_SIZE;
+		nodes = realloc(dl->nodes, size * sizeof(*nodes));
+		if (nodes == NULL) {
+			dl->failed = true;
+			return;
+		}
+		dl->nodes = nodes;
+		dl->size = size;
+	}
+	path_hold(dl->paths, dir);
+	dl->nodes[dl->n++] = dir;
+}
+
+static int node_cmp(const void *a, const void *b)
+{
+	uintptr_t x = (uintptr_t)*(struct path_node **)a;
+	uintptr_t y = (uintptr_t)*(struct path_node **)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/**
+ * sort the nodes of a list and drop the duplicated ones
+ */
+static void dir_list_unique(struct dir_list *dl)
+{
+	int i, n = 0;
+
+	qsort(dl->nodes, dl->n, sizeof(struct path_node *), node_cmp);
+	for (i = 0; i < dl->n; i++) {
+		if (n > 0 && dl->nodes[n - 1] == dl->nodes[i])
+			path_put(dl->paths, dl->nodes[i]);
+		else
+			dl->nodes[n++] = dl->nodes[i];
+	}
+	dl->n = n;
+}
+
+static void dir_list_destroy(struct dir_list *dl)
+{
+	int i;
+
+	for (i = 0; i < dl->n; i++)
+		path_put(dl->paths, dl->nodes[i]);
+	free(dl->nodes);
+}
+
+static int trans_entry_name_cmp(const void *a, const void *b)
+{
+	const struct trans_file_entry *x = a, *y = b;
+
+	return strcmp(x->name, y->name);
+}
+
+/**
+ * sum up every directory of the file table
+ * @tft: an entry of type DIRECTORY is appended per directory, sorted
+ *       by name, its timestamp is the sum of the directory
+ * @return: 0 if succeeds, -1 otherwise
+ */
+int file_table_summary(struct file_table *table, struct trans_file_table *tft)
+{
+	struct dir_list dl;
+	int i, start = tft->n, ret = 0;
+
+	bzero(&dl, sizeof(dl));
+	dl.paths = &table->paths;
+	file_table_for_each(table, dir_list_fn, &dl);
+	if (dl.failed) {
+		_error("directory list alloc failed\n");
+		ret = -1;
+		goto out;
+	}
+	dir_list_unique(&dl);
+
+	for (i = 0; i < dl.n; i++) {
+		struct trans_file_entry *te = trans_table_append(tft);
+		if (te == NULL) {
+			ret = -1;
+			goto out;
+		}
+		path_name(dl.nodes[i], te->name, MAX_NAME_LEN);
+		te->timestamp = __atomic_load_n(&dl.nodes[i]->sum,
+						__ATOMIC_RELAXED);
+		te->file_type = DIRECTORY;
+	}
+	qsort(tft->entries + start, tft->n - start,
+			sizeof(struct trans_file_entry), trans_entry_name_cmp);
+
+out:
+	dir_list_destroy(&dl);
+	return ret;
+}
+
+/**
+ * compare the directory summaries of a peer with the ones of the file
+ * table
+ * @peer: the summaries of the peer, sorted by name here
+ * @same: the directories with the same sums are appended to it
+ * @differ: the others are appended to it, including the ones which
+ *          only one side has
+ * @return: 0 if succeeds, -1 otherwise
+ */
+int file_table_summary_diff(struct file_table *table,
+			    struct trans_file_table *peer,
+			    struct trans_file_table *same,
+			    struct trans_file_table *differ)
+{
+	struct trans_file_table own;
+	struct trans_file_entry *te;
+	int i = 0, j = 0, cmp, ret = -1;
+
+	trans_table_init(&own);
+	if (file_table_summary(table, &own) < 0)
+		goto out;
+	qsort(peer->entries, peer->n, sizeof(struct trans_file_entry),
+			trans_entry_name_cmp);
+
+	while (i < peer->n || j < own.n) {
+		if (i == peer->n)
+			cmp = 1;
+		else if (j == own.n)
+			cmp = -1;
+		else
+			cmp = strcmp(peer->entries[i].name, own.entries[j].name);
+
+		if (cmp == 0 && peer->entries[i].timestamp ==
+				own.entries[j].timestamp)
+			te = trans_table_append(same);
+		else
+			te = trans_table_append(differ);
+		if (te == NULL)
+			goto out;
+		*te = cmp <= 0 ? peer->entries[i] : own.entries[j];
+		if (cmp <= 0)
+			i++;
+		if (cmp >= 0)
+			j++;
+	}
+	ret = 0;
+
+out:
+	trans_table_destroy(&own);
+	return ret;
+}
+
+/**
+ * intern a set of directories
+ * @dirs: names of the directories
+ * @return: 0 if succeeds, -1 otherwise
+ */
+int dir_set_init(struct dir_set *ds, struct file_table *table,
+		 struct trans_file_table *dirs)
+{
+	struct dir_list dl;
+	int i;
+
+	bzero(&dl, sizeof(dl));
+	dl.paths = &table->paths;
+	dl.nodes = malloc((dirs->n ? dirs->n : 1) * sizeof(struct path_node *));
+	if (dl.nodes == NULL) {
+		_error("directory set alloc failed\n");
+		return -1;
+	}
+	for (i = 0; i < dirs->n; i++) {
+		struct path_node *node = path_get(dl.paths, dirs->entries[i].name);
+		if (node == NULL) {
+			dir_list_destroy(&dl);
+			return -1;
+		}
+		dl.nodes[dl.n++] = node;
+	}
+	dir_list_unique(&dl);
+	ds->nodes = dl.nodes;
+	ds->n = dl.n;
+
+	return 0;
+}
+
+/**
+ * tell whether the directory of an entry is in the set, the entries
+ * at the top, which are in no directory, are always in
+ */
+bool dir_set_has_parent(struct dir_set *ds, struct file_entry *fe)
+{
+	struct path_node *dir = fe->path ? fe->path->parent : NULL;
+
+	if (dir == NULL)
+		return true;
+
+	return bsearch(&dir, ds->nodes, ds->n, sizeof(struct path_node *),
+		       node_cmp) != NULL;
+}
+
+void dir_set_destroy(struct dir_set *ds, struct file_table *table)
+{
+	int i;
+
+	for (i = 0; i < ds->n; i++)
+		path_put(&table->paths, ds->nodes[i]);
+	free(ds->nodes);
+	ds->nodes = NULL;
+	ds->n = 0;
+}
+
+/* entries collected from a walk of the table, references held */
+struct entry_list {
+	struct dir_set *ds;
+	struct file_entry **files;
+	int n;
+	int size;
+};
+
+static void entry_list_fn(struct file_entry *fe, void *arg)
+{
+	struct entry_list *el = arg;
+	struct file_entry **files;
+
+	if (fe->path == NULL || fe->path->parent == NULL ||
+			!dir_set_has_parent(el->ds, fe))
+		return;
+
+	if (el->n == el->size) {
+		int size = el->size ? el->size * 2 : FILE_SET_INIT_SIZE;
+		files = realloc(el->files, size * sizeof(*files));
+		if (files == NULL) {
+			_error("entry list grow to %d failed\n", size);
+			return;
+		}
+		el->files = files;
+		el->size = size;
+	}
+	file_entry_get(fe);
+	el->files[el->n++] = fe;
+}
+
+/**
+ * add a peer to the owners of every entry right under a set of
+ * directories, which the peer has the same as the table
+ * @fn: called without locks on every entry whose owners are changed
+ * @return: number of the entries
+ */
+int file_table_own_dirs(struct file_table *table, struct dir_set *ds,
+			struct peer_id *peer,
+			void (*fn)(struct file_entry *fe, void *arg),
+			void *arg)
+{
+	struct entry_list el;
+	int i;
+
+	bzero(&el, sizeof(el));
+	el.ds = ds;
+	file_table_for_each(table, entry_list_fn, &el);
+
+	for (i = 0; i < el.n; i++) {
+		struct file_entry *fe = el.files[i];
+		if (file_entry_add_owner(fe, peer->ip, peer->port) == 0 &&
+				fn != NULL)
+			fn(fe, arg);
+		file_entry_put(fe);
+	}
+	free(el.files);
+
+	return el.n;
+}
+
+static void destroy_fn(struct file_entry *fe, void *arg)
+{
+	id_set_clear(&fe->owners);
+	pthread_rwlock_destroy(&fe->rwlock);
+}
+
+static void owner_registry_destroy(struct owner_registry *reg)
+{
+	int i;
+
+	/* the parked entries are released with the others */
+	for (i = 0; i < reg->n; i++) {
+		free(reg->owners[i]->files.slots);
+		free(reg->owners[i]->parked);
+		free(reg->owners[i]);
+	}
+	free(reg->owners);
+	reg->owners = NULL;
+	reg->n = reg->size = 0;
+	hash_init(reg->by_ip);
+}
+
+/**
+ * destroy the file table and release all its entries at once
+ * You MUST NOT use any entry of the table after it, even one which
+ * you hold a reference of
+ */
+void file_table_destroy(struct file_table *table)
+{
+	int i;
+
+	/* the entries deleted before are freed one by one first */
+	epoch_synchronize();
+
+	for (i = 0; i < FILE_SHARDS; i++) {
+		struct file_shard *sh = table->shards + i;
+		pthread_mutex_lock(&sh->mutex);
+		__file_shard_walk(sh, destroy_fn, NULL);
+		free(sh->buckets);
+		free(sh->old_buckets);
+		sh->buckets = sh->old_buckets = NULL;
+		sh->n = 0;
+		pthread_mutex_unlock(&sh->mutex);
+	}
+
+	pthread_mutex_lock(&table->registry.mutex);
+	owner_registry_destroy(&table->registry);
+	pthread_mutex_unlock(&table->registry.mutex);
+	slab_pool_destroy(&table->entry_pool);
+	free(table->log.changes);
+	table->log.changes = NULL;
+	path_trie_destroy(&table->paths);
+}
+
+static void print_fn(struct file_entry *fe, void *arg)
+{
+	char name[MAX_NAME_LEN];
+
+	_debug("%-60s %lu\n", file_entry_name(fe, name), fe->timestamp);
+}
+
+/**
+ * print a file table
+ * @table: the file table which would be printed
+ */
+void file_table_print(struct file_table *table)
+{
+	printf("\n");
+	_debug("-------- File Table -------\n");
+	file_table_for_each(table, print_fn, NULL);
+	_debug("----------- END ----------\n\n");
+}
+
+/**
+ * stream the entries of the file table
+ * @ft: the file table which would be streamed
+ * @ts: the trans stream which the entries would be added to
+ * @op: the operation type of every streamed entry
+ * @scope: only the entries under these directories, NULL for all
+ * @return: 0 if succeeds, -1 otherwise
+ */
+struct stream_arg {
+	struct trans_stream *ts;
+	enum operation_type op;
+	struct dir_set *scope;
+	int ret;
+};
+
+static void stream_fn(struct file_entry *fe, void *arg)
+{
+	struct stream_arg *sa = arg;
+	struct trans_file_entry te;
+
+	if (sa->scope != NULL && !dir_set_has_parent(sa->scope, fe))
+		return;
+
+	trans_entry_fill_from(&te, fe);
+	te.op_type = sa->op;
+	if (trans_stream_add(sa->ts, &te) < 0)
+		sa->ret = -1;
+}
+
+int file_table_stream(struct file_table *ft, struct trans_stream *ts,
+		      enum operation_type op, struct dir_set *scope)
+{
+	struct stream_arg sa = { .ts = ts, .op = op, .scope = scope, .ret = 0 };
+
+	if (ft == NULL || ts == NULL)
+		return -1;
+
+	file_table_for_each(ft, stream_fn, &sa);
+
+	return sa.ret;
+}
+
+bool has_same_owners(struct file_entry *fe, struct trans_file_entry *te)
+{
+	struct owner_registry *reg;
+	struct id_set owners = ID_SET_INIT;
+	bool same = true;
+	int i;
 
-	if (n != te->owner_n)
+	if (fe == NULL || te == NULL)
 		return false;
 
-	n = 0;
-	list_for_each(pos, &fe->owner_head) {
-		struct peer_id_list *p = list_entry(pos, struct peer_id_list, l);
-		if (p->ip != te->owners[n].ip || p->port != te->owners[n].port)
-			return false;
-		n++;
+	reg = &fe->table->registry;
+	pthread_rwlock_rdlock(&fe->rwlock);
+	pthread_mutex_lock(&reg->mutex);
+	for (i = 0; i < te->owner_n && same; i++) {
+		struct file_owner *o = __owner_find(reg, te->owners[i].ip);
+		if (o == NULL)
+			same = false;
+		else
+			id_set_add(&owners, o->id);
 	}
+	pthread_mutex_unlock(&reg->mutex);
+	if (same)
+		same = id_set_equal(&owners, &fe->owners);
+	pthread_rwlock_unlock(&fe->rwlock);
+	id_set_clear(&owners);
 
-	return true;
+	return same;
 }
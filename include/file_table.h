@@ -9,34 +9,142 @@
 #include <hash.h>
 #include <list.h>
 #include <trans_file_table.h>
-
-struct peer_id_list {
-	uint32_t ip;
-	uint16_t port;
-	struct list_head l;
-};
+#include <utility/epoch.h>
+#include <utility/id_set.h>
+#include <utility/path_trie.h>
+#include <utility/slab.h>
 
 struct file_entry {
-	char name[MAX_NAME_LEN];
+	struct path_node *path;	/* interned name, fixed once linked */
+	uint64_t digest;	/* in the sum of its directory, 0 if not */
 	uint64_t timestamp;
 	enum file_type type;
-	struct list_head owner_head;
+	struct id_set owners;	/* ids of the owners in the registry */
 	struct hlist_node hlist;
+	uint32_t hash;		/* of name, kept for resizing */
 	pthread_rwlock_t rwlock;
+	int ref;		/* one held by the table while linked */
+	struct file_table *table;	/* whose registry owners are in */
+	struct epoch_head eh;
 };
 
-struct file_table {
+#define FILE_SHARDS		(1 << FILE_SHARD_BITS)
+#define FILE_SHARD_INIT_BITS	6	/* initial buckets of a shard */
+#define FILE_SHARD_LOAD		2	/* entries per bucket to grow at */
+#define FILE_SHARD_MIGRATE	4	/* old buckets moved per operation */
+#define FILE_FIND_RETRIES	4	/* lockless tries before locking */
+
+struct file_buckets {
+	struct epoch_head eh;
+	int bits;			/* 1 << bits heads */
+	struct hlist_head heads[];
+};
+
+/* a shard of the file table. Writers lock it on their own, and it
+   grows by doubling its buckets, the entries are moved over
+   incrementally, a few old buckets on each later write of the shard.
+   Readers do not lock, they walk the buckets inside an epoch and
+   retry if seq tells them that entries were moved meanwhile */
+struct file_shard {
+	pthread_mutex_t mutex;
+	unsigned int seq;		/* odd while entries are moved */
+	int n;
+	struct file_buckets *buckets;
+	struct file_buckets *old_buckets;	/* being migrated, or NULL */
+	int migrated;			/* old buckets moved so far */
+};
+
+#define FILE_OWNER_BITS		8	/* ip buckets of the registry */
+#define FILE_SET_INIT_SIZE	16	/* power of 2 */
+
+/* an open-addressing hash set of file entries with linear probing, at
+   most half full */
+struct file_set {
+	struct file_entry **slots;
+	int size;
 	int n;
+};
+
+/* a file an owner had when it left */
+struct parked_file {
+	struct file_entry *fe;		/* a reference held */
+	uint64_t timestamp;		/* of the version it had */
+	uint64_t digest;		/* trans_entry_digest() of it */
+};
+
+/* a peer which owns files, its id is never reused */
+struct file_owner {
+	struct peer_id peer;
+	int id;
+	struct hlist_node hlist;	/* by ip */
+	struct file_set files;		/* entries owned */
+	struct parked_file *parked;	/* files kept for its return */
+	int parked_n;
+	uint64_t parked_seq;		/* change log seq when it left */
+};
+
+/* owners interned into small ids, so that the owners of an entry are
+   kept as a set of ids, and indexed back to the files they own, so
+   that a peer can be removed without walking the whole table. Lock
+   order is shard mutex, entry rwlock, then this mutex */
+struct owner_registry {
 	pthread_mutex_t mutex;
-	DECLARE_HASHTABLE(file_htable, FILE_HASH_BITS);
+	DECLARE_HASHTABLE(by_ip, FILE_OWNER_BITS);
+	struct file_owner **owners;	/* by id */
+	int n;
+	int size;
+};
+
+#define FILE_LOG_LEN		65536	/* changes kept, power of 2 */
+
+/* a change of the file table, the entry is looked up again when the
+   change is replayed */
+struct file_change {
+	uint64_t seq;
+	struct path_node *path;		/* a reference held */
+	enum file_type type;
+};
+
+/* the last FILE_LOG_LEN changes of the file table, numbered from 1 on
+   within a generation, so that a peer can catch up with the changes
+   it missed. Only the tables which set it up keep one */
+struct file_log {
+	pthread_mutex_t mutex;
+	uint64_t gen;
+	uint64_t seq;			/* of the last change */
+	struct file_change *changes;	/* ring by seq, or NULL */
+};
+
+/* a set of directories of a file table */
+struct dir_set {
+	struct path_node **nodes;	/* sorted, references held */
+	int n;
+};
+
+/* entries are spread over the shards by the hash of their names */
+struct file_table {
+	uint32_t seed;		/* of the name hash */
+	struct file_shard shards[FILE_SHARDS];
+	struct owner_registry registry;
+	struct slab_pool entry_pool;	/* of the file entries */
+	struct path_trie paths;		/* names of the entries */
+	struct file_log log;
 };
 
-void peer_id_list_replace(struct file_entry *fe, struct trans_file_entry *te);
+void file_entry_replace_owners(struct file_entry *fe,
+			       struct trans_file_entry *te);
 bool has_same_owners(struct file_entry *fe, struct trans_file_entry *te);
 
-struct file_entry *file_entry_alloc();
+struct file_entry *file_entry_alloc(struct file_table *table);
+void file_entry_get(struct file_entry *fe);
+void file_entry_put(struct file_entry *fe);
+char *file_entry_name(struct file_entry *fe, char *buf);
+int file_entry_set_name(struct file_entry *fe, const char *name);
 void file_entry_add(struct file_table *table, struct file_entry *fe);
 int file_entry_update(struct file_entry *fe, struct trans_file_entry *te);
+int file_entry_add_owner(struct file_entry *fe, uint32_t ip, uint16_t port);
+int file_entry_delete_owner(struct file_entry *fe, uint32_t ip);
+struct peer_id *file_entry_owners(struct file_entry *fe, int *n);
 void file_entry_update_timestamp(struct file_entry *fe, uint64_t timestamp);
 void file_entry_fill_from(struct file_entry *fe, struct trans_file_entry *te);
 void trans_entry_fill_from(struct trans_file_entry *te, struct file_entry *fe);
@@ -48,10 +156,45 @@ struct file_entry *file_table_find(struct file_table *table,
 				   struct trans_file_entry *te);
 int file_table_update(struct file_table *table, struct trans_file_entry *te);
 int file_table_delete(struct file_table *table, struct trans_file_entry *te);
-void file_table_delete_owner(struct file_table *table, uint32_t ip);
+int file_table_delete_owner(struct file_table *table, uint32_t ip,
+			    bool park,
+			    void (*fn)(struct file_entry *fe, void *arg),
+			    void *arg);
+int file_table_restore_owner(struct file_table *table, struct peer_id *peer,
+			     uint64_t digest, struct trans_file_table *changed,
+			     void (*fn)(struct file_entry *fe, void *arg),
+			     void *arg);
+void file_table_unpark_owner(struct file_table *table, uint32_t ip);
+int file_table_log_init(struct file_table *table);
+uint64_t file_table_seq(struct file_table *table, uint64_t *gen);
+int file_table_changes(struct file_table *table, uint64_t since,
+		       void (*fn)(struct trans_file_entry *te, void *arg),
+		       void *arg);
 void file_table_destroy(struct file_table *table);
 void file_table_print(struct file_table *table);
+int file_table_summary(struct file_table *table, struct trans_file_table *tft);
+int file_table_summary_diff(struct file_table *table,
+			    struct trans_file_table *peer,
+			    struct trans_file_table *same,
+			    struct trans_file_table *differ);
+int dir_set_init(struct dir_set *ds, struct file_table *table,
+		 struct trans_file_table *dirs);
+bool dir_set_has_parent(struct dir_set *ds, struct file_entry *fe);
+void dir_set_destroy(struct dir_set *ds, struct file_table *table);
+int file_table_own_dirs(struct file_table *table, struct dir_set *ds,
+			struct peer_id *peer,
+			void (*fn)(struct file_entry *fe, void *arg),
+			void *arg);
+int file_table_count(struct file_table *table);
+void file_table_for_each(struct file_table *table,
+			 void (*fn)(struct file_entry *fe, void *arg),
+			 void *arg);
+int file_table_join(struct file_table *table, struct trans_file_table *tft,
+		    void (*fn)(struct file_entry *fe,
+			       struct trans_file_entry *te, void *arg),
+		    void *arg, struct file_entry **matched);
 
-void trans_table_fill_from(struct trans_file_table *tft, struct file_table *ft);
+int file_table_stream(struct file_table *ft, struct trans_stream *ts,
+		      enum operation_type op, struct dir_set *scope);
 
 #endif
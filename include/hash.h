@@ -3,27 +3,60 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
 #include <list.h>
 
 /* 2^31 + 2^29 - 2^25 + 2^22 - 2^19 - 2^16 + 1 */
 #define GOLDEN_RATIO_PRIME_32 0x9e370001UL
 
+/* 2^64 / golden ratio, and the multipliers of the murmur3 finalizer */
+#define GOLDEN_RATIO_64 0x9e3779b97f4a7c15ULL
+#define HASH_MIX_64_1 0xff51afd7ed558ccdULL
+#define HASH_MIX_64_2 0xc4ceb9fe1a85ec53ULL
+
 #define ARRAY_SIZE(arr) (sizeof(arr) / sizeof((arr)[0]))
 
 
-static inline unsigned long ELFhash(char *key)
+static inline uint64_t hash_mix_64(uint64_t h)
 {
-	unsigned long h=0;
-	while (*key) {
-		h = (h << 4) + *key++;
-		unsigned long g = h & 0Xf0000000L;
-		if (g) 
-			h ^= g >> 24; 
-		h &= ~g; 
-	}   
+	h ^= h >> 33;
+	h *= HASH_MIX_64_1;
+	h ^= h >> 33;
+	h *= HASH_MIX_64_2;
+	h ^= h >> 33;
 	return h;
 }
 
+/**
+ * hash bytes 8 at a time, every byte changes all the bits of the
+ * result, so long names sharing a prefix still spread well
+ * @seed: picked per table, so that the chains can not be foreseen
+ */
+static inline uint32_t hash_mem(const void *key, size_t len, uint32_t seed)
+{
+	const char *p = key;
+	uint64_t h = seed ^ (len * GOLDEN_RATIO_64);
+	uint64_t w;
+
+	for (; len >= sizeof(w); p += sizeof(w), len -= sizeof(w)) {
+		memcpy(&w, p, sizeof(w));
+		w *= HASH_MIX_64_1;
+		h ^= (w << 31) | (w >> 33);
+		h = ((h << 27) | (h >> 37)) * 5 + 0x52dce729;
+	}
+	w = 0;
+	memcpy(&w, p, len);
+	h ^= w * HASH_MIX_64_2;
+
+	h = hash_mix_64(h);
+	return (uint32_t)(h ^ (h >> 32));
+}
+
+static inline uint32_t hash_str(const char *key, uint32_t seed)
+{
+	return hash_mem(key, strlen(key), seed);
+}
+
 static inline uint32_t hash_32(uint32_t val, unsigned int bits)
 {
 	uint32_t hash = val * GOLDEN_RATIO_PRIME_32;
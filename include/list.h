@@ -121,4 +121,38 @@ static inline void hlist_del_init(struct hlist_node *n)
 	     pos && ({ n = pos->member.next; 1; });                     \
 	     pos = hlist_entry_safe(n, typeof(*pos), member))
 
+/*
+ * Variants for lists walked by lockless readers while writers, who
+ * still serialize among themselves, change them. A node is published
+ * only after it is fully set up, and a deleted node keeps its next
+ * pointer so that a reader standing on it can go on walking.
+ */
+static inline void hlist_add_head_rcu(struct hlist_node *n,
+				      struct hlist_head *h)
+{
+	struct hlist_node *first = h->first;
+	__atomic_store_n(&n->next, first, __ATOMIC_RELAXED);
+	n->pprev = &h->first;
+	if (first)
+		first->pprev = &n->next;
+	__atomic_store_n(&h->first, n, __ATOMIC_RELEASE);
+}
+
+static inline void hlist_del_rcu(struct hlist_node *n)
+{
+	struct hlist_node *next = n->next;
+	struct hlist_node **pprev = n->pprev;
+	__atomic_store_n(pprev, next, __ATOMIC_RELEASE);
+	if (next)
+		next->pprev = pprev;
+	n->pprev = NULL;
+}
+
+#define hlist_for_each_entry_rcu(pos, head, member)                     \
+	for (pos = hlist_entry_safe(__atomic_load_n(&(head)->first,     \
+			__ATOMIC_ACQUIRE), typeof(*(pos)), member);     \
+	     pos;                                                       \
+	     pos = hlist_entry_safe(__atomic_load_n(&(pos)->member.next, \
+			__ATOMIC_ACQUIRE), typeof(*(pos)), member))
+
 #endif
@@ -15,6 +15,12 @@
 			      (pkt)->hdr.data_len)
 #define GET_TIMESTAMP(tv) ((tv)->tv_sec * 1000000 + (tv)->tv_usec)
 
+/* protocol name a peer puts in PEER_REGISTER to ask for framed segments */
+#define PROTOCOL_FRAMED		"dartsync/framed"
+
+/* length of ttop_control_info understood by legacy peers */
+#define LEGACY_CONTROL_INFO_LEN	(2 * sizeof(int))
+
 
 /**
  * definition of packet from peer to tracker
@@ -26,6 +32,8 @@ enum ptot_packet_type {
 	PEER_KEEP_ALIVE,
 	PEER_FILE_UPDATE,
 	PEER_SYNC,
+	PEER_RESYNC,
+	PEER_SUMMARY,
 };
 
 /* definition of packet header from peer to tracker */
@@ -54,6 +62,8 @@ enum ttop_packet_type {
 	TRACKER_BROADCAST,
 	TRACKER_SYNC,
 	TRACKER_CLOSE,
+	TRACKER_RESYNC,
+	TRACKER_SUMMARY,
 };
 
 /* definition of packet header from tracker to peer */
@@ -62,10 +72,37 @@ struct ttop_packet_header {
 	uint16_t data_len;	/* length of data */
 };
 
+/* features the tracker agreed on in TRACKER_ACCEPT */
+enum tracker_feature {
+	FEATURE_FRAMED = 1 << 0,	/* length-prefixed segments */
+	FEATURE_RESYNC = 1 << 1,	/* PEER_RESYNC and TRACKER_RESYNC */
+	FEATURE_SUMMARY = 1 << 2,	/* PEER_SUMMARY and TRACKER_SUMMARY */
+};
+
+/* a full sync may start with directory summaries. PEER_SUMMARY chunks
+   carry an entry of type DIRECTORY per directory of the peer, whose
+   timestamp is the sum of the trans_entry_digest() of the entries
+   right under it. TRACKER_SUMMARY chunks tell the directories whose
+   sums differ, the PEER_SYNC chunks which follow are then only the
+   entries under them, and the entries at the top of the targets */
+
+/* where a peer left the tracker's file table. PEER_RESYNC carries the
+   point the peer synced to last, its PEER_SYNC chunks which follow
+   are then only the files changed since. TRACKER_RESYNC comes before
+   the TRACKER_SYNC chunks, it carries the point they bring the peer
+   to, or tells the peer to send its whole table */
+struct sync_point {
+	uint64_t gen;		/* generation of the tracker's file table */
+	uint64_t seq;		/* last change of the table seen */
+	uint64_t digest;	/* PEER_RESYNC: of the files not changed */
+	uint32_t accepted;	/* TRACKER_RESYNC: 0 if a full sync is needed */
+};
+
 /* peer control information which is setup by tracker */
 struct ttop_control_info {
 	int interval;		/* time interval that the peer should send alive message */
 	int piece_len;		/* piece length */
+	int features;		/* agreed features, never sent to legacy peers */
 };
 
 /* definition of packet structure from tracker to peer */
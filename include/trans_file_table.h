@@ -2,11 +2,14 @@
 #define TRANS_FILE_TABLE_H
 
 #include <stdint.h>
+#include <stdbool.h>
 
 #include <consts.h>
 
-#define trans_table_len(table) (sizeof(int) +	\
-		(table)->n * sizeof(struct trans_file_entry))
+/* a file table is sent as a sequence of chunks, each one fits into
+   the data of a single packet */
+#define TRANS_CHUNK_LEN		(MAX_PKT_DATA_LEN - 1)
+#define TRANS_CHUNK_MORE	0x1	/* more chunks follow */
 
 enum file_type {
 	REGULAR,
@@ -35,9 +38,67 @@ struct trans_file_entry {
 	struct peer_id owners[MAX_PEER_ENTRIES];
 };
 
+/* a growable array of trans file entries */
 struct trans_file_table {
 	int n;
-	struct trans_file_entry entries[MAX_FILE_ENTRIES];
+	int size;		/* allocated entries */
+	struct trans_file_entry *entries;
 };
 
+/* header of a chunk in the data of a packet, packed entries follow
+   it. An entry is encoded as
+	varint	bytes of name shared with the previous entry
+	varint	length of the rest of name, then the bytes
+	varint	zigzag delta of timestamp to the previous entry
+	varint	op_type, file_type, owner_n
+	owner_n	times: 4 bytes ip as is, varint port
+   the previous entry is reset at the start of every chunk, so that a
+   chunk can always be decoded on its own */
+struct trans_chunk_header {
+	uint16_t flags;		/* TRANS_CHUNK_MORE */
+	uint16_t n;		/* number of entries in this chunk */
+};
+
+/* writer side of a streamed file table */
+struct trans_stream {
+	char *data;		/* chunk buffer of TRANS_CHUNK_LEN bytes */
+	int len;		/* bytes used in the chunk */
+	int n;			/* entries in the chunk */
+	int total;		/* entries streamed so far */
+	bool reply;		/* send the last chunk even if it is empty */
+	char prev_name[MAX_NAME_LEN];	/* last entry in the chunk */
+	uint64_t prev_timestamp;
+	int (*flush)(struct trans_stream *ts, int len);	/* send a chunk */
+};
+
+/* reader side of a single chunk */
+struct trans_chunk_reader {
+	char *data;
+	int len;
+	int pos;		/* offset of the next packed entry */
+	int left;		/* entries not read yet */
+	bool more;		/* more chunks follow this one */
+	char prev_name[MAX_NAME_LEN];	/* last entry read */
+	uint64_t prev_timestamp;
+};
+
+void trans_table_init(struct trans_file_table *tft);
+struct trans_file_entry *trans_table_append(struct trans_file_table *tft);
+void trans_table_destroy(struct trans_file_table *tft);
+uint64_t trans_entry_digest(const char *name, uint64_t timestamp,
+			    uint16_t file_type);
+
+void trans_stream_init(struct trans_stream *ts, char *data,
+		       int (*flush)(struct trans_stream *ts, int len));
+int trans_stream_add(struct trans_stream *ts, struct trans_file_entry *te);
+int trans_stream_add_table(struct trans_stream *ts,
+			   struct trans_file_table *tft);
+int trans_stream_finish(struct trans_stream *ts);
+
+int trans_chunk_open(struct trans_chunk_reader *tr, char *data, int len);
+int trans_chunk_next(struct trans_chunk_reader *tr,
+		     struct trans_file_entry *te);
+int trans_chunk_read_table(struct trans_chunk_reader *tr,
+			   struct trans_file_table *tft);
+
 #endif
@@ -0,0 +1,21 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+#include <stdint.h>
+
+#define EPOCH_RECLAIM_BATCH	64	/* deferred frees per reclaim try */
+
+/* an object whose free is deferred until no reader can see it, it is
+   embedded into the object */
+struct epoch_head {
+	struct epoch_head *next;
+	uint64_t epoch;		/* global epoch when it was retired */
+	void (*free)(struct epoch_head *eh);
+};
+
+void epoch_enter();
+void epoch_exit();
+void epoch_defer(struct epoch_head *eh, void (*free)(struct epoch_head *eh));
+void epoch_synchronize();
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef ID_SET_H
+#define ID_SET_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define ID_SET_WORD_BITS	64
+
+/* a set of small integer ids as a bitmap. The first word is inline,
+   so sets of ids below 64 never allocate */
+struct id_set {
+	uint64_t word;		/* ids 0 ~ 63 */
+	uint64_t *ext;		/* ids from 64 on, ext_n words */
+	int ext_n;
+};
+
+#define ID_SET_INIT { .word = 0, .ext = NULL, .ext_n = 0 }
+
+void id_set_init(struct id_set *s);
+void id_set_clear(struct id_set *s);
+int id_set_add(struct id_set *s, int id);
+bool id_set_del(struct id_set *s, int id);
+bool id_set_test(struct id_set *s, int id);
+bool id_set_empty(struct id_set *s);
+int id_set_count(struct id_set *s);
+bool id_set_equal(struct id_set *a, struct id_set *b);
+int id_set_next(struct id_set *s, int id);
+
+#define id_set_for_each(id, s) \
+	for (id = id_set_next(s, 0); id >= 0; id = id_set_next(s, id + 1))
+
+#endif
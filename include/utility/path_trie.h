@@ -0,0 +1,44 @@
+#ifndef PATH_TRIE_H
+#define PATH_TRIE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include <list.h>
+
+#define PATH_TRIE_INIT_BITS	8	/* initial buckets */
+
+/* a path component, the whole path is the chain up to a root node.
+   Nodes are shared by all the paths with the same prefix, and never
+   change once created but for the atomic sum, so that they can be
+   read without locks while a reference is held */
+struct path_node {
+	struct path_node *parent;	/* NULL for a root component */
+	struct hlist_node hlist;	/* by parent and component */
+	uint32_t hash;
+	int ref;			/* paths held and children */
+	uint64_t sum;			/* kept by the user of the trie */
+	uint16_t len;			/* of the component */
+	uint16_t path_len;		/* of the whole path */
+	char comp[];			/* NUL terminated */
+};
+
+/* interned paths, which are split at '/' */
+struct path_trie {
+	pthread_mutex_t mutex;
+	struct hlist_head *buckets;
+	int bits;
+	int n;
+};
+
+int path_trie_init(struct path_trie *pt);
+void path_trie_destroy(struct path_trie *pt);
+struct path_node *path_get(struct path_trie *pt, const char *path);
+void path_hold(struct path_trie *pt, struct path_node *node);
+void path_put(struct path_trie *pt, struct path_node *node);
+int path_name(struct path_node *node, char *buf, int size);
+bool path_equal(struct path_node *node, const char *path, int len);
+bool path_under(struct path_node *node, struct path_node *dir);
+
+#endif
@@ -1,7 +1,67 @@
 #ifndef SEGMENT_H
 #define SEGMENT_H
 
+#include <stdint.h>
+
+#include <consts.h>
+
+#define SEGMENT_MAGIC		'D'	/* first byte of a framed header */
+#define SEGMENT_VERSION		1
+#define SEGMENT_ALIGN		8	/* framed payloads are padded to it */
+#define SEGMENT_BUF_LEN		(MAX_PKT_DATA_LEN + 4096)
+#define SEGMENT_IOV_MAX		64	/* segments per writev() */
+#define SEGMENT_MAX_QUEUED	(4 * SEGMENT_BUF_LEN)	/* senders block above it */
+#define SEGMENT_MAX_BACKLOG	(256 * SEGMENT_BUF_LEN)	/* peers dropped above it */
+
+#define segment_align(len) (((len) + SEGMENT_ALIGN - 1) &		\
+			    ~(SEGMENT_ALIGN - 1))
+
+/* wire modes of a connection, only affect the sending side. The
+   receiving side recognizes both of them by the first byte */
+enum segment_mode {
+	SEGMENT_SENTINEL,	/* legacy '!&' ... '!#' framing */
+	SEGMENT_FRAMED,		/* fixed header carrying payload length */
+};
+
+/* roles of a connection, decide its TCP options */
+enum segment_role {
+	SEGMENT_CONTROL,	/* small messages, TCP_NODELAY */
+	SEGMENT_BULK,		/* piece data, TCP_CORK */
+};
+
+/* header of a framed segment, the payload follows it and is padded
+   to SEGMENT_ALIGN so that every header stays aligned */
+struct segment_header {
+	uint8_t magic;		/* always SEGMENT_MAGIC */
+	uint8_t version;	/* SEGMENT_VERSION */
+	uint16_t flags;		/* reserved */
+	uint32_t len;		/* payload length in network order */
+};
+
+/* an immutable payload shared by the send queues of many connections,
+   e.g. a broadcast which is encoded once for all peers */
+struct segment_buf {
+	int ref;
+	int len;
+	char data[];
+};
+
+void segment_set_mode(int conn, enum segment_mode mode);
+enum segment_mode segment_get_mode(int conn);
+void segment_set_role(int conn, enum segment_role role);
+void segment_push(int conn);
+void segment_conn_close(int conn);
+
 int send_segment(int conn, char *buf, int len);
-int recv_segment(int conn, char *buf, int len);
+int recv_segment_view(int conn, char **data);
+int recv_segment_try(int conn, char **data);
+int send_segment_raw(int conn, char *buf, int len,
+		     int (*raw)(int conn, void *arg), void *arg);
+int recv_segment_raw(int conn, char *buf, int len);
+
+struct segment_buf *segment_buf_alloc(int len);
+void segment_buf_get(struct segment_buf *sb);
+void segment_buf_put(struct segment_buf *sb);
+int send_segment_buf(int conn, struct segment_buf *sb);
 
 #endif
@@ -0,0 +1,33 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+#define SLAB_SIZE		(64 * 1024)
+#define SLAB_ALIGN		16
+#define SLAB_CACHE_MAX		64	/* objects cached by a thread */
+#define SLAB_CACHE_BATCH	32	/* objects moved to or from the pool */
+
+struct slab_cache;
+
+/* a pool of objects of one size, carved out of big slabs. Each thread
+   allocates from and frees to its own cache, which goes to the pool
+   only in batches. The slabs are released all together when the pool
+   is destroyed */
+struct slab_pool {
+	pthread_mutex_t mutex;
+	size_t obj_size;
+	int obj_per_slab;
+	void *slabs;			/* linked by their first word */
+	void *free;			/* linked by their first word */
+	struct slab_cache *caches;	/* of all the threads */
+	pthread_key_t key;
+};
+
+int slab_pool_init(struct slab_pool *pool, size_t obj_size);
+void slab_pool_destroy(struct slab_pool *pool);
+void *slab_alloc(struct slab_pool *pool);
+void slab_free(struct slab_pool *pool, void *obj);
+
+#endif
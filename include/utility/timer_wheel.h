@@ -0,0 +1,35 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdint.h>
+
+#include <list.h>
+
+/* a timer, embedded into the caller's own structure */
+struct timer_entry {
+	struct list_head l;	/* in a slot of the wheel */
+	uint64_t expires;	/* in ticks */
+};
+
+/* a hashed timer wheel, timers are hashed into slots by their expiry
+   tick. It is not locked, the caller serializes the operations */
+struct timer_wheel {
+	struct list_head *slots;
+	int slot_n;
+	uint64_t tick_us;	/* length of a tick in micro sec */
+	uint64_t now;		/* the last tick advanced to */
+};
+
+#define timer_entry_init(t) INIT_LIST_ELM(&(t)->l)
+#define timer_pending(t) (!list_unattached(&(t)->l))
+
+uint64_t timer_wheel_clock();
+int timer_wheel_init(struct timer_wheel *tw, int slot_n, uint64_t tick_us);
+void timer_wheel_destroy(struct timer_wheel *tw);
+void timer_wheel_arm(struct timer_wheel *tw, struct timer_entry *t,
+		     uint64_t delay_us);
+void timer_wheel_cancel(struct timer_wheel *tw, struct timer_entry *t);
+int timer_wheel_advance(struct timer_wheel *tw, uint64_t now_us,
+			struct list_head *expired);
+
+#endif
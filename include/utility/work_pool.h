@@ -0,0 +1,37 @@
+#ifndef WORK_POOL_H
+#define WORK_POOL_H
+
+#include <pthread.h>
+#include <stdbool.h>
+
+#include <list.h>
+
+/* a unit of work, embedded into the caller's own structure */
+struct work {
+	struct list_head l;
+	void (*fn)(struct work *w);
+	bool final;		/* the last work of its strand, which may free
+				   the strand */
+};
+
+/* works queued on the same strand run one at a time in order */
+struct work_strand {
+	struct list_head works;
+	struct list_head l;	/* in the ready list of the pool */
+	bool scheduled;		/* in the ready list or running */
+};
+
+/* a fixed number of worker threads running the works of strands */
+struct work_pool {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	struct list_head ready;	/* strands with works to run */
+	int thread_n;
+	pthread_t *tids;
+};
+
+int work_pool_init(struct work_pool *wp, int thread_n);
+void work_strand_init(struct work_strand *ws);
+void work_queue(struct work_pool *wp, struct work_strand *ws, struct work *w);
+
+#endif
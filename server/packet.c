@@ -1,11 +1,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <netinet/in.h>
 
 #include <debug.h>
+#include <list.h>
 #include <utility/segment.h>
 #include "packet.h"
 
@@ -24,23 +26,87 @@ inline int send_ttop_packet(int conn, struct ttop_packet *pkt)
 /**
  * tracker receives a ptot packet from a peer
  * @conn: connection fd
- * @pkt: the ptot_packet which is going to be filled
+ * @pkt: set to the received ptot_packet, which lives in the receive
+ *       buffer of the connection until the next receive on it
  * @return: -1, failed. otherwise indicates how many bytes have
  *          been received
  */
-int recv_ptot_packet(int conn, struct ptot_packet *pkt)
+int recv_ptot_packet(int conn, struct ptot_packet **pkt)
 {
-	int ret = -1;
-	char buf[sizeof(struct ptot_packet) + 2] = { 0 };
+	char *data;
+	int ret;
 
-	ret = recv_segment(conn, buf, sizeof(buf));
-	if (ret < 0)
+	ret = recv_segment_view(conn, &data);
+	if (ret < (int)sizeof(struct ptot_packet_header))
+		return -1;
+	*pkt = (struct ptot_packet *)data;
+	if (ptot_packet_len(*pkt) > ret)
 		return -1;
-	memcpy(pkt, buf, sizeof(struct ptot_packet));
 
 	return ret;
 }
 
+/**
+ * tracker receives a ptot packet from a peer if a whole one has
+ * arrived, without waiting for it
+ * @return: 0 if none has arrived yet, -1 if the connection is gone
+ *          or the packet is malformed. Otherwise indicates how many
+ *          bytes have been received
+ */
+int try_recv_ptot_packet(int conn, struct ptot_packet **pkt)
+{
+	char *data;
+	int ret;
+
+	ret = recv_segment_try(conn, &data);
+	if (ret == 0)
+		return 0;
+	if (ret < (int)sizeof(struct ptot_packet_header))
+		return -1;
+	*pkt = (struct ptot_packet *)data;
+	if (ptot_packet_len(*pkt) > ret)
+		return -1;
+
+	return ret;
+}
+
+/**
+ * queue a chunk to the peer without waiting for it, a slow peer is
+ * left to the segment flusher
+ */
+static int ttop_stream_flush(struct trans_stream *ts, int len)
+{
+	struct ttop_stream *ps = list_entry(ts, struct ttop_stream, ts);
+	struct segment_buf *sb;
+	int ret;
+
+	ps->pkt.hdr.data_len = len;
+	sb = segment_buf_alloc(ttop_packet_len(&ps->pkt));
+	if (sb == NULL)
+		return -1;
+	memcpy(sb->data, &ps->pkt, sb->len);
+	ret = send_segment_buf(ps->conn, sb);
+	segment_buf_put(sb);
+
+	return ret;
+}
+
+/**
+ * init a stream which sends a file table to a peer as a sequence
+ * of ttop packets
+ * @ps: the ttop stream
+ * @conn: connection fd to the peer
+ * @type: type of every packet, e.g. TRACKER_SYNC
+ */
+void ttop_stream_init(struct ttop_stream *ps, int conn,
+		      enum ttop_packet_type type)
+{
+	bzero(&ps->pkt.hdr, sizeof(ps->pkt.hdr));
+	ps->pkt.hdr.type = type;
+	ps->conn = conn;
+	trans_stream_init(&ps->ts, ps->pkt.data, ttop_stream_flush);
+}
+
 int server_tcp_listen(uint16_t port)
 {
 	int listenfd, on = 1;
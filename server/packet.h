@@ -2,9 +2,20 @@
 #define SERVER_PACKET_H
 
 #include <packet_def.h>
+#include <trans_file_table.h>
 
-inline int send_ttop_packet(int conn, struct ttop_packet *pkt);
-int recv_ptot_packet(int conn, struct ptot_packet *pkt);
+/* streams a file table to a peer as a sequence of ttop packets */
+struct ttop_stream {
+	struct trans_stream ts;
+	int conn;
+	struct ttop_packet pkt;
+};
+
+int send_ttop_packet(int conn, struct ttop_packet *pkt);
+int recv_ptot_packet(int conn, struct ptot_packet **pkt);
+int try_recv_ptot_packet(int conn, struct ptot_packet **pkt);
+void ttop_stream_init(struct ttop_stream *ps, int conn,
+		      enum ttop_packet_type type);
 
 int server_tcp_listen(uint16_t port);
 
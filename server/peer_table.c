@@ -6,6 +6,7 @@
 #include <stdlib.h>
 
 #include <debug.h>
+#include <hash.h>
 #include <list.h>
 #include <packet_def.h>
 #include "peer_table.h"
@@ -26,10 +27,118 @@ inline struct peer_entry *peer_entry_alloc()
 	gettimeofday(&current_time, NULL);
 	pe->timestamp = GET_TIMESTAMP(&current_time);
 	INIT_LIST_ELM(&pe->l);
+	timer_entry_init(&pe->alive_timer);
 	 
 	return pe;
 }
 
+static uint32_t peer_ip_key(struct peer_entry *pe)
+{
+	return pe->peerid.ip;
+}
+
+static uint32_t peer_conn_key(struct peer_entry *pe)
+{
+	return pe->conn;
+}
+
+static int peer_index_init(struct peer_index *pi,
+			   uint32_t (*key)(struct peer_entry *pe))
+{
+	pi->slots = calloc(PEER_INDEX_INIT_SIZE, sizeof(struct peer_entry *));
+	if (pi->slots == NULL) {
+		_error("peer index alloc failed\n");
+		return -1;
+	}
+	pi->size = PEER_INDEX_INIT_SIZE;
+	pi->n = 0;
+	pi->key = key;
+
+	return 0;
+}
+
+static inline int peer_index_slot(struct peer_index *pi, uint32_t key)
+{
+	return hash_32(key, ilog2(pi->size));
+}
+
+static void __peer_index_insert(struct peer_index *pi, struct peer_entry *pe)
+{
+	int i = peer_index_slot(pi, pi->key(pe));
+
+	while (pi->slots[i] != NULL)
+		i = (i + 1) & (pi->size - 1);
+	pi->slots[i] = pe;
+	pi->n++;
+}
+
+/**
+ * insert a peer entry, the index doubles when it gets half full
+ * @return: 0 if succeeds, -1 otherwise
+ */
+static int peer_index_insert(struct peer_index *pi, struct peer_entry *pe)
+{
+	if (2 * (pi->n + 1) > pi->size) {
+		struct peer_entry **old = pi->slots;
+		int i, old_size = pi->size;
+
+		pi->slots = calloc(2 * old_size, sizeof(struct peer_entry *));
+		if (pi->slots == NULL) {
+			_error("peer index grow failed\n");
+			pi->slots = old;
+			return -1;
+		}
+		pi->size = 2 * old_size;
+		pi->n = 0;
+		for (i = 0; i < old_size; i++)
+			if (old[i] != NULL)
+				__peer_index_insert(pi, old[i]);
+		free(old);
+	}
+
+	__peer_index_insert(pi, pe);
+	return 0;
+}
+
+static struct peer_entry *peer_index_find(struct peer_index *pi, uint32_t key)
+{
+	int i = peer_index_slot(pi, key);
+
+	for (; pi->slots[i] != NULL; i = (i + 1) & (pi->size - 1))
+		if (pi->key(pi->slots[i]) == key)
+			return pi->slots[i];
+
+	return NULL;
+}
+
+/**
+ * remove a peer entry, the entries after it in the same run are
+ * shifted back so that no tombstone is needed
+ */
+static void peer_index_remove(struct peer_index *pi, struct peer_entry *pe)
+{
+	int i = peer_index_slot(pi, pi->key(pe));
+	int mask = pi->size - 1, j, home;
+
+	while (pi->slots[i] != pe) {
+		if (pi->slots[i] == NULL)
+			return;
+		i = (i + 1) & mask;
+	}
+	pi->slots[i] = NULL;
+	pi->n--;
+
+	for (j = (i + 1) & mask; pi->slots[j] != NULL; j = (j + 1) & mask) {
+		home = peer_index_slot(pi, pi->key(pi->slots[j]));
+		/* move it into the hole unless its home lies in (i, j] */
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			pi->slots[i] = pi->slots[j];
+			pi->slots[j] = NULL;
+			i = j;
+		}
+	}
+}
+
 /**
  * alloc and initialize an empty peer_table
  * return: a pointer to the new peer_table
@@ -40,56 +149,71 @@ inline void peer_table_init(struct peer_table *pt)
 		return;
 
 	bzero(pt, sizeof(struct peer_table));
+	pthread_rwlock_init(&pt->lock, NULL);
 	pthread_mutex_init(&pt->mutex, NULL);
 	INIT_LIST_HEAD(&pt->peer_head);
+	peer_index_init(&pt->ip_index, peer_ip_key);
+	peer_index_init(&pt->conn_index, peer_conn_key);
+	timer_wheel_init(&pt->alive_wheel, PEER_WHEEL_SLOTS, PEER_WHEEL_TICK);
 }
 
-/* alloc and init a new peer_table_entry, then add it to peer_table 
+/* add a new peer_table_entry to peer_table
  * @pt: peer table
- * @ip: new peer ip
- * @port: new peer port
- * @conn: tcp connection fd with peer
- * return 1 if success, -1 otherwise
+ * @pe: the new entry
+ * return 0 if success, -1 otherwise
  */
 int peer_table_add(struct peer_table *pt, struct peer_entry *pe)
 {
+	int ret = -1;
+
 	if (pt == NULL)
 		return -1;
 
-	pthread_mutex_lock(&pt->mutex);
+	pthread_rwlock_wrlock(&pt->lock);
+	if (peer_index_insert(&pt->ip_index, pe) < 0)
+		goto out;
+	if (peer_index_insert(&pt->conn_index, pe) < 0) {
+		peer_index_remove(&pt->ip_index, pe);
+		goto out;
+	}
 	list_add(&pt->peer_head, &pe->l);
 	pt->peer_num++;
-	pthread_mutex_unlock(&pt->mutex);
+	ret = 0;
+out:
+	pthread_rwlock_unlock(&pt->lock);
 
-	return 0;	
+	return ret;
 }
 
 /**
- * delete the peer_table_entry entry and free the memory
+ * delete the peer_table_entry of a connection and free the memory
  * @pt: peer_table
- * @entry: peer_table_entry
- * return 1 if success, -1 otherwise
+ * @conn: connection fd of the peer
+ * return the peer ip if success, -1 otherwise
  */
 int peer_table_delete(struct peer_table *pt, int conn)
 {
-	struct list_head *pos;
+	struct peer_entry *pe;
 	int ret = -1;
 
 	if (pt == NULL)
 		return ret;
 
-	pthread_mutex_lock(&pt->mutex);
-	list_for_each(pos, &pt->peer_head) {
-		struct peer_entry *pe = list_entry(pos, struct peer_entry, l);
-		if (pe->conn == conn) {
-			ret = pe->peerid.ip;
-			list_del(&pe->l);
-			free(pe);
-			pt->peer_num--;
-			break;
-		}
+	pthread_rwlock_wrlock(&pt->lock);
+	pe = peer_index_find(&pt->conn_index, conn);
+	if (pe != NULL) {
+		ret = pe->peerid.ip;
+		peer_index_remove(&pt->conn_index, pe);
+		peer_index_remove(&pt->ip_index, pe);
+		list_del(&pe->l);
+		pt->peer_num--;
+
+		pthread_mutex_lock(&pt->mutex);
+		timer_wheel_cancel(&pt->alive_wheel, &pe->alive_timer);
+		pthread_mutex_unlock(&pt->mutex);
+		free(pe);
 	}
-	pthread_mutex_unlock(&pt->mutex);
+	pthread_rwlock_unlock(&pt->lock);
 
 	return ret;
 }
@@ -101,25 +225,75 @@ int peer_table_delete(struct peer_table *pt, int conn)
  */
 struct peer_entry *peer_table_find(struct peer_table *pt, uint32_t ip)
 {
-	struct list_head *pos;
+	struct peer_entry *pe;
 
 	if (pt == NULL)
 		return NULL;
 
+	pthread_rwlock_rdlock(&pt->lock);
+	pe = peer_index_find(&pt->ip_index, ip);
+	pthread_rwlock_unlock(&pt->lock);
+
+	return pe;
+}
+
+/**
+ * find an entry in peer table by its connection fd
+ */
+struct peer_entry *peer_table_find_conn(struct peer_table *pt, int conn)
+{
+	struct peer_entry *pe;
+
+	if (pt == NULL)
+		return NULL;
+
+	pthread_rwlock_rdlock(&pt->lock);
+	pe = peer_index_find(&pt->conn_index, conn);
+	pthread_rwlock_unlock(&pt->lock);
+
+	return pe;
+}
+
+/**
+ * (re)arm the alive timer of a peer, which is O(1)
+ * @timeout_us: the peer is considered dead if it isn't kept alive
+ *              again within this time
+ */
+void peer_table_keep_alive(struct peer_table *pt, struct peer_entry *pe,
+			   uint64_t timeout_us)
+{
 	pthread_mutex_lock(&pt->mutex);
-	list_for_each(pos, &pt->peer_head) {
-		struct peer_entry *pe = list_entry(pos, struct peer_entry, l);
-		if (pe->peerid.ip == ip) {
-			pthread_mutex_unlock(&pt->mutex);
-			return pe;
-		}
+	timer_wheel_arm(&pt->alive_wheel, &pe->alive_timer, timeout_us);
+	pthread_mutex_unlock(&pt->mutex);
+}
+
+/**
+ * collect the peers whose alive timers have expired in a batch
+ * @fn: called on every expired peer with the table locked, it MUST
+ *      NOT free the peer entry
+ * @return: number of expired peers
+ */
+int peer_table_expire(struct peer_table *pt,
+		      void (*fn)(struct peer_entry *pe))
+{
+	struct list_head expired, *pos, *tmp;
+	int n;
+
+	INIT_LIST_HEAD(&expired);
+	pthread_mutex_lock(&pt->mutex);
+	n = timer_wheel_advance(&pt->alive_wheel, timer_wheel_clock(),
+				&expired);
+	list_for_each_safe(pos, tmp, &expired) {
+		struct peer_entry *pe =
+			list_entry(pos, struct peer_entry, alive_timer.l);
+		timer_wheel_cancel(&pt->alive_wheel, &pe->alive_timer);
+		fn(pe);
 	}
 	pthread_mutex_unlock(&pt->mutex);
 
-	return NULL;
+	return n;
 }
 
-
 /**
  * print the content of a peer table
  */
@@ -127,7 +301,7 @@ void peer_table_print(struct peer_table *pt)
 {
 	struct list_head *pos;
 
-	pthread_mutex_lock(&pt->mutex);
+	pthread_rwlock_rdlock(&pt->lock);
 	_debug("{ Peer Table }:\n");
 	_debug("\tnum of peers: %d\n",pt->peer_num);
 
@@ -136,5 +310,5 @@ void peer_table_print(struct peer_table *pt)
 		_debug("ip: %10u, port: %6d, timestamp: %10ld\n",
 				pe->peerid.ip, pe->peerid.port, pe->timestamp);
 	}
-	pthread_mutex_unlock(&pt->mutex);
+	pthread_rwlock_unlock(&pt->lock);
 }
@@ -7,6 +7,11 @@
 #include <consts.h>
 #include <list.h>
 #include <trans_file_table.h>
+#include <utility/timer_wheel.h>
+
+#define PEER_WHEEL_SLOTS	256
+#define PEER_WHEEL_TICK		100000	/* micro sec */
+#define PEER_INDEX_INIT_SIZE	64	/* power of 2 */
 
 
 struct peer_entry {
@@ -14,13 +19,26 @@ struct peer_entry {
 	uint64_t timestamp;	/* last timestamp of alive */
 	struct peer_id peerid;	/* peer ip and port */
 	struct list_head l;	/* entry list */
-	pthread_t tid;		/* receiver thread id */
+	struct timer_entry alive_timer;	/* expires if no keep alive */
+};
+
+/* an open-addressing hash index of peer entries with linear probing,
+   at most half full */
+struct peer_index {
+	struct peer_entry **slots;
+	int size;			/* power of 2 */
+	int n;
+	uint32_t (*key)(struct peer_entry *pe);
 };
 
 struct peer_table {
 	int peer_num;			/* num of alive peers */
-	pthread_mutex_t mutex;
+	pthread_rwlock_t lock;		/* protects the list and indexes */
+	pthread_mutex_t mutex;		/* protects timestamps and timers */
 	struct list_head peer_head;	/* linked list of all peers alive */
+	struct peer_index ip_index;	/* by peerid.ip */
+	struct peer_index conn_index;	/* by conn */
+	struct timer_wheel alive_wheel;	/* alive timers of the peers */
 };
 
 
@@ -30,6 +48,11 @@ void peer_table_init(struct peer_table *pt);
 int peer_table_add(struct peer_table *pt, struct peer_entry *pe);
 int peer_table_delete(struct peer_table *pt, int conn);
 struct peer_entry *peer_table_find(struct peer_table *pt, uint32_t ip);
+struct peer_entry *peer_table_find_conn(struct peer_table *pt, int conn);
+void peer_table_keep_alive(struct peer_table *pt, struct peer_entry *pe,
+			   uint64_t timeout_us);
+int peer_table_expire(struct peer_table *pt,
+		      void (*fn)(struct peer_entry *pe));
 void peer_table_print(struct peer_table *pt);
 
 #endif
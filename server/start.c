@@ -7,23 +7,30 @@
 #include <stdint.h>
 #include <unistd.h>
 #include <errno.h>
+#include <signal.h>
 #include <sys/time.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <netinet/in.h>
+#include <sys/epoll.h>
 
 #include <consts.h>
 #include <packet_def.h>
 #include <file_table.h>
 #include <hash.h>
 #include <debug.h>
+#include <utility/segment.h>
+#include <utility/work_pool.h>
 #include "start.h"
 #include "peer_table.h"
 #include "packet.h"
+#include "store.h"
 
 static struct file_table ft;
 static struct peer_table pt;
+static struct tracker_store store;
 static struct ttop_control_info ctr_info;
+static struct work_pool workers;
 
 
 static int parse_conf_file(struct ttop_control_info *control)
@@ -54,120 +61,149 @@ static int parse_conf_file(struct ttop_control_info *control)
 	return 0;
 }
 
-static void broadcast_update(struct peer_table *pt,
-			     struct trans_file_table *tft,
-			     int exclusive_conn)
+/* streams file table updates to all peers alive but one */
+struct broadcast_stream {
+	struct trans_stream ts;
+	struct peer_table *pt;
+	int exclusive_conn;
+	struct ttop_packet pkt;
+};
+
+/**
+ * encode a chunk once into a shared buffer and queue it to every
+ * peer, slow peers are left to the segment flusher
+ */
+static int broadcast_flush(struct trans_stream *ts, int len)
 {
+	struct broadcast_stream *bs;
+	struct peer_table *pt;
+	struct segment_buf *sb;
 	struct list_head *pos;
-	struct ttop_packet pkt;
 
-	if (pt == NULL || tft == NULL || tft->n == 0)
-		goto out;
+	bs = list_entry(ts, struct broadcast_stream, ts);
+	pt = bs->pt;
+	bs->pkt.hdr.data_len = len;
 
-	pkt.hdr.type = TRACKER_BROADCAST;
-	pkt.hdr.data_len = trans_table_len(tft);
-	memcpy(pkt.data, tft, pkt.hdr.data_len);
+	sb = segment_buf_alloc(ttop_packet_len(&bs->pkt));
+	if (sb == NULL)
+		return -1;
+	memcpy(sb->data, &bs->pkt, sb->len);
 
-	pthread_mutex_lock(&pt->mutex);
-	_enter("table len = %d", tft->n);
+	pthread_rwlock_rdlock(&pt->lock);
+	_enter("chunk entries = %d", ts->n);
 
-	/* send ACCEPT back to peer */
 	list_for_each(pos, &pt->peer_head) {
 		struct peer_entry *pe = list_entry(pos, struct peer_entry, l);
-		if (pe->conn != exclusive_conn) {
+		if (pe->conn != bs->exclusive_conn) {
 			_debug("\tto %u\n", ip_string(pe->peerid.ip));
-			if (send_ttop_packet(pe->conn, &pkt) < 0)
+			if (send_segment_buf(pe->conn, sb) < 0)
 				_error("fail to send BROADCAST to peer(%u)\n",
 						pe->peerid.ip);
 		}
 	}
 	_leave();
-	pthread_mutex_unlock(&pt->mutex);
+	pthread_rwlock_unlock(&pt->lock);
 
-out:
-	return;
+	segment_buf_put(sb);
+
+	return 0;
 }
 
-/* checks every INTERVAL time to see if a peer is still alive,
- * if the peer is dead, terminates the receiver_handler task for this peer and
- * terminates peer_check_alive_task thread itself
- * @arg: a server_thread_arg structure
+/**
+ * alloc a broadcast stream, entries added to it are sent to peers in
+ * chunks. Nothing is sent if no entry is added before finishing it
+ * @exclusive_conn: the peer that does not need the update, -1 if none
+ * @return: the stream, NULL if failed
  */
-void *peer_check_alive_task(void *arg)
+static struct broadcast_stream *broadcast_stream_alloc(struct peer_table *pt,
+						       int exclusive_conn)
 {
-	/* extracs arguments */
-	struct server_thread_arg *targ = (struct server_thread_arg*)arg;
-	uint32_t ip = targ->peerid.ip;
-	uint64_t last_timestamp = 0;
-	pthread_t receiver_tid = targ->tid;
+	struct broadcast_stream *bs = calloc(1, sizeof(*bs));
 
-	free(targ);
+	if (bs == NULL) {
+		_error("broadcast stream alloc failed\n");
+		return NULL;
+	}
+	bs->pkt.hdr.type = TRACKER_BROADCAST;
+	bs->pt = pt;
+	bs->exclusive_conn = exclusive_conn;
+	trans_stream_init(&bs->ts, bs->pkt.data, broadcast_flush);
 
-	/* keeps running until this peer is considered to be dead */
-	while (1) {
-		struct peer_entry *pe;
-		struct timeval current_time;
-		/* sleep for INTERVAL time */
-		usleep(ctr_info.interval + CHECK_ALIVE_DIFF);
-
-		pe = peer_table_find(&pt, ip);
-		if (pe == NULL) {
-			_debug("peer entry (ip:%u) doesn't exist\n",
-					ip_string(ip));
-			pthread_cancel(receiver_tid);
-			pthread_exit(NULL);
-		}
+	return bs;
+}
 
-		/* check if peer is alive */
-		gettimeofday(&current_time, NULL);
-		pthread_mutex_lock(&pt.mutex);
-		if (pe->timestamp == last_timestamp) {
-			printf("\n");
-			_debug("DIED! peer (ip:%u)\n\n",
-					ip_string(pe->peerid.ip));
-			pthread_mutex_unlock(&pt.mutex);
-			pthread_cancel(receiver_tid);
-			pthread_exit((void *)0);
-		}
-		last_timestamp = pe->timestamp;
-		pthread_mutex_unlock(&pt.mutex);
+/**
+ * send the last chunk of a broadcast stream and free it
+ */
+static void broadcast_stream_finish(struct broadcast_stream *bs)
+{
+	trans_stream_finish(&bs->ts);
+	free(bs);
+}
+
+static void peer_reap(struct peer_entry *pe)
+{
+	printf("\n");
+	_debug("DIED! peer (ip:%u)\n\n", ip_string(pe->peerid.ip));
+	shutdown(pe->conn, SHUT_RDWR);
+}
+
+/**
+ * reaps the peers whose alive timers have expired every tick of the
+ * alive wheel. A dead peer's connection is shut down, so that its I/O
+ * thread sees the end of it and cleans the peer up
+ */
+static void *peer_check_alive_task(void *arg)
+{
+	while (1) {
+		usleep(PEER_WHEEL_TICK);
+		peer_table_expire(&pt, peer_reap);
 	}
 
 	pthread_exit((void *)0);
 }
 
 /**
- * peer_register_handler_task: called when receivs PEER_REGISTER,
- * @  a structure that contains
+ * called when receivs PEER_REGISTER,
  * 1. create an ACCEPT packet and send it back to peer
- * 2. create a new peer_table_entry and add it to peer_table
- * 3. create a peer_check_alive_timer for this client (send the receiver_handler's
-      tid and peer ip as argument to this thread)
+ * 2. create a new peer_table_entry and add it to peer_table, and arm
+ *    its alive timer
  */
-static void *peer_register_handler_task(void *arg)
-{
-	struct server_thread_arg *targ = (struct server_thread_arg *)arg;
-	int conn = targ->conn;
-	uint32_t ip = targ->peerid.ip;
-	uint16_t port = targ->peerid.port;
-	pthread_t receiver_tid = targ->tid;
-	pthread_t check_alive_tid;
+static void peer_register_handler(struct tracker_conn *tc,
+				  struct ptot_packet *pkt)
+{
+	int conn = tc->conn;
+	bool framed;
 	struct peer_entry *pe;
 	struct ttop_packet accept_pkt;
-	long int ret = 0;
+	struct ttop_control_info info = ctr_info;
 
 	_enter();
 
-	/* create an ACCEPT packet */
+	/* create an ACCEPT packet, legacy peers only understand the
+	   first two fields of the control info */
+	framed = strncmp(pkt->hdr.protocol_name, PROTOCOL_FRAMED,
+			 MAX_NAME_LEN) == 0;
 	accept_pkt.hdr.type = TRACKER_ACCEPT;
-	accept_pkt.hdr.data_len = sizeof(struct ttop_control_info);
-	memcpy(accept_pkt.data, &ctr_info, accept_pkt.hdr.data_len);
+	if (framed) {
+		info.features = FEATURE_FRAMED | FEATURE_RESYNC |
+				FEATURE_SUMMARY;
+		accept_pkt.hdr.data_len = sizeof(struct ttop_control_info);
+	} else
+		accept_pkt.hdr.data_len = LEGACY_CONTROL_INFO_LEN;
+	memcpy(accept_pkt.data, &info, accept_pkt.hdr.data_len);
 
 	/* send ACCEPT back to peer */
 	if (send_ttop_packet(conn, &accept_pkt) < 0) {
 		_error("fail to send ACCEPT to peer\n");
-		free(targ);
-		ret = -1;
+		goto out;
+	}
+	if (framed)
+		segment_set_mode(conn, SEGMENT_FRAMED);
+	tc->features = framed ? info.features : 0;
+
+	if (tc->pe != NULL) {
+		_debug("peer on %d registers again\n", conn);
 		goto out;
 	}
 
@@ -175,175 +211,417 @@ static void *peer_register_handler_task(void *arg)
 	pe = peer_entry_alloc();
 	if (pe == NULL) {
 		_error("peer entry alloc failed\n");
-		free(targ);
-		ret = -1;
 		goto out;
 	}
 	pe->conn = conn;
-	pe->peerid.ip = ip;
-	pe->peerid.port = port;
-	pe->tid = receiver_tid;
+	pe->peerid.ip = pkt->hdr.ip;
+	pe->peerid.port = pkt->hdr.port;
 	peer_table_add(&pt, pe);
-
-	/* create a peer_check_alive_task for this peer and
-	   send the targ got from receiver_handler_task to
-	   peer_check_alive_task */
-	pthread_create(&check_alive_tid, NULL, peer_check_alive_task, targ);
+	peer_table_keep_alive(&pt, pe, ctr_info.interval + CHECK_ALIVE_DIFF);
+	tc->pe = pe;
 
 out:
 	_leave();
-	pthread_exit((void *)ret);
 }
 
 /**
- * called when receivs PEER_KEEP_ALIVE, looks for the peer in peer table and
- * udpates its timestamp
+ * called when receivs PEER_KEEP_ALIVE, udpates the peer's timestamp
+ * and re-arms its alive timer
  */
-static void *peer_life_update_task(void *arg)
+static void peer_life_update_handler(struct tracker_conn *tc)
 {
-	uint32_t ip = (long int)arg;
-	struct peer_entry *pe = peer_table_find(&pt, ip);
-	long int ret = -1;
-
-	if (pe == NULL) {
-		_error("peer entry (ip:%u) doesn't exist\n", ip);
-		goto out;
+	if (tc->pe == NULL) {
+		_error("peer on %d doesn't register\n", tc->conn);
+		return;
 	}
 
 	/* update peer timestamp */
 	pthread_mutex_lock(&pt.mutex);
-	pe->timestamp += ctr_info.interval;
+	tc->pe->timestamp += ctr_info.interval;
+	timer_wheel_arm(&pt.alive_wheel, &tc->pe->alive_timer,
+			ctr_info.interval + CHECK_ALIVE_DIFF);
 	pthread_mutex_unlock(&pt.mutex);
-
-out:
-	pthread_exit((void *)ret);
 }
 
 
-static inline
-struct trans_file_entry *trans_file_search(struct trans_file_table *tft,
-					   const char *name)
+/* a tracker's entry to send back to a syncing peer */
+struct sync_reply {
+	struct file_entry *fe;		/* a reference of it */
+	int op_type;
+};
+
+struct sync_arg {
+	struct trans_file_table *tft;	/* the peer's file table */
+	struct dir_set *scope;		/* the peer sent, NULL if all */
+	struct sync_reply *replies;	/* sent once the table is unlocked */
+	int n;
+	int size;
+};
+
+/**
+ * keep a tracker's file entry to stream it back to the peer, if the
+ * peer doesn't have it or has an older one. It runs with a shard of
+ * the table locked, so nothing is sent from here
+ * @te: the peer's entry of the same name, or NULL
+ */
+static void sync_entry_fn(struct file_entry *fe, struct trans_file_entry *te,
+			  void *arg)
 {
-	int i;
+	struct sync_arg *sa = arg;
+	struct sync_reply *replies;
+	int op_type;
 
-	for (i = 0; i < tft->n; i++)
-		if (strcmp(tft->entries[i].name, name) == 0)
-			return tft->entries + i;
-	return NULL;
+	/* the peer has the same entries as the tracker out of scope */
+	if (sa->scope != NULL && !dir_set_has_parent(sa->scope, fe))
+		return;
+
+	if (te == NULL)
+		op_type = FILE_ADD;
+	else if (fe->timestamp > te->timestamp ||
+			(fe->timestamp == te->timestamp &&
+			 !has_same_owners(fe, te)))
+		op_type = FILE_MODIFY;
+	else
+		return;
+
+	if (sa->n == sa->size) {
+		replies = realloc(sa->replies, (sa->size ? sa->size * 2 : 64) *
+				  sizeof(struct sync_reply));
+		if (replies == NULL) {
+			_error("sync replies alloc failed\n");
+			return;
+		}
+		sa->replies = replies;
+		sa->size = sa->size ? sa->size * 2 : 64;
+	}
+	file_entry_get(fe);
+	sa->replies[sa->n].fe = fe;
+	sa->replies[sa->n].op_type = op_type;
+	sa->n++;
 }
 
 /**
- * this thread sync the current file table with peer's file table
+ * stream the kept entries back to the peer and drop their references
+ * @ts: the stream to the peer, NULL to only drop them
  */
-static void *sync_task(void *arg)
-{
-	struct server_thread_arg *targ = arg;
-	struct trans_file_table *tft = targ->data;
-	int conn = targ->conn;
-	struct trans_file_table *broad_tft;
-	struct trans_file_table *peer_tft;
-	struct file_entry *fe;
-	struct ttop_packet *pkt;
-	long int i, ret = 0;
-
-	broad_tft = calloc(1, sizeof(struct trans_file_table));
-	if (broad_tft == NULL) {
-		_error("broad tft alloc failed\n");
-		ret = -1;
-		goto out;
+static int sync_replies_send(struct sync_arg *sa, struct trans_stream *ts)
+{
+	struct trans_file_entry te;
+	int i, ret = ts == NULL ? -1 : 0;
+
+	for (i = 0; i < sa->n; i++) {
+		trans_entry_fill_from(&te, sa->replies[i].fe);
+		te.op_type = sa->replies[i].op_type;
+		if (ret == 0 && trans_stream_add(ts, &te) < 0)
+			ret = -1;
+		file_entry_put(sa->replies[i].fe);
 	}
+	free(sa->replies);
+	sa->replies = NULL;
+	sa->n = sa->size = 0;
+
+	return ret;
+}
 
-	peer_tft = calloc(1, sizeof(struct trans_file_table));
-	if (peer_tft == NULL) {
-		_error("peer tft alloc failed\n");
-		ret = -1;
-		goto free_broad_tft;
+/**
+ * tell a peer which point of the file table the following TRACKER_SYNC
+ * chunks bring it to, or that it has to send its whole table
+ */
+static int send_sync_point(int conn, uint64_t gen, uint64_t seq,
+			   bool accepted)
+{
+	struct ttop_packet pkt;
+	struct sync_point sp;
+
+	bzero(&sp, sizeof(sp));
+	sp.gen = gen;
+	sp.seq = seq;
+	sp.accepted = accepted;
+	pkt.hdr.type = TRACKER_RESYNC;
+	pkt.hdr.data_len = sizeof(sp);
+	memcpy(pkt.data, &sp, sizeof(sp));
+
+	return send_ttop_packet(conn, &pkt);
+}
+
+/**
+ * update self file table with the peer's entries and broadcast the
+ * updates to all other peers
+ * @matched: the tracker's entries of the peer's ones, or NULL if they
+ *           are to be looked up. Their references are dropped
+ */
+static void sync_peer_entries(struct broadcast_stream *bs,
+			      struct trans_file_table *tft,
+			      struct file_entry **matched)
+{
+	long int i;
+
+	for (i = 0; i < tft->n; i++) {
+		struct trans_file_entry *te = tft->entries + i;
+		struct file_entry *fe;
+
+		fe = matched ? matched[i] : file_table_find(&ft, te);
+		if (fe == NULL) {
+			file_entry_put(file_table_add(&ft, te));
+			te->op_type = FILE_ADD;
+			trans_stream_add(&bs->ts, te);
+		} else if (fe->timestamp < te->timestamp) {
+			file_entry_update(fe, te);
+			te->op_type = FILE_MODIFY;
+			trans_stream_add(&bs->ts, te);
+		} else
+			file_entry_update(fe, te);
+		file_entry_put(fe);
 	}
+}
 
-	pkt = calloc(1, sizeof(struct ttop_packet));
-	if (pkt == NULL) {
-		_error("packet alloc failed\n");
-		ret = -1;
-		goto free_peer_tft;
+/**
+ * sync the current file table with peer's file table
+ * @tc: the peer connection
+ * @tft: the whole file table of the peer
+ */
+static void sync_handler(struct tracker_conn *tc, struct trans_file_table *tft)
+{
+	struct broadcast_stream *bs;
+	struct ttop_stream *ps;
+	struct sync_arg sa;
+	struct file_entry **matched;
+	int conn = tc->conn;
+	uint64_t gen, seq;
+
+	bs = broadcast_stream_alloc(&pt, conn);
+	if (bs == NULL)
+		return;
+
+	ps = calloc(1, sizeof(struct ttop_stream));
+	if (ps == NULL) {
+		_error("ttop stream alloc failed\n");
+		goto free_bs;
+	}
+	matched = malloc((tft->n ? tft->n : 1) * sizeof(struct file_entry *));
+	if (matched == NULL) {
+		_error("sync matched entries alloc failed\n");
+		goto free_ps;
 	}
 
-	/* update peer's file table */
+	/* the files kept for the peer's return are stale now */
+	if (tc->pe != NULL)
+		file_table_unpark_owner(&ft, tc->pe->peerid.ip);
+	seq = file_table_seq(&ft, &gen);
+	if ((tc->features & FEATURE_RESYNC) &&
+			send_sync_point(conn, gen, seq, true) < 0)
+		_error("ttop packet send failed\n");
+
+	/* update peer's file table, which is streamed back to the peer
+	   as TRACKER_SYNC chunks once the table is unlocked. The
+	   tracker's entries matching the peer's ones are kept for the
+	   update below */
 	_debug("update peer's file table, n = %d\n", tft->n);
-	hash_for_each(ft.file_htable, i, fe, hlist) {
-		struct trans_file_entry *te;
-		te = trans_file_search(tft, fe->name);
-		if (te == NULL) {
-			trans_entry_fill_from(peer_tft->entries + peer_tft->n,
-					      fe);
-			peer_tft->entries[peer_tft->n].op_type = FILE_ADD;
-			peer_tft->n++;
-		} else if (fe->timestamp > te->timestamp ||
-				(fe->timestamp == te->timestamp &&
-				 !has_same_owners(fe, te))) {
-			trans_entry_fill_from(peer_tft->entries + peer_tft->n,
-					      fe);
-			peer_tft->entries[peer_tft->n].op_type = FILE_MODIFY;
-			peer_tft->n++;
-		}
+	ttop_stream_init(ps, conn, TRACKER_SYNC);
+	ps->ts.reply = true;
+	bzero(&sa, sizeof(sa));
+	sa.tft = tft;
+	sa.scope = tc->scope;
+	if (file_table_join(&ft, tft, sync_entry_fn, &sa, matched) < 0) {
+		sync_replies_send(&sa, NULL);
+		goto free_matched;
 	}
-	/* send updated file table back to the peer */
+	if (sync_replies_send(&sa, &ps->ts) < 0 ||
+			trans_stream_finish(&ps->ts) < 0)
+		_error("ttop packet send failed\n");
+
 	_debug("update traker's file table, n = %d\n", tft->n);
-	pkt->hdr.type = TRACKER_SYNC;
-	pkt->hdr.data_len = trans_table_len(peer_tft);
-	memcpy(pkt->data, peer_tft, pkt->hdr.data_len);
-	if (send_ttop_packet(conn, pkt) < 0)
+	sync_peer_entries(bs, tft, matched);
+
+free_matched:
+	free(matched);
+free_ps:
+	free(ps);
+free_bs:
+	broadcast_stream_finish(bs);
+}
+
+/* broadcast an entry whose owners are changed */
+static void owner_changed_fn(struct file_entry *fe, void *arg)
+{
+	struct broadcast_stream *bs = arg;
+	struct trans_file_entry te;
+
+	if (bs == NULL)
+		return;
+
+	trans_entry_fill_from(&te, fe);
+	te.op_type = FILE_MODIFY;
+	trans_stream_add(&bs->ts, &te);
+}
+
+static void changes_fn(struct trans_file_entry *te, void *arg)
+{
+	struct trans_file_entry *new_te = trans_table_append(arg);
+
+	if (new_te != NULL)
+		*new_te = *te;
+}
+
+/**
+ * sync a returning peer with the changes it missed. It takes back the
+ * files it left with and has not changed, brings in the ones it has
+ * changed, and gets the tail of the change log since it left
+ * @tc: the peer connection, with the point the peer left at
+ * @tft: the files the peer has changed since
+ */
+static void resync_handler(struct tracker_conn *tc,
+			   struct trans_file_table *tft)
+{
+	struct sync_point *sp = &tc->resync;
+	struct broadcast_stream *bs;
+	struct trans_file_table tail;
+	struct ttop_stream *ps;
+	int conn = tc->conn;
+	uint64_t gen, seq;
+	int ret;
+
+	file_table_seq(&ft, &gen);
+	if (tc->pe == NULL || sp->gen != gen)
+		goto full;
+
+	bs = broadcast_stream_alloc(&pt, conn);
+	if (bs == NULL)
+		goto full;
+	ret = file_table_restore_owner(&ft, &tc->pe->peerid, sp->digest, tft,
+				       owner_changed_fn, bs);
+	if (ret >= 0)
+		sync_peer_entries(bs, tft, NULL);
+	broadcast_stream_finish(bs);
+	if (ret < 0)
+		goto full;
+	_debug("peer takes %d files back, %d changed\n", ret, tft->n);
+
+	trans_table_init(&tail);
+	seq = file_table_seq(&ft, NULL);
+	if (file_table_changes(&ft, sp->seq, changes_fn, &tail) < 0) {
+		trans_table_destroy(&tail);
+		goto full;
+	}
+	_debug("resync peer from %lu to %lu, n = %d\n", sp->seq, seq,
+			tail.n);
+
+	ps = calloc(1, sizeof(struct ttop_stream));
+	if (ps == NULL) {
+		_error("ttop stream alloc failed\n");
+		trans_table_destroy(&tail);
+		goto full;
+	}
+	if (send_sync_point(conn, gen, seq, true) < 0)
 		_error("ttop packet send failed\n");
+	ttop_stream_init(ps, conn, TRACKER_SYNC);
+	ps->ts.reply = true;
+	if (trans_stream_add_table(&ps->ts, &tail) < 0 ||
+			trans_stream_finish(&ps->ts) < 0)
+		_error("ttop packet send failed\n");
+	free(ps);
+	trans_table_destroy(&tail);
+	return;
 
-	/* update self file table */
-	for (i = 0; i < tft->n; i++) {
-		struct trans_file_entry *te = tft->entries + i;
-		fe = file_table_find(&ft, te);
-		if (fe == NULL) {
-			file_table_add(&ft, te);
-			broad_tft->entries[broad_tft->n] = *te;
-			broad_tft->entries[broad_tft->n].op_type = FILE_ADD;
-			broad_tft->n++;
-		} else if (fe->timestamp < te->timestamp) {
-			file_table_update(&ft, te);
-			broad_tft->entries[broad_tft->n] = *te;
-			broad_tft->entries[broad_tft->n].op_type = FILE_MODIFY;
-			broad_tft->n++;
-		} else
-			file_table_update(&ft, te);
+full:
+	_debug("peer on %d has to sync in full\n", conn);
+	if (send_sync_point(conn, gen, 0, false) < 0)
+		_error("ttop packet send failed\n");
+}
+
+static void scope_release(struct tracker_conn *tc)
+{
+	if (tc->scope == NULL)
+		return;
+
+	dir_set_destroy(tc->scope, &ft);
+	free(tc->scope);
+	tc->scope = NULL;
+}
+
+/**
+ * compare the directory summaries of a peer with the tracker's. The
+ * peer takes the files back under the directories it has the same,
+ * and is told the others, whose entries it sends then in PEER_SYNC
+ * @tc: the peer connection, whose scope of PEER_SYNC is set
+ * @tft: the directory summaries of the peer
+ */
+static void summary_handler(struct tracker_conn *tc,
+			    struct trans_file_table *tft)
+{
+	struct trans_file_table same, differ, *reply = tft;
+	struct broadcast_stream *bs;
+	struct ttop_stream *ps;
+	struct dir_set ds;
+	int conn = tc->conn, n;
+
+	scope_release(tc);
+	trans_table_init(&same);
+	trans_table_init(&differ);
+	if (tc->pe == NULL ||
+			file_table_summary_diff(&ft, tft, &same, &differ) < 0)
+		goto reply;
+
+	file_table_unpark_owner(&ft, tc->pe->peerid.ip);
+	if (dir_set_init(&ds, &ft, &same) < 0)
+		goto reply;
+	bs = broadcast_stream_alloc(&pt, conn);
+	n = file_table_own_dirs(&ft, &ds, &tc->pe->peerid, owner_changed_fn,
+				bs);
+	if (bs != NULL)
+		broadcast_stream_finish(bs);
+	dir_set_destroy(&ds, &ft);
+
+	tc->scope = malloc(sizeof(struct dir_set));
+	if (tc->scope != NULL && dir_set_init(tc->scope, &ft, &differ) < 0) {
+		free(tc->scope);
+		tc->scope = NULL;
 	}
-	/* broadcast update to all peers */
-	broadcast_update(&pt, broad_tft, conn);
+	if (tc->scope != NULL)
+		reply = &differ;
+	_debug("peer has %d directories the same, %d files, %d differ\n",
+			same.n, n, differ.n);
+
+reply:
+	/* without a scope every directory of the peer is asked for */
+	ps = calloc(1, sizeof(struct ttop_stream));
+	if (ps == NULL) {
+		_error("ttop stream alloc failed\n");
+		goto out;
+	}
+	ttop_stream_init(ps, conn, TRACKER_SUMMARY);
+	ps->ts.reply = true;
+	if (trans_stream_add_table(&ps->ts, reply) < 0 ||
+			trans_stream_finish(&ps->ts) < 0)
+		_error("ttop packet send failed\n");
+	free(ps);
 
-	free(pkt);
-free_peer_tft:
-	free(peer_tft);
-free_broad_tft:
-	free(broad_tft);
 out:
-	free(tft);
-	pthread_exit((void *)ret);
+	trans_table_destroy(&same);
+	trans_table_destroy(&differ);
 }
 
 /**
  * called when receivs PEER_FILE_UPDATE
+ * @conn: connection fd to the peer
+ * @tft: the updated entries in a chunk
  */
-static void *peer_file_update_task(void *arg)
+static void peer_file_update_handler(int conn, struct trans_file_table *tft)
 {
-	/* extracts the trans_file_table sent by receiver_handler_task thread */
-	struct server_thread_arg *targ = arg;
-	struct trans_file_table *tft = targ->data;
-	int conn = targ->conn;
-	struct trans_file_table new_tft;
+	struct broadcast_stream *bs;
+	struct trans_file_entry new_te;
 	enum operation_type op_type;
 	int entry_n = tft->n;
 	int i;
 
 	_enter();
 
-	bzero(&new_tft, sizeof(struct trans_file_table));
+	bs = broadcast_stream_alloc(&pt, conn);
+	if (bs == NULL)
+		return;
 
-	/* update tracker's file table. if updated, broadcast the
-	   entire file tabel to all peers alive */
+	/* update tracker's file table. the updated entries are
+	   broadcast to all other peers alive */
 	for (i = 0; i < entry_n; i++) {
 		struct trans_file_entry *te = tft->entries + i;
 		struct file_entry *fe;
@@ -355,21 +633,18 @@ static void *peer_file_update_task(void *arg)
 			   only owenr, and add it to global filetable */
 			fe = file_table_add(&ft, te);
 			if (fe != NULL) {
-				trans_entry_fill_from(new_tft.entries + new_tft.n,
-						fe);
-				new_tft.entries[new_tft.n].op_type = FILE_ADD;
-				new_tft.n++;
+				trans_entry_fill_from(&new_te, fe);
+				new_te.op_type = FILE_ADD;
+				trans_stream_add(&bs->ts, &new_te);
+				file_entry_put(fe);
 			}
 			break;
 
 		case FILE_DELETE:
 			_debug("{ FILE_DELETE } '%s'\n", te->name);
 			/* delete this entry from file table */
-			if (file_table_delete(&ft, te) == 0) {
-				memcpy(new_tft.entries + new_tft.n, te,
-						sizeof(struct trans_file_entry));
-				new_tft.n++;
-			}
+			if (file_table_delete(&ft, te) == 0)
+				trans_stream_add(&bs->ts, te);
 			break;
 
 		case FILE_MODIFY:
@@ -379,16 +654,19 @@ static void *peer_file_update_task(void *arg)
 			if (fe == NULL) {
 				_debug("\t'%s' not exists, conflict!\n",
 						te->name);
-				file_table_add(&ft, te);
+				fe = file_table_add(&ft, te);
 				op_type = FILE_ADD;
 			} else {
 				file_entry_update(fe, te);
 				op_type = FILE_MODIFY;
 			}
+			if (fe == NULL)
+				break;
 
-			trans_entry_fill_from(new_tft.entries + new_tft.n, fe);
-			new_tft.entries[new_tft.n].op_type = op_type;
-			new_tft.n++;
+			trans_entry_fill_from(&new_te, fe);
+			new_te.op_type = op_type;
+			trans_stream_add(&bs->ts, &new_te);
+			file_entry_put(fe);
 
 			break;
 
@@ -401,138 +679,341 @@ static void *peer_file_update_task(void *arg)
 		}
 	}
 
-	/* after scanning the entire trans_file_table, check if need
-	   to broadcast the entire file table to all peers alive */
-	if (new_tft.n > 0)
-		broadcast_update(&pt, &new_tft, conn);
+	/* send the last chunk of updates, if any */
+	broadcast_stream_finish(bs);
 
 	_leave();
-	free(targ);
-	free(tft);
-	pthread_exit((void *)0);
 }
 
-static void receiver_task_cleanup(void *arg)
+/**
+ * drop a peer connection which can't go on, the I/O thread sees it
+ * closed and the packets still queued for it are ignored
+ */
+static void tracker_conn_drop(struct tracker_conn *tc)
+{
+	tc->broken = true;
+	shutdown(tc->conn, SHUT_RDWR);
+}
+
+/**
+ * PEER_SYNC and PEER_SUMMARY come in chunks, which are collected until
+ * the last one comes and the whole table is handled then. A malformed
+ * or too long table drops the connection, a part of it is never taken
+ * as the peer's files
+ */
+static void peer_sync_chunk_handler(struct tracker_conn *tc,
+				    struct ptot_packet *pkt)
 {
-	long int conn = (long int)arg;
+	struct trans_chunk_reader tr;
+
+	if (trans_chunk_open(&tr, pkt->data, pkt->hdr.data_len) < 0)
+		goto drop;
+
+	if (tc->sync_tft == NULL) {
+		tc->sync_tft = calloc(1, sizeof(struct trans_file_table));
+		if (tc->sync_tft == NULL) {
+			_error("trans file table alloc failed\n");
+			goto drop;
+		}
+	}
+	if (trans_chunk_read_table(&tr, tc->sync_tft) < 0)
+		goto drop;
+	if (tc->sync_tft->n > TRACKER_MAX_SYNC_ENTRIES) {
+		_error("peer %u syncs more than %d files\n",
+				ip_string(pkt->hdr.ip), TRACKER_MAX_SYNC_ENTRIES);
+		goto drop;
+	}
+	if (tr.more)
+		return;
+
+	if (pkt->hdr.type == PEER_SUMMARY)
+		summary_handler(tc, tc->sync_tft);
+	else if (tc->resyncing) {
+		tc->resyncing = false;
+		resync_handler(tc, tc->sync_tft);
+	} else {
+		sync_handler(tc, tc->sync_tft);
+		scope_release(tc);
+	}
+	goto free_table;
+
+drop:
+	_error("bad sync from %u, dropped\n", ip_string(pkt->hdr.ip));
+	tracker_conn_drop(tc);
+free_table:
+	trans_table_destroy(tc->sync_tft);
+	free(tc->sync_tft);
+	tc->sync_tft = NULL;
+}
+
+/**
+ * PEER_RESYNC tells where the peer left, the PEER_SYNC chunks which
+ * follow are only the files it has changed since
+ */
+static void peer_resync_handler(struct tracker_conn *tc,
+				struct ptot_packet *pkt)
+{
+	bzero(&tc->resync, sizeof(tc->resync));
+	memcpy(&tc->resync, pkt->data,
+			min(pkt->hdr.data_len, sizeof(tc->resync)));
+	tc->resyncing = true;
+}
+
+/**
+ * every chunk of PEER_FILE_UPDATE is handled on its own
+ */
+static void peer_file_update_chunk_handler(struct tracker_conn *tc,
+					   struct ptot_packet *pkt)
+{
+	struct trans_file_table tft;
+	struct trans_chunk_reader tr;
+
+	if (trans_chunk_open(&tr, pkt->data, pkt->hdr.data_len) < 0)
+		return;
+
+	trans_table_init(&tft);
+	if (trans_chunk_read_table(&tr, &tft) == 0)
+		peer_file_update_handler(tc->conn, &tft);
+	trans_table_destroy(&tft);
+}
+
+/**
+ * take a handled packet off the bytes queued for a peer, and read
+ * from it again once half of them are drained
+ */
+static void tracker_conn_drained(struct tracker_conn *tc, int len)
+{
+	struct epoll_event ev;
+
+	/* under the lock, or a late pause would undo the resume */
+	pthread_mutex_lock(&tc->qlock);
+	tc->queued -= len;
+	if (tc->paused && tc->queued <= TRACKER_MAX_QUEUED / 2) {
+		tc->paused = false;
+		ev.events = EPOLLIN;
+		ev.data.ptr = tc;
+		epoll_ctl(tc->epfd, EPOLL_CTL_MOD, tc->conn, &ev);
+	}
+	pthread_mutex_unlock(&tc->qlock);
+}
+
+/**
+ * run on a worker, handles a packet received on a peer connection
+ */
+static void packet_work_handler(struct work *w)
+{
+	struct tracker_work *tw = list_entry(w, struct tracker_work, w);
+	struct tracker_conn *tc = tw->tc;
+	struct ptot_packet *pkt = (struct ptot_packet *)tw->buf;
+	uint32_t ip = pkt->hdr.ip;
+
+	if (tc->broken)
+		goto drained;
+
+	switch (pkt->hdr.type) {
+	case PEER_REGISTER:
+		_debug("[ PEER_REGISTER from '%u']\n", ip_string(ip));
+		peer_register_handler(tc, pkt);
+		break;
+	case PEER_KEEP_ALIVE:
+		_debug("[ PEER_KEEP_ALIVE from '%u']\n", ip_string(ip));
+		peer_life_update_handler(tc);
+		break;
+	case PEER_SYNC:
+		_debug("[ PEER_SYNC from '%u']\n", ip_string(ip));
+		peer_sync_chunk_handler(tc, pkt);
+		break;
+	case PEER_FILE_UPDATE:
+		_debug("[ PEER_FILE_UPDATE from '%u']\n", ip_string(ip));
+		peer_file_update_chunk_handler(tc, pkt);
+		break;
+	case PEER_RESYNC:
+		_debug("[ PEER_RESYNC from '%u']\n", ip_string(ip));
+		peer_resync_handler(tc, pkt);
+		break;
+	case PEER_SUMMARY:
+		_debug("[ PEER_SUMMARY from '%u']\n", ip_string(ip));
+		peer_sync_chunk_handler(tc, pkt);
+		break;
+	default:
+		break;
+	}
+
+drained:
+	tracker_conn_drained(tc, tw->len);
+	free(tw);
+}
+
+/**
+ * run on a worker as the final work of a peer connection, removes
+ * the peer and tells the others about the files it owned
+ */
+static void close_work_handler(struct work *w)
+{
+	struct tracker_conn *tc = list_entry(w, struct tracker_conn, close_w);
+	int conn = tc->conn;
 	uint32_t peer_ip;
-	struct trans_file_table *tft;
-	int i;
+	struct broadcast_stream *bs;
 
 	_enter();
 
 	peer_ip = peer_table_delete(&pt, conn);
-	file_table_delete_owner(&ft, peer_ip);
-	tft = calloc(1, sizeof(struct trans_file_table));
-	if (tft == NULL)
-		return;
-	trans_table_fill_from(tft, &ft);
-	for (i = 0; i < tft->n; i++)
-		tft->entries[i].op_type = FILE_MODIFY;
-	broadcast_update(&pt, tft, -1);
+	bs = broadcast_stream_alloc(&pt, -1);
+	file_table_delete_owner(&ft, peer_ip, tc->features & FEATURE_RESYNC,
+				owner_changed_fn, bs);
+	if (bs != NULL)
+		broadcast_stream_finish(bs);
+	segment_conn_close(conn);
 	close(conn);
 
-	free(tft);
+	if (tc->sync_tft != NULL) {
+		trans_table_destroy(tc->sync_tft);
+		free(tc->sync_tft);
+	}
+	scope_release(tc);
+	pthread_mutex_destroy(&tc->qlock);
+	free(tc);
+
+	_leave();
 }
 
-static void *receiver_task(void *arg)
+/**
+ * the owners restored from disk which have not come back in time are
+ * gone, their files are taken over by the others or dropped
+ */
+static void restored_owners_expire()
 {
-	long int conn = (long int)arg;
-	pthread_t my_tid = pthread_self();
-	struct ptot_packet pkt;
+	struct broadcast_stream *bs;
+	int i, n = 0;
+
+	for (i = 0; i < store.restored_n; i++) {
+		uint32_t ip = store.restored[i].ip;
+		if (peer_table_find(&pt, ip) != NULL)
+			continue;
+		bs = broadcast_stream_alloc(&pt, -1);
+		file_table_delete_owner(&ft, ip, false, owner_changed_fn, bs);
+		if (bs != NULL)
+			broadcast_stream_finish(bs);
+		n++;
+	}
+	_debug("%d of %d restored owners are gone\n", n, store.restored_n);
+}
 
-	_enter();
+/**
+ * journals the changes of the file table every STORE_SYNC_INTERVAL,
+ * and expires the restored owners after STORE_OWNER_GRACE
+ */
+static void *tracker_store_task(void *arg)
+{
+	int ticks = STORE_OWNER_GRACE * 1000000 / STORE_SYNC_INTERVAL;
 
-	pthread_cleanup_push(receiver_task_cleanup, (void *)conn);
-
-	while (recv_ptot_packet(conn, &pkt) > 0) {
-		pthread_t new_tid;
-		enum ptot_packet_type type = pkt.hdr.type;
-		uint32_t ip = pkt.hdr.ip;
-		uint16_t port = pkt.hdr.port;
-		uint16_t data_len = pkt.hdr.data_len;
-		struct server_thread_arg *targ;
-		struct trans_file_table *tft;
-
-		switch (type) {
-		case PEER_REGISTER:
-			_debug("[ PEER_REGISTER from '%u']\n", ip_string(ip));
-			/* create a structure of arguments that needs to pass
-			   to peer_register_handler_task thread */
-			targ = calloc(1, sizeof(*targ));
-			if (targ == NULL) {
-				_error("targ alloc failed\n");
-				pthread_exit((void *)-1);
-			}
-			targ->conn = conn;
-			targ->peerid.ip = ip;
-			targ->peerid.port = port;
-			targ->tid = my_tid;
-			/* creates peer_register_handler_task thread */
-			pthread_create(&new_tid, NULL,
-					peer_register_handler_task,
-					(void *)targ);
-			break;
-		case PEER_KEEP_ALIVE:
-			_debug("[ PEER_KEEP_ALIVE from '%u']\n", ip_string(ip));
-			/* creates peer_life_update_task thread */
-			pthread_create(&new_tid, NULL,
-					peer_life_update_task,
-					(void *)(long int)ip);
-			break;
-		case PEER_SYNC:
-			_debug("[ PEER_SYNC from '%u']\n", ip_string(ip));
-			targ = calloc(1, sizeof(*targ));
-			if (targ == NULL) {
-				_error("targ alloc failed\n");
-				pthread_exit((void *)-1);
-			}
-			targ->conn = conn;
+	while (1) {
+		usleep(STORE_SYNC_INTERVAL);
+		store_sync(&store);
+		if (ticks > 0 && --ticks == 0)
+			restored_owners_expire();
+	}
 
-			tft = calloc(1, sizeof(*tft));
-			if (tft == NULL) {
-				_error("trans file table alloc failed\n");
-				pthread_exit((void *)-1);
-			}
-			memcpy(tft, pkt.data, data_len);
+	pthread_exit((void *)0);
+}
 
-			targ->data = tft;
-			pthread_create(&new_tid, NULL,
-					sync_task, targ);
-			break;
-		case PEER_FILE_UPDATE:
-			_debug("[ PEER_FILE_UPDATE from '%u']\n", ip_string(ip));
-			/* extracts trans_file_table from received packet's
-			   data field */
-			targ = calloc(1, sizeof(*targ));
-			if (targ == NULL) {
-				_error("targ alloc failed\n");
-				pthread_exit((void *)-1);
-			}
-			targ->conn = conn;
+static struct tracker_conn *tracker_conn_alloc(int conn, int epfd)
+{
+	struct tracker_conn *tc = calloc(1, sizeof(struct tracker_conn));
 
-			tft = calloc(1, sizeof(*tft));
-			if (tft == NULL) {
-				_error("trans file table alloc failed\n");
-				pthread_exit((void *)-1);
-			}
-			memcpy(tft, pkt.data, data_len);
-			/* creates peer_file_update thread
-			   passes the trans_file_table structure it needs to
-			   handle as argument */
-			targ->data = tft;
-			pthread_create(&new_tid, NULL,
-					peer_file_update_task, targ);
+	if (tc == NULL) {
+		_error("tracker conn alloc failed\n");
+		return NULL;
+	}
+	tc->conn = conn;
+	tc->epfd = epfd;
+	work_strand_init(&tc->strand);
+	INIT_LIST_ELM(&tc->close_w.l);
+	tc->close_w.fn = close_work_handler;
+	tc->close_w.final = true;
+	pthread_mutex_init(&tc->qlock, NULL);
+
+	return tc;
+}
+
+/**
+ * read the packets which have arrived on a peer connection and queue
+ * them to the workers. At most TRACKER_READ_BATCH packets are read at
+ * a time, so that a busy peer can't starve the others. A peer with
+ * more than TRACKER_MAX_QUEUED bytes waiting for the workers is not
+ * read until they drain, the rest waits in its socket buffer
+ */
+static void tracker_conn_read(struct tracker_conn *tc)
+{
+	struct ptot_packet *pkt;
+	struct tracker_work *tw;
+	struct epoll_event ev;
+	int i, ret, len;
+
+	for (i = 0; i < TRACKER_READ_BATCH; i++) {
+		pthread_mutex_lock(&tc->qlock);
+		if (tc->queued > TRACKER_MAX_QUEUED) {
+			tc->paused = true;
+			ev.events = 0;
+			ev.data.ptr = tc;
+			epoll_ctl(tc->epfd, EPOLL_CTL_MOD, tc->conn, &ev);
+			pthread_mutex_unlock(&tc->qlock);
+			return;
+		}
+		pthread_mutex_unlock(&tc->qlock);
+
+		ret = try_recv_ptot_packet(tc->conn, &pkt);
+		if (ret == 0)
+			return;
+		if (ret < 0)
 			break;
-		default:
+
+		len = ptot_packet_len(pkt);
+		tw = malloc(sizeof(struct tracker_work) + len);
+		if (tw == NULL) {
+			_error("tracker work alloc failed\n");
 			break;
 		}
+		INIT_LIST_ELM(&tw->w.l);
+		tw->w.fn = packet_work_handler;
+		tw->w.final = false;
+		tw->tc = tc;
+		tw->len = len;
+		memcpy(tw->buf, pkt, len);
+		pthread_mutex_lock(&tc->qlock);
+		tc->queued += len;
+		pthread_mutex_unlock(&tc->qlock);
+		work_queue(&workers, &tc->strand, &tw->w);
 	}
+	if (i == TRACKER_READ_BATCH)
+		return;
 
-	pthread_cleanup_pop(0);
+	/* the peer is gone, nothing is read from it any more */
+	epoll_ctl(tc->epfd, EPOLL_CTL_DEL, tc->conn, NULL);
+	work_queue(&workers, &tc->strand, &tc->close_w);
+}
+
+/**
+ * an I/O thread, owns the peer connections added to its epoll fd
+ */
+static void *tracker_io_task(void *arg)
+{
+	int epfd = (long int)arg;
+	struct epoll_event events[TRACKER_MAX_EVENTS];
+	int i, n;
+
+	while (1) {
+		n = epoll_wait(epfd, events, TRACKER_MAX_EVENTS, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait() error");
+			break;
+		}
+		for (i = 0; i < n; i++)
+			tracker_conn_read(events[i].data.ptr);
+	}
 
-	_leave();
-	receiver_task_cleanup((void *)conn);
 	pthread_exit((void *)0);
 }
 
@@ -541,7 +1022,9 @@ void server_start()
 	long int listenfd, connfd;
 	struct sockaddr_in cliaddr;
 	socklen_t clilen;
-	pthread_t receiver_tid;
+	pthread_t tid;
+	int epfds[TRACKER_IO_THREADS];
+	int i, next = 0;
 
 	/* get tracker to peer control information */
 	if (parse_conf_file(&ctr_info) != 0)
@@ -549,15 +1032,43 @@ void server_start()
 	_debug("interval = %d, piece_len = %d\n", ctr_info.interval,
 			ctr_info.piece_len);
 
-	/* init file table and peer table */
+	/* a peer going away fails the write with EPIPE, only its
+	   connection is dropped then */
+	signal(SIGPIPE, SIG_IGN);
+
+	/* init file table and peer table, the file table is restored from
+	   disk first, so that returning peers only sync what differs */
 	file_table_init(&ft);
+	if (store_open(&store, &ft) < 0)
+		_error("file table is not kept on disk\n");
+	if (file_table_log_init(&ft) < 0)
+		return;
 	peer_table_init(&pt);
 
+	/* start the workers, the I/O threads and the alive checker */
+	if (work_pool_init(&workers, TRACKER_WORKERS) != 0)
+		return;
+	for (i = 0; i < TRACKER_IO_THREADS; i++) {
+		epfds[i] = epoll_create1(0);
+		if (epfds[i] < 0) {
+			perror("epoll_create1() error");
+			return;
+		}
+		pthread_create(&tid, NULL, tracker_io_task,
+				(void *)(long int)epfds[i]);
+	}
+	pthread_create(&tid, NULL, peer_check_alive_task, NULL);
+	pthread_create(&tid, NULL, tracker_store_task, NULL);
+
 	/* accept peer connection */
 	listenfd = server_tcp_listen(TRACKER_RECEIVER_PORT);
 	if (listenfd < 0)
 		return;
 	while (1) {
+		struct tracker_conn *tc;
+		struct epoll_event ev;
+
+		clilen = sizeof(cliaddr);
 		connfd = accept(listenfd, (struct sockaddr *)&cliaddr, &clilen);
 		if (connfd < 0) {
 			if (errno == EINTR)
@@ -567,10 +1078,26 @@ void server_start()
 				break;
 			}
 		}
-		pthread_create(&receiver_tid, NULL,
-				receiver_task, (void *)connfd);
+		segment_set_role(connfd, SEGMENT_CONTROL);
+
+		/* hand the connection over to the I/O threads in turn */
+		tc = tracker_conn_alloc(connfd, epfds[next]);
+		if (tc == NULL) {
+			close(connfd);
+			continue;
+		}
+		next = (next + 1) % TRACKER_IO_THREADS;
+		ev.events = EPOLLIN;
+		ev.data.ptr = tc;
+		if (epoll_ctl(tc->epfd, EPOLL_CTL_ADD, connfd, &ev) < 0) {
+			perror("epoll_ctl() error");
+			close(connfd);
+			free(tc);
+		}
 	}
 
+	store_sync(&store);
+	store_close(&store);
 	file_table_destroy(&ft);
 	return;
 }
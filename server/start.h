@@ -2,18 +2,50 @@
 #define SERVER_START_H
 
 #include <stdint.h>
+#include <stdbool.h>
 
 #include <consts.h>
+#include <packet_def.h>
 #include <trans_file_table.h>
+#include <file_table.h>
 #include <utility/pthread_wait.h>
+#include <utility/work_pool.h>
+#include "peer_table.h"
 
 #define SERVER_CONF_FILE	"./server/server.conf"
 
-struct server_thread_arg {
-	int		conn;
-	pthread_t	tid;
-	struct peer_id	peerid;	/* peer ip and peer port */
-	void		*data;
+#define TRACKER_IO_THREADS	2	/* threads owning the peer sockets */
+#define TRACKER_WORKERS		4	/* threads running the handlers */
+#define TRACKER_MAX_EVENTS	64	/* events per epoll_wait() */
+#define TRACKER_READ_BATCH	64	/* packets read per event */
+#define TRACKER_MAX_QUEUED	(1 << 20)	/* bytes queued per peer */
+#define TRACKER_MAX_SYNC_ENTRIES (1 << 16)	/* files in a peer's sync */
+
+/* a peer connection, owned by one I/O thread. Its packets are handled
+   in order on its strand of the worker pool */
+struct tracker_conn {
+	int			conn;
+	int			epfd;		/* of the owning I/O thread */
+	struct work_strand	strand;
+	struct peer_entry	*pe;		/* NULL until PEER_REGISTER */
+	int			features;	/* agreed in TRACKER_ACCEPT */
+	struct trans_file_table	*sync_tft;	/* PEER_SYNC chunks so far */
+	bool			resyncing;	/* PEER_RESYNC came first */
+	struct sync_point	resync;		/* where the peer left */
+	struct dir_set		*scope;		/* of PEER_SYNC, NULL if all */
+	struct work		close_w;	/* the final work */
+	pthread_mutex_t		qlock;
+	int			queued;		/* bytes of packets queued */
+	bool			paused;		/* not read until drained */
+	bool			broken;		/* dropped, the rest is ignored */
+};
+
+/* a packet received on a peer connection, waiting for a worker */
+struct tracker_work {
+	struct work		w;
+	struct tracker_conn	*tc;
+	int			len;
+	char			buf[];		/* the ptot packet */
 };
 
 void server_start();
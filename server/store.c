@@ -0,0 +1,442 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <debug.h>
+#include <hash.h>
+#include <list.h>
+#include "store.h"
+
+#define STORE_SNAPSHOT_MAGIC	"DSSNAP1"
+#define STORE_JOURNAL_MAGIC	"DSJRNL1"
+#define STORE_CHECK_SEED	0x5eed5eed
+
+/* writes chunks of entries as records of a store file */
+struct store_stream {
+	struct trans_stream ts;
+	int fd;
+	off_t len;		/* bytes written */
+	char chunk[TRANS_CHUNK_LEN];
+};
+
+static int store_write(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = write(fd, p, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+static int store_flush(struct trans_stream *ts, int len)
+{
+	struct store_stream *ss = list_entry(ts, struct store_stream, ts);
+	struct store_record rec;
+
+	rec.len = len;
+	rec.check = hash_mem(ss->chunk, len, STORE_CHECK_SEED);
+	if (store_write(ss->fd, &rec, sizeof(rec)) < 0 ||
+			store_write(ss->fd, ss->chunk, len) < 0)
+		return -1;
+	ss->len += sizeof(rec) + len;
+
+	return len;
+}
+
+static void store_stream_init(struct store_stream *ss, int fd)
+{
+	ss->fd = fd;
+	ss->len = 0;
+	trans_stream_init(&ss->ts, ss->chunk, store_flush);
+}
+
+static void store_header_init(struct store_header *hdr, const char *magic,
+			      uint64_t id)
+{
+	bzero(hdr, sizeof(*hdr));
+	strncpy(hdr->magic, magic, sizeof(hdr->magic));
+	hdr->id = id;
+}
+
+/**
+ * map a whole store file read only
+ * @len: returns the length of the file
+ * @return: the mapping, NULL if the file is missing or empty
+ */
+static char *store_map(const char *path, size_t *len)
+{
+	struct stat st;
+	char *data;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) < 0 ||
+			st.st_size < (off_t)sizeof(struct store_header)) {
+		close(fd);
+		return NULL;
+	}
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		_error("mmap '%s' failed\n", path);
+		return NULL;
+	}
+	madvise(data, st.st_size, MADV_SEQUENTIAL);
+	*len = st.st_size;
+
+	return data;
+}
+
+/* remember an owner found on disk, until it comes back or is expired */
+static void store_restore_owners(struct tracker_store *st,
+				 struct trans_file_entry *te)
+{
+	struct peer_id *restored;
+	int i, j;
+
+	for (i = 0; i < te->owner_n; i++) {
+		for (j = 0; j < st->restored_n; j++)
+			if (st->restored[j].ip == te->owners[i].ip)
+				break;
+		if (j < st->restored_n)
+			continue;
+		restored = realloc(st->restored,
+				   (st->restored_n + 1) * sizeof(*restored));
+		if (restored == NULL)
+			return;
+		st->restored = restored;
+		st->restored[st->restored_n++] = te->owners[i];
+	}
+}
+
+/**
+ * set an entry of the table to the state of a journaled one
+ */
+static void store_apply(struct tracker_store *st, struct trans_file_entry *te)
+{
+	struct file_entry *fe;
+
+	if (te->op_type == FILE_DELETE) {
+		file_table_delete(st->table, te);
+		return;
+	}
+
+	fe = file_table_add(st->table, te);
+	if (fe == NULL)
+		return;
+	/* the journal has the latest state, owners may be gone */
+	file_entry_update_timestamp(fe, te->timestamp);
+	file_entry_replace_owners(fe, te);
+	file_entry_put(fe);
+	store_restore_owners(st, te);
+}
+
+/**
+ * replay the records of a mapped store file into the table
+ * @return: bytes of the valid records with the header, -1 if the file
+ *          is not one of the store
+ */
+static off_t store_replay(struct tracker_store *st, char *data, size_t len,
+			  const char *magic)
+{
+	struct store_header *hdr = (struct store_header *)data;
+	struct trans_chunk_reader tr;
+	struct trans_file_entry te;
+	size_t pos = sizeof(*hdr);
+
+	if (strncmp(hdr->magic, magic, sizeof(hdr->magic)) != 0)
+		return -1;
+
+	/* a record torn by a crash ends the file */
+	while (pos + sizeof(struct store_record) <= len) {
+		struct store_record *rec = (struct store_record *)(data + pos);
+		char *chunk = data + pos + sizeof(*rec);
+
+		if (rec->len > len - pos - sizeof(*rec) ||
+				rec->check != hash_mem(chunk, rec->len,
+						       STORE_CHECK_SEED))
+			break;
+		if (trans_chunk_open(&tr, chunk, rec->len) < 0)
+			break;
+		while (trans_chunk_next(&tr, &te) > 0)
+			store_apply(st, &te);
+		pos += sizeof(*rec) + rec->len;
+	}
+
+	return pos;
+}
+
+/**
+ * load the snapshot and the journal into the table
+ */
+static void store_load(struct tracker_store *st)
+{
+	struct store_header *hdr;
+	char *data;
+	size_t len;
+	off_t end;
+
+	data = store_map(STORE_SNAPSHOT_FILE, &len);
+	if (data == NULL)
+		return;
+	hdr = (struct store_header *)data;
+	end = store_replay(st, data, len, STORE_SNAPSHOT_MAGIC);
+	if (end >= 0)
+		st->id = hdr->id;
+	else
+		_error("'%s' is not a snapshot\n", STORE_SNAPSHOT_FILE);
+	munmap(data, len);
+	if (end < 0)
+		return;
+
+	/* the journal of an older snapshot is stale */
+	data = store_map(STORE_JOURNAL_FILE, &len);
+	if (data == NULL)
+		return;
+	hdr = (struct store_header *)data;
+	if (hdr->id == st->id) {
+		end = store_replay(st, data, len, STORE_JOURNAL_MAGIC);
+		if (end >= 0 && end < (off_t)len)
+			_debug("journal is torn at %ld of %lu\n", end, len);
+	}
+	munmap(data, len);
+}
+
+static void store_dir_sync(const char *path)
+{
+	char dir[MAX_NAME_LEN], *slash;
+	int fd;
+
+	strncpy(dir, path, sizeof(dir) - 1);
+	dir[sizeof(dir) - 1] = '\0';
+	slash = strrchr(dir, '/');
+	if (slash == NULL)
+		strcpy(dir, ".");
+	else
+		*slash = '\0';
+
+	fd = open(dir, O_RDONLY);
+	if (fd < 0)
+		return;
+	fsync(fd);
+	close(fd);
+}
+
+static void journal_fn(struct trans_file_entry *te, void *arg)
+{
+	struct store_stream *ss = arg;
+
+	trans_stream_add(&ss->ts, te);
+}
+
+/**
+ * write a new snapshot of the table and start an empty journal of it
+ * You MUST lock the mutex of the store before calling it
+ * @return: 0 if succeeds, -1 otherwise
+ */
+static int __store_compact(struct tracker_store *st)
+{
+	char tmp[MAX_NAME_LEN];
+	struct store_stream *ss;
+	struct store_header hdr;
+	struct timespec ts;
+	uint64_t id, seq;
+	int fd, n, ret = -1;
+
+	ss = malloc(sizeof(*ss));
+	if (ss == NULL) {
+		_error("store stream alloc failed\n");
+		return -1;
+	}
+	clock_gettime(CLOCK_REALTIME, &ts);
+	id = hash_mix_64(((uint64_t)ts.tv_sec << 32 ^ ts.tv_nsec) ^ st->id);
+
+	/* the changes made while the table is walked are journaled
+	   again, replaying them twice leaves the same state */
+	seq = file_table_seq(st->table, NULL);
+	sprintf(tmp, "%s.tmp", STORE_SNAPSHOT_FILE);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		_error("open '%s' failed\n", tmp);
+		goto free_ss;
+	}
+	store_header_init(&hdr, STORE_SNAPSHOT_MAGIC, id);
+	store_stream_init(ss, fd);
+	if (store_write(fd, &hdr, sizeof(hdr)) < 0 ||
+			file_table_stream(st->table, &ss->ts, FILE_ADD,
+					  NULL) < 0 ||
+			(n = trans_stream_finish(&ss->ts)) < 0) {
+		_error("write '%s' failed\n", tmp);
+		goto close_fd;
+	}
+	hdr.n = n;
+	if (pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+			fsync(fd) < 0 || rename(tmp, STORE_SNAPSHOT_FILE) < 0) {
+		_error("save '%s' failed\n", STORE_SNAPSHOT_FILE);
+		goto close_fd;
+	}
+	store_dir_sync(STORE_SNAPSHOT_FILE);
+	close(fd);
+
+	/* the old journal is dropped with the old snapshot, a crash in
+	   between leaves a journal whose id is not the snapshot's */
+	if (st->journal_fd >= 0)
+		close(st->journal_fd);
+	st->journal_fd = open(STORE_JOURNAL_FILE,
+			      O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+	if (st->journal_fd < 0) {
+		_error("open '%s' failed\n", STORE_JOURNAL_FILE);
+		goto free_ss;
+	}
+	store_header_init(&hdr, STORE_JOURNAL_MAGIC, id);
+	if (store_write(st->journal_fd, &hdr, sizeof(hdr)) < 0 ||
+			fdatasync(st->journal_fd) < 0) {
+		_error("write '%s' failed\n", STORE_JOURNAL_FILE);
+		close(st->journal_fd);
+		st->journal_fd = -1;
+		goto free_ss;
+	}
+	st->id = id;
+	st->seq = seq;
+	st->journal_len = sizeof(hdr);
+	_debug("snapshot of %d entries at %lu\n", n, seq);
+	ret = 0;
+	goto free_ss;
+
+close_fd:
+	close(fd);
+	unlink(tmp);
+free_ss:
+	free(ss);
+	return ret;
+}
+
+/**
+ * load the tracker's file table from disk, and start a new snapshot
+ * of it. Call it before the change log of the table is set up, so
+ * that the restored entries are not taken as changes
+ * @return: 0 if succeeds, -1 if the table can't be kept on disk
+ */
+int store_open(struct tracker_store *st, struct file_table *table)
+{
+	int ret;
+
+	bzero(st, sizeof(*st));
+	pthread_mutex_init(&st->mutex, NULL);
+	st->table = table;
+	st->journal_fd = -1;
+
+	store_load(st);
+	_debug("%d entries restored, %d owners\n", file_table_count(table),
+			st->restored_n);
+
+	pthread_mutex_lock(&st->mutex);
+	ret = __store_compact(st);
+	pthread_mutex_unlock(&st->mutex);
+
+	return ret;
+}
+
+/**
+ * append the changes of the table since the last sync to the journal,
+ * the journal is compacted into a new snapshot once it grows too big
+ * @return: 0 if succeeds, -1 otherwise
+ */
+int store_sync(struct tracker_store *st)
+{
+	struct store_stream *ss;
+	uint64_t seq;
+	int n, ret = 0;
+
+	pthread_mutex_lock(&st->mutex);
+	if (st->journal_fd < 0) {
+		ret = -1;
+		goto out;
+	}
+	seq = file_table_seq(st->table, NULL);
+	if (seq == st->seq)
+		goto out;
+
+	ss = malloc(sizeof(*ss));
+	if (ss == NULL) {
+		_error("store stream alloc failed\n");
+		ret = -1;
+		goto out;
+	}
+	store_stream_init(ss, st->journal_fd);
+	n = file_table_changes(st->table, st->seq, journal_fn, ss);
+	if (n < 0) {
+		/* too many changes since, the log doesn't have them all */
+		free(ss);
+		ret = __store_compact(st);
+		goto out;
+	}
+	if (trans_stream_finish(&ss->ts) < 0 ||
+			fdatasync(st->journal_fd) < 0) {
+		_error("write '%s' failed\n", STORE_JOURNAL_FILE);
+		free(ss);
+		/* a torn record would end the replay before the records
+		   appended after it, cut it off or start a new journal */
+		if (ftruncate(st->journal_fd, st->journal_len) < 0)
+			__store_compact(st);
+		ret = -1;
+		goto out;
+	}
+	st->seq = seq;
+	st->journal_len += ss->len;
+	free(ss);
+
+	if (st->journal_len > STORE_JOURNAL_MAX)
+		ret = __store_compact(st);
+out:
+	pthread_mutex_unlock(&st->mutex);
+	return ret;
+}
+
+/**
+ * fold the journal into a new snapshot
+ * @return: 0 if succeeds, -1 otherwise
+ */
+int store_compact(struct tracker_store *st)
+{
+	int ret;
+
+	pthread_mutex_lock(&st->mutex);
+	ret = __store_compact(st);
+	pthread_mutex_unlock(&st->mutex);
+
+	return ret;
+}
+
+void store_close(struct tracker_store *st)
+{
+	pthread_mutex_lock(&st->mutex);
+	if (st->journal_fd >= 0)
+		close(st->journal_fd);
+	st->journal_fd = -1;
+	free(st->restored);
+	st->restored = NULL;
+	st->restored_n = 0;
+	pthread_mutex_unlock(&st->mutex);
+}
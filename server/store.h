@@ -0,0 +1,51 @@
+#ifndef SERVER_STORE_H
+#define SERVER_STORE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include <file_table.h>
+#include <trans_file_table.h>
+
+#define STORE_SNAPSHOT_FILE	"./server/tracker.snap"
+#define STORE_JOURNAL_FILE	"./server/tracker.journal"
+
+#define STORE_SYNC_INTERVAL	200000		/* micro sec between syncs */
+#define STORE_JOURNAL_MAX	(16 << 20)	/* bytes to compact at */
+#define STORE_OWNER_GRACE	30		/* sec for owners to return */
+
+/* the tracker's file table is kept on disk as a snapshot, and the
+   changes since in a journal appended to. Both are a header followed
+   by records, each one a chunk of packed entries as they are sent on
+   the wire. The journal belongs to the snapshot of the same id, it is
+   replayed on top of it when the tracker starts */
+struct store_header {
+	char magic[8];
+	uint64_t id;		/* of the snapshot */
+	uint64_t n;		/* entries in the snapshot, 0 in journal */
+};
+
+struct store_record {
+	uint32_t len;		/* of the chunk which follows */
+	uint32_t check;		/* hash_mem() of the chunk */
+};
+
+struct tracker_store {
+	pthread_mutex_t mutex;
+	struct file_table *table;
+	uint64_t id;		/* of the current snapshot */
+	uint64_t seq;		/* change of the table journaled up to */
+	int journal_fd;
+	off_t journal_len;
+	struct peer_id *restored;	/* owners found on disk */
+	int restored_n;
+};
+
+int store_open(struct tracker_store *st, struct file_table *table);
+int store_sync(struct tracker_store *st);
+int store_compact(struct tracker_store *st);
+void store_close(struct tracker_store *st);
+
+#endif
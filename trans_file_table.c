@@ -0,0 +1,395 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include <debug.h>
+#include <hash.h>
+#include <trans_file_table.h>
+
+#define TRANS_TABLE_INIT_SIZE	64
+#define VARINT_MAX_LEN		10	/* bytes of an encoded uint64_t */
+
+/* upper bound of a packed entry, see struct trans_chunk_header */
+#define TRANS_ENTRY_MAX_LEN	(2 * VARINT_MAX_LEN + MAX_NAME_LEN +	\
+				 4 * VARINT_MAX_LEN +			\
+				 MAX_PEER_ENTRIES * (sizeof(uint32_t) +	\
+						     VARINT_MAX_LEN))
+
+/**
+ * trans file table operations
+ */
+
+void trans_table_init(struct trans_file_table *tft)
+{
+	if (tft == NULL)
+		return;
+
+	bzero(tft, sizeof(struct trans_file_table));
+}
+
+/**
+ * append an empty entry to the trans file table, the table grows
+ * if it is full
+ * @tft: the trans file table
+ * @return: the new zeroed entry, NULL if failed
+ */
+struct trans_file_entry *trans_table_append(struct trans_file_table *tft)
+{
+	struct trans_file_entry *te;
+
+	if (tft->n == tft->size) {
+		int size = tft->size ? tft->size * 2 : TRANS_TABLE_INIT_SIZE;
+		te = realloc(tft->entries, size * sizeof(*te));
+		if (te == NULL) {
+			_error("trans table grow to %d failed\n", size);
+			return NULL;
+		}
+		tft->entries = te;
+		tft->size = size;
+	}
+
+	te = tft->entries + tft->n++;
+	bzero(te, sizeof(*te));
+
+	return te;
+}
+
+void trans_table_destroy(struct trans_file_table *tft)
+{
+	if (tft == NULL)
+		return;
+
+	free(tft->entries);
+	bzero(tft, sizeof(struct trans_file_table));
+}
+
+/**
+ * digest of a file version, the digest of a set of files is the sum
+ * of theirs, so that it doesn't depend on the order of the files. It
+ * is the same on every peer
+ */
+uint64_t trans_entry_digest(const char *name, uint64_t timestamp,
+			    uint16_t file_type)
+{
+	return hash_mix_64(((uint64_t)hash_str(name, file_type) << 32) ^
+			   timestamp);
+}
+
+
+/**
+ * varint encoding, 7 bits a byte with the high bit set on all but
+ * the last byte
+ */
+
+static inline int varint_put(char *buf, uint64_t v)
+{
+	int n = 0;
+
+	while (v >= 0x80) {
+		buf[n++] = (char)(v | 0x80);
+		v >>= 7;
+	}
+	buf[n++] = (char)v;
+
+	return n;
+}
+
+/**
+ * @return: bytes consumed, -1 if the varint is truncated or too long
+ */
+static inline int varint_get(const char *buf, int len, uint64_t *v)
+{
+	int n, shift = 0;
+
+	*v = 0;
+	for (n = 0; n < len && n < VARINT_MAX_LEN; n++, shift += 7) {
+		uint8_t b = buf[n];
+		*v |= (uint64_t)(b & 0x7f) << shift;
+		if (!(b & 0x80))
+			return n + 1;
+	}
+
+	return -1;
+}
+
+static inline uint64_t zigzag_encode(int64_t v)
+{
+	return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static inline int64_t zigzag_decode(uint64_t v)
+{
+	return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+static inline int common_prefix_len(const char *a, const char *b, int max)
+{
+	int n = 0;
+
+	while (n < max && a[n] != '\0' && a[n] == b[n])
+		n++;
+
+	return n;
+}
+
+/**
+ * pack an entry into buf, relative to the previous one of the chunk
+ * @return: length of the packed entry
+ */
+static int trans_entry_pack(struct trans_stream *ts, char *buf,
+			    struct trans_file_entry *te)
+{
+	int i, n = 0, name_len, prefix;
+
+	name_len = strnlen(te->name, MAX_NAME_LEN - 1);
+	prefix = common_prefix_len(ts->prev_name, te->name, name_len);
+
+	n += varint_put(buf + n, prefix);
+	n += varint_put(buf + n, name_len - prefix);
+	memcpy(buf + n, te->name + prefix, name_len - prefix);
+	n += name_len - prefix;
+
+	n += varint_put(buf + n, zigzag_encode(te->timestamp -
+					       ts->prev_timestamp));
+	n += varint_put(buf + n, te->op_type);
+	n += varint_put(buf + n, te->file_type);
+	n += varint_put(buf + n, min(te->owner_n, MAX_PEER_ENTRIES));
+	for (i = 0; i < te->owner_n && i < MAX_PEER_ENTRIES; i++) {
+		memcpy(buf + n, &te->owners[i].ip, sizeof(uint32_t));
+		n += sizeof(uint32_t);
+		n += varint_put(buf + n, te->owners[i].port);
+	}
+
+	memcpy(ts->prev_name, te->name, name_len);
+	ts->prev_name[name_len] = '\0';
+	ts->prev_timestamp = te->timestamp;
+
+	return n;
+}
+
+/**
+ * unpack an entry from the chunk, relative to the previous one read
+ * @return: 0 if succeeds, -1 if the entry is malformed
+ */
+static int trans_entry_unpack(struct trans_chunk_reader *tr,
+			      struct trans_file_entry *te)
+{
+	uint64_t prefix, suffix, delta, op, type, owner_n, port;
+	char *p = tr->data + tr->pos;
+	int i, ret, left = tr->len - tr->pos;
+
+#define GET_VARINT(v)							\
+	do {								\
+		ret = varint_get(p, left, &(v));			\
+		if (ret < 0)						\
+			return -1;					\
+		p += ret;						\
+		left -= ret;						\
+	} while (0)
+
+	GET_VARINT(prefix);
+	GET_VARINT(suffix);
+	if (prefix > strlen(tr->prev_name) ||
+	    prefix + suffix > MAX_NAME_LEN - 1 || suffix > left)
+		return -1;
+	bzero(te, sizeof(*te));
+	memcpy(te->name, tr->prev_name, prefix);
+	memcpy(te->name + prefix, p, suffix);
+	p += suffix;
+	left -= suffix;
+
+	GET_VARINT(delta);
+	GET_VARINT(op);
+	GET_VARINT(type);
+	GET_VARINT(owner_n);
+	if (owner_n > MAX_PEER_ENTRIES)
+		return -1;
+	te->timestamp = tr->prev_timestamp + zigzag_decode(delta);
+	te->op_type = op;
+	te->file_type = type;
+	te->owner_n = owner_n;
+	for (i = 0; i < owner_n; i++) {
+		if (left < sizeof(uint32_t))
+			return -1;
+		memcpy(&te->owners[i].ip, p, sizeof(uint32_t));
+		p += sizeof(uint32_t);
+		left -= sizeof(uint32_t);
+		GET_VARINT(port);
+		te->owners[i].port = port;
+	}
+
+#undef GET_VARINT
+
+	strcpy(tr->prev_name, te->name);
+	tr->prev_timestamp = te->timestamp;
+	tr->pos = tr->len - left;
+
+	return 0;
+}
+
+
+/**
+ * trans stream operations
+ */
+
+static inline void trans_stream_reset(struct trans_stream *ts)
+{
+	ts->len = sizeof(struct trans_chunk_header);
+	ts->n = 0;
+	ts->prev_name[0] = '\0';
+	ts->prev_timestamp = 0;
+}
+
+static int trans_stream_flush(struct trans_stream *ts, bool more)
+{
+	struct trans_chunk_header hdr;
+	int ret;
+
+	hdr.flags = more ? TRANS_CHUNK_MORE : 0;
+	hdr.n = ts->n;
+	memcpy(ts->data, &hdr, sizeof(hdr));
+
+	ret = ts->flush(ts, ts->len);
+	trans_stream_reset(ts);
+
+	return ret < 0 ? -1 : 0;
+}
+
+/**
+ * init a stream which sends a file table chunk by chunk
+ * @ts: the trans stream
+ * @data: the chunk buffer, normally the data of a packet
+ * @flush: called with the chunk length whenever a chunk is full
+ */
+void trans_stream_init(struct trans_stream *ts, char *data,
+		       int (*flush)(struct trans_stream *ts, int len))
+{
+	ts->data = data;
+	ts->total = 0;
+	ts->reply = false;
+	ts->flush = flush;
+	trans_stream_reset(ts);
+}
+
+/**
+ * add an entry to the stream, the current chunk is sent if it is full
+ * @return: 0 if succeeds, -1 if sending a chunk failed
+ */
+int trans_stream_add(struct trans_stream *ts, struct trans_file_entry *te)
+{
+	int ret = 0;
+
+	if (ts->len + TRANS_ENTRY_MAX_LEN > TRANS_CHUNK_LEN)
+		ret = trans_stream_flush(ts, true);
+
+	ts->len += trans_entry_pack(ts, ts->data + ts->len, te);
+	ts->n++;
+	ts->total++;
+
+	return ret;
+}
+
+int trans_stream_add_table(struct trans_stream *ts,
+			   struct trans_file_table *tft)
+{
+	int i, ret = 0;
+
+	for (i = 0; i < tft->n; i++)
+		if (trans_stream_add(ts, tft->entries + i) < 0)
+			ret = -1;
+
+	return ret;
+}
+
+/**
+ * send the last chunk of the stream. Nothing is sent for an empty
+ * stream unless it is a reply
+ * @return: number of entries streamed, -1 if failed
+ */
+int trans_stream_finish(struct trans_stream *ts)
+{
+	if (ts->total == 0 && !ts->reply)
+		return 0;
+
+	if (trans_stream_flush(ts, false) < 0)
+		return -1;
+
+	return ts->total;
+}
+
+
+/**
+ * trans chunk operations
+ */
+
+/**
+ * start reading a received chunk
+ * @tr: the chunk reader
+ * @data: the chunk, normally the data of a packet
+ * @len: length of the chunk
+ * @return: 0 if succeeds, -1 if the chunk is malformed
+ */
+int trans_chunk_open(struct trans_chunk_reader *tr, char *data, int len)
+{
+	struct trans_chunk_header hdr;
+
+	if (len < sizeof(hdr))
+		return -1;
+
+	memcpy(&hdr, data, sizeof(hdr));
+	tr->data = data;
+	tr->len = len;
+	tr->pos = sizeof(hdr);
+	tr->left = hdr.n;
+	tr->more = hdr.flags & TRANS_CHUNK_MORE;
+	tr->prev_name[0] = '\0';
+	tr->prev_timestamp = 0;
+
+	return 0;
+}
+
+/**
+ * read the next entry of a chunk
+ * @te: filled with the entry
+ * @return: 1 if an entry is read, 0 at the end of the chunk, -1 if
+ *          the rest of the chunk is malformed
+ */
+int trans_chunk_next(struct trans_chunk_reader *tr,
+		     struct trans_file_entry *te)
+{
+	if (tr->left == 0)
+		return 0;
+
+	if (trans_entry_unpack(tr, te) < 0) {
+		_error("bad chunk, %d entries left at %d of %d bytes\n",
+				tr->left, tr->pos, tr->len);
+		tr->left = 0;
+		return -1;
+	}
+	tr->left--;
+
+	return 1;
+}
+
+/**
+ * append all the entries of a chunk to a trans file table
+ * @return: 0 if succeeds, -1 otherwise
+ */
+int trans_chunk_read_table(struct trans_chunk_reader *tr,
+			   struct trans_file_table *tft)
+{
+	struct trans_file_entry *te;
+
+	while (tr->left > 0) {
+		te = trans_table_append(tft);
+		if (te == NULL)
+			return -1;
+		if (trans_chunk_next(tr, te) < 0) {
+			tft->n--;
+			return -1;
+		}
+	}
+
+	return 0;
+}
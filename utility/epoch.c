@@ -0,0 +1,204 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include <debug.h>
+#include <utility/epoch.h>
+
+/*
+ * Epoch based reclamation. Readers walk shared structures between
+ * epoch_enter() and epoch_exit() without locks. Writers unlink objects
+ * first and retire them with epoch_defer(). A retired object is freed
+ * once the global epoch has advanced twice, which only happens after
+ * every reader active at retirement has left its critical section.
+ */
+
+/* per-thread reader state, never freed but reused by later threads */
+struct epoch_record {
+	struct epoch_record *next;
+	uint64_t state;		/* epoch << 1 | active */
+	int nest;		/* depth of nested critical sections */
+	bool in_use;
+};
+
+static uint64_t epoch_global = 1;
+static struct epoch_record *epoch_records;
+static pthread_mutex_t epoch_records_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t epoch_key;
+static pthread_once_t epoch_once = PTHREAD_ONCE_INIT;
+static __thread struct epoch_record *epoch_self;
+
+/* retired objects waiting to be freed, oldest last */
+static struct epoch_head *epoch_limbo;
+static int epoch_limbo_n;
+static pthread_mutex_t epoch_limbo_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void epoch_record_release(void *arg)
+{
+	struct epoch_record *rec = arg;
+
+	__atomic_store_n(&rec->state, 0, __ATOMIC_RELEASE);
+	pthread_mutex_lock(&epoch_records_mutex);
+	rec->in_use = false;
+	pthread_mutex_unlock(&epoch_records_mutex);
+}
+
+static void epoch_key_create(void)
+{
+	pthread_key_create(&epoch_key, epoch_record_release);
+}
+
+static struct epoch_record *epoch_record_get(void)
+{
+	struct epoch_record *rec;
+
+	if (epoch_self != NULL)
+		return epoch_self;
+
+	pthread_once(&epoch_once, epoch_key_create);
+	pthread_mutex_lock(&epoch_records_mutex);
+	for (rec = epoch_records; rec != NULL; rec = rec->next)
+		if (!rec->in_use)
+			break;
+	if (rec == NULL) {
+		rec = calloc(1, sizeof(struct epoch_record));
+		if (rec == NULL) {
+			pthread_mutex_unlock(&epoch_records_mutex);
+			_error("epoch record alloc failed\n");
+			abort();
+		}
+		rec->next = epoch_records;
+		__atomic_store_n(&epoch_records, rec, __ATOMIC_RELEASE);
+	}
+	rec->in_use = true;
+	rec->nest = 0;
+	pthread_mutex_unlock(&epoch_records_mutex);
+
+	pthread_setspecific(epoch_key, rec);
+	epoch_self = rec;
+
+	return rec;
+}
+
+/**
+ * enter a read-side critical section, objects seen in it stay valid
+ * until the matching epoch_exit(). Sections may nest
+ */
+void epoch_enter()
+{
+	struct epoch_record *rec = epoch_record_get();
+	uint64_t epoch;
+
+	if (rec->nest++ > 0)
+		return;
+
+	epoch = __atomic_load_n(&epoch_global, __ATOMIC_ACQUIRE);
+	__atomic_store_n(&rec->state, epoch << 1 | 1, __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void epoch_exit()
+{
+	struct epoch_record *rec = epoch_self;
+
+	if (--rec->nest > 0)
+		return;
+
+	__atomic_store_n(&rec->state, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * advance the global epoch if every active reader has seen the
+ * current one
+ * @return: the global epoch
+ */
+static uint64_t epoch_try_advance(void)
+{
+	uint64_t epoch = __atomic_load_n(&epoch_global, __ATOMIC_SEQ_CST);
+	struct epoch_record *rec;
+
+	rec = __atomic_load_n(&epoch_records, __ATOMIC_ACQUIRE);
+	for (; rec != NULL; rec = rec->next) {
+		uint64_t state = __atomic_load_n(&rec->state, __ATOMIC_SEQ_CST);
+		if ((state & 1) && (state >> 1) != epoch)
+			return epoch;
+	}
+
+	__atomic_compare_exchange_n(&epoch_global, &epoch, epoch + 1, false,
+				    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	return __atomic_load_n(&epoch_global, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * free the retired objects which no reader can see any more
+ * You MUST hold epoch_limbo_mutex
+ * @return: the freed objects, linked by next
+ */
+static struct epoch_head *__epoch_collect(uint64_t epoch)
+{
+	struct epoch_head **pp = &epoch_limbo, *eh;
+
+	/* the list is sorted by retirement, newest first */
+	for (eh = *pp; eh != NULL; pp = &eh->next, eh = *pp)
+		if (eh->epoch + 2 <= epoch)
+			break;
+	*pp = NULL;
+
+	return eh;
+}
+
+/**
+ * retire an unlinked object, it is freed by @free once no reader can
+ * see it any more
+ */
+void epoch_defer(struct epoch_head *eh, void (*free)(struct epoch_head *eh))
+{
+	struct epoch_head *done = NULL, *next;
+
+	eh->free = free;
+
+	/* read under the lock, the global epoch only grows, so the limbo
+	   stays sorted for __epoch_collect() */
+	pthread_mutex_lock(&epoch_limbo_mutex);
+	eh->epoch = __atomic_load_n(&epoch_global, __ATOMIC_SEQ_CST);
+	eh->next = epoch_limbo;
+	epoch_limbo = eh;
+	if (++epoch_limbo_n >= EPOCH_RECLAIM_BATCH) {
+		done = __epoch_collect(epoch_try_advance());
+		for (eh = done; eh != NULL; eh = eh->next)
+			epoch_limbo_n--;
+	}
+	pthread_mutex_unlock(&epoch_limbo_mutex);
+
+	for (eh = done; eh != NULL; eh = next) {
+		next = eh->next;
+		eh->free(eh);
+	}
+}
+
+/**
+ * wait until every object retired so far is freed
+ * You MUST NOT call it inside a read-side critical section
+ */
+void epoch_synchronize()
+{
+	uint64_t target = __atomic_load_n(&epoch_global, __ATOMIC_SEQ_CST) + 2;
+	struct epoch_head *done, *eh, *next;
+
+	while (epoch_try_advance() < target)
+		usleep(1000);
+
+	pthread_mutex_lock(&epoch_limbo_mutex);
+	done = __epoch_collect(__atomic_load_n(&epoch_global,
+					       __ATOMIC_SEQ_CST));
+	for (eh = done; eh != NULL; eh = eh->next)
+		epoch_limbo_n--;
+	pthread_mutex_unlock(&epoch_limbo_mutex);
+
+	for (eh = done; eh != NULL; eh = next) {
+		next = eh->next;
+		eh->free(eh);
+	}
+}
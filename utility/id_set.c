@@ -0,0 +1,142 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <debug.h>
+#include <utility/id_set.h>
+
+/* the word holding an id, or NULL if it is beyond the set */
+static inline uint64_t *id_set_word(struct id_set *s, int id)
+{
+	int w = id / ID_SET_WORD_BITS;
+
+	if (w == 0)
+		return &s->word;
+	if (w > s->ext_n)
+		return NULL;
+	return s->ext + w - 1;
+}
+
+void id_set_init(struct id_set *s)
+{
+	s->word = 0;
+	s->ext = NULL;
+	s->ext_n = 0;
+}
+
+void id_set_clear(struct id_set *s)
+{
+	free(s->ext);
+	id_set_init(s);
+}
+
+/**
+ * add an id to the set
+ * @return: 1 if it is added, 0 if it is there already, -1 if the set
+ *          fails to grow
+ */
+int id_set_add(struct id_set *s, int id)
+{
+	uint64_t bit = 1ULL << (id % ID_SET_WORD_BITS);
+	uint64_t *w = id_set_word(s, id);
+
+	if (w == NULL) {
+		int ext_n = id / ID_SET_WORD_BITS;
+		uint64_t *ext = realloc(s->ext, ext_n * sizeof(uint64_t));
+		if (ext == NULL) {
+			_error("id set grow to %d words failed\n", ext_n + 1);
+			return -1;
+		}
+		memset(ext + s->ext_n, 0,
+				(ext_n - s->ext_n) * sizeof(uint64_t));
+		s->ext = ext;
+		s->ext_n = ext_n;
+		w = id_set_word(s, id);
+	}
+	if (*w & bit)
+		return 0;
+	*w |= bit;
+
+	return 1;
+}
+
+/**
+ * @return: true if the id was in the set
+ */
+bool id_set_del(struct id_set *s, int id)
+{
+	uint64_t bit = 1ULL << (id % ID_SET_WORD_BITS);
+	uint64_t *w = id_set_word(s, id);
+
+	if (w == NULL || !(*w & bit))
+		return false;
+	*w &= ~bit;
+
+	return true;
+}
+
+bool id_set_test(struct id_set *s, int id)
+{
+	uint64_t *w = id_set_word(s, id);
+
+	return w != NULL && (*w >> (id % ID_SET_WORD_BITS) & 1);
+}
+
+bool id_set_empty(struct id_set *s)
+{
+	int i;
+
+	if (s->word != 0)
+		return false;
+	for (i = 0; i < s->ext_n; i++)
+		if (s->ext[i] != 0)
+			return false;
+
+	return true;
+}
+
+int id_set_count(struct id_set *s)
+{
+	int i, n = __builtin_popcountll(s->word);
+
+	for (i = 0; i < s->ext_n; i++)
+		n += __builtin_popcountll(s->ext[i]);
+
+	return n;
+}
+
+bool id_set_equal(struct id_set *a, struct id_set *b)
+{
+	int i, n = a->ext_n > b->ext_n ? a->ext_n : b->ext_n;
+
+	if (a->word != b->word)
+		return false;
+	for (i = 0; i < n; i++) {
+		uint64_t wa = i < a->ext_n ? a->ext[i] : 0;
+		uint64_t wb = i < b->ext_n ? b->ext[i] : 0;
+		if (wa != wb)
+			return false;
+	}
+
+	return true;
+}
+
+/**
+ * @return: the smallest id in the set not less than @id, or -1
+ */
+int id_set_next(struct id_set *s, int id)
+{
+	int w = id / ID_SET_WORD_BITS;
+	uint64_t bits;
+
+	if (w > s->ext_n)
+		return -1;
+	bits = *id_set_word(s, id) & (~0ULL << (id % ID_SET_WORD_BITS));
+	while (bits == 0) {
+		if (++w > s->ext_n)
+			return -1;
+		bits = s->ext[w - 1];
+	}
+
+	return w * ID_SET_WORD_BITS + __builtin_ctzll(bits);
+}
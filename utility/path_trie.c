@@ -0,0 +1,253 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <debug.h>
+#include <hash.h>
+#include <utility/path_trie.h>
+
+static inline uint32_t path_comp_hash(struct path_node *parent,
+				      const char *comp, int len)
+{
+	return hash_mem(comp, len, (uint32_t)hash_mix_64((uintptr_t)parent));
+}
+
+static struct hlist_head *path_buckets_alloc(int bits)
+{
+	struct hlist_head *buckets;
+	int i;
+
+	buckets = malloc((1 << bits) * sizeof(struct hlist_head));
+	if (buckets == NULL)
+		return NULL;
+	for (i = 0; i < 1 << bits; i++)
+		INIT_HLIST_HEAD(buckets + i);
+
+	return buckets;
+}
+
+int path_trie_init(struct path_trie *pt)
+{
+	pthread_mutex_init(&pt->mutex, NULL);
+	pt->bits = PATH_TRIE_INIT_BITS;
+	pt->n = 0;
+	pt->buckets = path_buckets_alloc(pt->bits);
+	if (pt->buckets == NULL) {
+		_error("path trie alloc failed\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+void path_trie_destroy(struct path_trie *pt)
+{
+	struct path_node *node;
+	struct hlist_node *tmp;
+	int i;
+
+	pthread_mutex_lock(&pt->mutex);
+	for (i = 0; i < 1 << pt->bits; i++)
+		hlist_for_each_entry_safe(node, tmp, pt->buckets + i, hlist)
+			free(node);
+	free(pt->buckets);
+	pt->buckets = NULL;
+	pt->n = 0;
+	pthread_mutex_unlock(&pt->mutex);
+}
+
+/**
+ * double the buckets, one node per bucket on average at most
+ * You MUST lock the mutex of the trie before calling it
+ */
+static void __path_trie_grow(struct path_trie *pt)
+{
+	struct hlist_head *buckets;
+	struct path_node *node;
+	struct hlist_node *tmp;
+	int i;
+
+	buckets = path_buckets_alloc(pt->bits + 1);
+	if (buckets == NULL)
+		return;
+	for (i = 0; i < 1 << pt->bits; i++)
+		hlist_for_each_entry_safe(node, tmp, pt->buckets + i, hlist) {
+			__hlist_del(&node->hlist);
+			hlist_add_head(&node->hlist, buckets +
+					hash_32(node->hash, pt->bits + 1));
+		}
+	free(pt->buckets);
+	pt->buckets = buckets;
+	pt->bits++;
+}
+
+/**
+ * find or create the child of a node, a reference of it is taken
+ * You MUST lock the mutex of the trie before calling it
+ */
+static struct path_node *__path_child_get(struct path_trie *pt,
+					  struct path_node *parent,
+					  const char *comp, int len)
+{
+	uint32_t hash = path_comp_hash(parent, comp, len);
+	struct path_node *node;
+
+	hlist_for_each_entry(node, pt->buckets + hash_32(hash, pt->bits), hlist)
+		if (node->hash == hash && node->parent == parent &&
+				node->len == len &&
+				memcmp(node->comp, comp, len) == 0) {
+			node->ref++;
+			return node;
+		}
+
+	node = malloc(sizeof(struct path_node) + len + 1);
+	if (node == NULL) {
+		_error("path node alloc failed\n");
+		return NULL;
+	}
+	node->parent = parent;
+	node->hash = hash;
+	node->ref = 1;
+	node->sum = 0;
+	node->len = len;
+	node->path_len = parent ? parent->path_len + 1 + len : len;
+	memcpy(node->comp, comp, len);
+	node->comp[len] = '\0';
+	if (parent != NULL)
+		parent->ref++;
+	hlist_add_head(&node->hlist, pt->buckets + hash_32(hash, pt->bits));
+	if (++pt->n > 1 << pt->bits)
+		__path_trie_grow(pt);
+
+	return node;
+}
+
+/**
+ * drop a reference of a node, the nodes no longer used are freed up
+ * to the root
+ * You MUST lock the mutex of the trie before calling it
+ */
+static void __path_put(struct path_trie *pt, struct path_node *node)
+{
+	while (node != NULL && --node->ref == 0) {
+		struct path_node *parent = node->parent;
+		__hlist_del(&node->hlist);
+		pt->n--;
+		free(node);
+		node = parent;
+	}
+}
+
+/**
+ * intern a path, components are split at '/'
+ * @return: the node of the path with a reference taken, drop it by
+ *          path_put(), or NULL
+ */
+struct path_node *path_get(struct path_trie *pt, const char *path)
+{
+	struct path_node *node = NULL, *child;
+	const char *comp = path, *end;
+
+	pthread_mutex_lock(&pt->mutex);
+	while (1) {
+		for (end = comp; *end != '\0' && *end != '/'; end++)
+			;
+		child = __path_child_get(pt, node, comp, end - comp);
+		/* the child holds the parent now */
+		if (node != NULL)
+			__path_put(pt, node);
+		if (child == NULL) {
+			node = NULL;
+			break;
+		}
+		node = child;
+		if (*end == '\0')
+			break;
+		comp = end + 1;
+	}
+	pthread_mutex_unlock(&pt->mutex);
+
+	return node;
+}
+
+/**
+ * take another reference of a node
+ */
+void path_hold(struct path_trie *pt, struct path_node *node)
+{
+	pthread_mutex_lock(&pt->mutex);
+	node->ref++;
+	pthread_mutex_unlock(&pt->mutex);
+}
+
+void path_put(struct path_trie *pt, struct path_node *node)
+{
+	if (node == NULL)
+		return;
+
+	pthread_mutex_lock(&pt->mutex);
+	__path_put(pt, node);
+	pthread_mutex_unlock(&pt->mutex);
+}
+
+/**
+ * build the whole path of a node
+ * @size: size of the buffer
+ * @return: length of the whole path, or -1 if it does not fit, buf is
+ *          left empty then rather than holding a cut path
+ */
+int path_name(struct path_node *node, char *buf, int size)
+{
+	int path_len = node->path_len, end = path_len;
+
+	if (path_len >= size) {
+		if (size > 0)
+			buf[0] = '\0';
+		return -1;
+	}
+	buf[path_len] = '\0';
+
+	/* from the last component back to the root */
+	for (; node != NULL; node = node->parent) {
+		int start = end - node->len;
+		memcpy(buf + start, node->comp, node->len);
+		if (node->parent != NULL)
+			buf[start - 1] = '/';
+		end = start - 1;
+	}
+
+	return path_len;
+}
+
+/**
+ * compare a path with the one of a node without building it
+ * @len: length of the path
+ */
+bool path_equal(struct path_node *node, const char *path, int len)
+{
+	if (node->path_len != len)
+		return false;
+
+	for (; node != NULL; node = node->parent) {
+		len -= node->len;
+		if (memcmp(path + len, node->comp, node->len) != 0)
+			return false;
+		if (node->parent != NULL && path[--len] != '/')
+			return false;
+	}
+
+	return true;
+}
+
+/**
+ * tell whether a node is somewhere under a directory, nodes are shared
+ * by prefixes, so it is only a walk up the parents
+ */
+bool path_under(struct path_node *node, struct path_node *dir)
+{
+	for (node = node->parent; node != NULL; node = node->parent)
+		if (node == dir)
+			return true;
+
+	return false;
+}
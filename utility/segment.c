@@ -1,65 +1,931 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
 
+#include <consts.h>
+#include <list.h>
 #include <utility/segment.h>
 #include <debug.h>
 
+/* an outgoing segment, already framed. The payload is either copied
+   into data, or shared with other connections through a segment_buf */
+struct segment_msg {
+	struct list_head l;
+	int len;		/* length of the framed segment */
+	int sent;		/* bytes of it written already */
+	int nvec;
+	struct iovec vec[3];	/* the framed segment */
+	char hdr[sizeof(struct segment_header)];
+	struct segment_buf *sb;	/* shared payload, NULL if copied */
+	char data[];
+};
+
+/* per-connection segment state, indexed by the connection fd */
+struct segment_conn {
+	enum segment_mode mode;
+	char *rbuf;		/* receive buffer of SEGMENT_BUF_LEN bytes */
+	int rstart;		/* first unconsumed byte in rbuf */
+	int rend;		/* end of received data in rbuf */
+	int fd;
+	bool broken;		/* a write failed, drop later segments */
+	bool pending;		/* on the flusher's list */
+	struct list_head pl;	/* in seg_pending */
+	int queued;		/* bytes waiting in sendq */
+	struct list_head sendq;	/* segments waiting for the writer */
+	pthread_mutex_t qlock;	/* protects sendq and queued */
+	pthread_mutex_t send_lock;	/* held by the thread writing */
+};
+
+static struct segment_conn *seg_conns[MAX_SEGMENT_CONNS];
+static pthread_mutex_t seg_conns_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* connections whose queue is left to the flusher thread */
+static LIST(seg_pending);
+static pthread_mutex_t seg_pending_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t seg_flusher_once = PTHREAD_ONCE_INIT;
+static int seg_wakeup[2] = { -1, -1 };	/* pipe waking up the flusher */
+
+static void segment_msg_free(struct segment_msg *msg)
+{
+	if (msg->sb != NULL)
+		segment_buf_put(msg->sb);
+	free(msg);
+}
+
+static void segment_queue_free(struct segment_conn *sc)
+{
+	struct list_head *pos, *tmp;
+
+	list_for_each_safe(pos, tmp, &sc->sendq) {
+		struct segment_msg *msg = list_entry(pos, struct segment_msg, l);
+		list_del(&msg->l);
+		segment_msg_free(msg);
+	}
+	sc->queued = 0;
+}
+
+static struct segment_conn *segment_conn_get(int conn)
+{
+	struct segment_conn *sc;
+
+	if (conn < 0 || conn >= MAX_SEGMENT_CONNS)
+		return NULL;
+
+	sc = seg_conns[conn];
+	if (sc != NULL)
+		return sc;
+
+	pthread_mutex_lock(&seg_conns_mutex);
+	sc = seg_conns[conn];
+	if (sc == NULL) {
+		sc = calloc(1, sizeof(struct segment_conn));
+		if (sc == NULL)
+			_error("segment conn alloc failed\n");
+		else if ((sc->rbuf = malloc(SEGMENT_BUF_LEN)) == NULL) {
+			_error("segment recv buffer alloc failed\n");
+			free(sc);
+			sc = NULL;
+		} else {
+			sc->mode = SEGMENT_SENTINEL;
+			sc->fd = conn;
+			INIT_LIST_ELM(&sc->pl);
+			INIT_LIST_HEAD(&sc->sendq);
+			pthread_mutex_init(&sc->qlock, NULL);
+			pthread_mutex_init(&sc->send_lock, NULL);
+			seg_conns[conn] = sc;
+		}
+	}
+	pthread_mutex_unlock(&seg_conns_mutex);
+
+	return sc;
+}
+
+/**
+ * set the wire mode which is used to send segments on a connection
+ * @conn: connection fd
+ * @mode: SEGMENT_SENTINEL for legacy peers, SEGMENT_FRAMED otherwise
+ */
+void segment_set_mode(int conn, enum segment_mode mode)
+{
+	struct segment_conn *sc = segment_conn_get(conn);
+
+	if (sc != NULL)
+		sc->mode = mode;
+}
+
+enum segment_mode segment_get_mode(int conn)
+{
+	struct segment_conn *sc;
+
+	if (conn < 0 || conn >= MAX_SEGMENT_CONNS)
+		return SEGMENT_SENTINEL;
+
+	sc = seg_conns[conn];
+	return sc == NULL ? SEGMENT_SENTINEL : sc->mode;
+}
+
+/**
+ * release the segment state of a connection
+ * You MUST call it before closing the connection fd, since the fd
+ * number would be reused by later connections
+ */
+void segment_conn_close(int conn)
+{
+	struct segment_conn *sc;
+
+	if (conn < 0 || conn >= MAX_SEGMENT_CONNS)
+		return;
+
+	pthread_mutex_lock(&seg_conns_mutex);
+	sc = seg_conns[conn];
+	seg_conns[conn] = NULL;
+	if (sc != NULL && sc->pending) {
+		pthread_mutex_lock(&seg_pending_mutex);
+		list_del(&sc->pl);
+		sc->pending = false;
+		pthread_mutex_unlock(&seg_pending_mutex);
+	}
+	pthread_mutex_unlock(&seg_conns_mutex);
+
+	if (sc == NULL)
+		return;
+	segment_queue_free(sc);
+	pthread_mutex_destroy(&sc->qlock);
+	pthread_mutex_destroy(&sc->send_lock);
+	free(sc->rbuf);
+	free(sc);
+}
+
+/**
+ * frame a payload into at most 3 io vectors: header, payload and
+ * trailer (padding for framed segments)
+ * @hdr: buffer of at least sizeof(struct segment_header) bytes
+ * @return: number of io vectors used
+ */
+static int segment_frame(enum segment_mode mode, struct iovec *iov,
+			 char *hdr, char *buf, int len)
+{
+	static char start_buf[] = { '!', '&' };
+	static char end_buf[] = { '!', '#' };
+	static char pad[SEGMENT_ALIGN] = { 0 };
+	struct segment_header *sh = (struct segment_header *)hdr;
+
+	if (mode == SEGMENT_FRAMED) {
+		sh->magic = SEGMENT_MAGIC;
+		sh->version = SEGMENT_VERSION;
+		sh->flags = 0;
+		sh->len = htonl(len);
+		iov[0].iov_base = sh;
+		iov[0].iov_len = sizeof(*sh);
+		iov[2].iov_base = pad;
+		iov[2].iov_len = segment_align(len) - len;
+	} else {
+		iov[0].iov_base = start_buf;
+		iov[0].iov_len = sizeof(start_buf);
+		iov[2].iov_base = end_buf;
+		iov[2].iov_len = sizeof(end_buf);
+	}
+	iov[1].iov_base = buf;
+	iov[1].iov_len = len;
+
+	return iov[2].iov_len > 0 ? 3 : 2;
+}
+
+static inline int iov_total(struct iovec *iov, int n)
+{
+	int i, len = 0;
+
+	for (i = 0; i < n; i++)
+		len += iov[i].iov_len;
+	return len;
+}
+
+/**
+ * write all the io vectors, resuming after partial writes. A peer
+ * which has gone away makes it fail with EPIPE instead of raising
+ * SIGPIPE
+ * @return: number of bytes written, -1 if failed
+ */
+static int writev_all(int conn, struct iovec *iov, int n)
+{
+	int total = iov_total(iov, n);
+	int left = total, ret;
+	struct msghdr mh;
+
+	while (left > 0) {
+		bzero(&mh, sizeof(mh));
+		mh.msg_iov = iov;
+		mh.msg_iovlen = n;
+		ret = sendmsg(conn, &mh, MSG_NOSIGNAL);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		left -= ret;
+		while (n > 0 && ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			n--;
+		}
+		if (n > 0) {
+			iov->iov_base = (char *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+
+	return total;
+}
+
+/**
+ * fill io vectors with the part of a message not written yet
+ * @return: number of io vectors used
+ */
+static int segment_msg_iov(struct segment_msg *msg, struct iovec *iov,
+			   int max)
+{
+	int i, n = 0, skip = msg->sent;
+
+	for (i = 0; i < msg->nvec && n < max; i++) {
+		if (skip >= msg->vec[i].iov_len) {
+			skip -= msg->vec[i].iov_len;
+			continue;
+		}
+		iov[n].iov_base = (char *)msg->vec[i].iov_base + skip;
+		iov[n].iov_len = msg->vec[i].iov_len - skip;
+		skip = 0;
+		n++;
+	}
+
+	return n;
+}
+
+/**
+ * write the queued messages, as many of them as possible per
+ * sendmsg() call
+ * You MUST hold sc->send_lock before calling it
+ * @nonblock: return instead of waiting when the socket buffer is full
+ * @return: 0 if the queue is empty, 1 if messages are left because the
+ *          socket would block, -1 if the connection is broken
+ */
+static int segment_drain(int conn, struct segment_conn *sc, bool nonblock)
+{
+	struct iovec iov[SEGMENT_IOV_MAX];
+	struct msghdr mh;
+	struct list_head *pos, *tmp;
+	int n, ret, flags = nonblock ? MSG_DONTWAIT | MSG_NOSIGNAL : MSG_NOSIGNAL;
+
+	while (1) {
+		n = 0;
+		pthread_mutex_lock(&sc->qlock);
+		list_for_each(pos, &sc->sendq) {
+			struct segment_msg *msg =
+				list_entry(pos, struct segment_msg, l);
+			if (n == SEGMENT_IOV_MAX)
+				break;
+			n += segment_msg_iov(msg, iov + n, SEGMENT_IOV_MAX - n);
+		}
+		pthread_mutex_unlock(&sc->qlock);
+		if (n == 0)
+			return 0;
+
+		bzero(&mh, sizeof(mh));
+		mh.msg_iov = iov;
+		mh.msg_iovlen = n;
+		do {
+			ret = sendmsg(conn, &mh, flags);
+		} while (ret < 0 && errno == EINTR);
+		if (ret < 0 && nonblock &&
+				(errno == EAGAIN || errno == EWOULDBLOCK))
+			return 1;
+
+		pthread_mutex_lock(&sc->qlock);
+		if (ret < 0) {
+			_error("segment send failed on %d\n", conn);
+			sc->broken = true;
+			segment_queue_free(sc);
+			pthread_mutex_unlock(&sc->qlock);
+			return -1;
+		}
+		sc->queued -= ret;
+		list_for_each_safe(pos, tmp, &sc->sendq) {
+			struct segment_msg *msg =
+				list_entry(pos, struct segment_msg, l);
+			if (ret < msg->len - msg->sent) {
+				msg->sent += ret;
+				break;
+			}
+			ret -= msg->len - msg->sent;
+			list_del(&msg->l);
+			segment_msg_free(msg);
+		}
+		pthread_mutex_unlock(&sc->qlock);
+	}
+}
+
+static inline bool segment_queue_empty(struct segment_conn *sc)
+{
+	bool empty;
+
+	pthread_mutex_lock(&sc->qlock);
+	empty = list_empty(&sc->sendq);
+	pthread_mutex_unlock(&sc->qlock);
+
+	return empty;
+}
+
+/**
+ * drain the queue unless another thread is writing already, that
+ * thread would pick up the queued messages before it leaves
+ */
+static void segment_kick(int conn, struct segment_conn *sc)
+{
+	while (!segment_queue_empty(sc) &&
+			pthread_mutex_trylock(&sc->send_lock) == 0) {
+		segment_drain(conn, sc, false);
+		pthread_mutex_unlock(&sc->send_lock);
+	}
+}
+
+static struct segment_msg *segment_msg_alloc(struct iovec *iov, int n)
+{
+	struct segment_msg *msg;
+	int i, len = iov_total(iov, n);
+
+	msg = malloc(sizeof(struct segment_msg) + len);
+	if (msg == NULL)
+		return NULL;
+	INIT_LIST_ELM(&msg->l);
+	msg->len = len;
+	msg->sent = 0;
+	msg->sb = NULL;
+	msg->nvec = 1;
+	msg->vec[0].iov_base = msg->data;
+	msg->vec[0].iov_len = len;
+	for (i = 0, len = 0; i < n; i++) {
+		memcpy(msg->data + len, iov[i].iov_base, iov[i].iov_len);
+		len += iov[i].iov_len;
+	}
+
+	return msg;
+}
+
+/**
+ * send a segment with a single gather-write. If another thread is
+ * writing to the same connection, the segment is queued and sent
+ * along with the other queued ones by that thread
+ * @conn: connection fd
+ * @buf: payload of the segment
+ * @len: payload length
+ * @return: -1, failed. Otherwise indicates how many bytes have been
+ *          sent or queued
+ */
 int send_segment(int conn, char *buf, int len)
 {
-	char start_buf[] = { '!', '&' };
-	char end_buf[] = { '!', '#' };
+	struct segment_conn *sc = segment_conn_get(conn);
+	char hdr[sizeof(struct segment_header)];
+	struct segment_msg *msg;
+	struct iovec iov[3];
+	int n, ret;
 
-	if (send(conn, start_buf, sizeof(start_buf), 0) < 0)
+	if (sc == NULL || sc->broken)
 		return -1;
-	if (send(conn, buf, len, 0) < 0)
+
+	n = segment_frame(sc->mode, iov, hdr, buf, len);
+
+	if (pthread_mutex_trylock(&sc->send_lock) == 0) {
+		/* nobody is writing, keep the order by draining the
+		   queue first and then write from the caller's buffer */
+		ret = segment_drain(conn, sc, false);
+		if (ret == 0)
+			ret = writev_all(conn, iov, n);
+		if (ret < 0)
+			sc->broken = true;
+		pthread_mutex_unlock(&sc->send_lock);
+		segment_kick(conn, sc);
+		return ret;
+	}
+
+	msg = segment_msg_alloc(iov, n);
+	if (msg == NULL) {
+		_error("segment msg alloc failed\n");
 		return -1;
-	if (send(conn, end_buf, sizeof(end_buf), 0) < 0)
+	}
+	len = msg->len;
+	pthread_mutex_lock(&sc->qlock);
+	list_add_tail(&sc->sendq, &msg->l);
+	sc->queued += len;
+	ret = sc->queued;
+	pthread_mutex_unlock(&sc->qlock);
+
+	/* the peer doesn't keep up, wait for the writer */
+	if (ret > SEGMENT_MAX_QUEUED) {
+		pthread_mutex_lock(&sc->send_lock);
+		ret = segment_drain(conn, sc, false);
+		pthread_mutex_unlock(&sc->send_lock);
+		if (ret < 0)
+			return -1;
+	}
+	segment_kick(conn, sc);
+
+	return len;
+}
+
+/**
+ * send a segment followed by raw bytes which are not framed, e.g. a
+ * piece written by sendfile(). Nothing else is written to the
+ * connection in between, the queued segments go out before them
+ * @raw: writes the raw bytes, returns -1 if failed
+ * @arg: passed to raw
+ * @return: -1 if failed, otherwise the return of raw
+ */
+int send_segment_raw(int conn, char *buf, int len,
+		     int (*raw)(int conn, void *arg), void *arg)
+{
+	struct segment_conn *sc = segment_conn_get(conn);
+	char hdr[sizeof(struct segment_header)];
+	struct iovec iov[3];
+	int n, ret;
+
+	if (sc == NULL || sc->broken)
 		return -1;
 
-	return len + sizeof(start_buf) + sizeof(end_buf);
-}
-
-int recv_segment(int conn, char *buf, int len)
-{
-	char c;
-	int idx = 0;
-	// state can be 0,1,2,3; 
-	// 0 starting point 
-	// 1 '!' received
-	// 2 '&' received, start receiving segment
-	// 3 '!' received,
-	// 4 '#' received, finish receiving segment 
-	int state = 0;  
-	while (recv(conn, &c, 1, 0) > 0) {
-		if (state == 0) {
-			if (c == '!')
-				state = 1;
-		} else if (state == 1)
-			state = c == '&' ? 2 : 0;
-		else if (state == 2) {
-			if (c == '!') {
-				buf[idx] = c;
-				idx++;
-				state = 3;
-			} else {
-				buf[idx] = c;
-				idx++;
-			}   
-		} else if (state == 3) {
-			if (c == '#') {
-				buf[idx]=c;
-				idx++;
-				return idx;
-			} else if (c == '!') {
-				buf[idx] = c;
-				idx++;
-			} else {
-				buf[idx] = c;
-				idx++;
-				state = 2;
+	n = segment_frame(sc->mode, iov, hdr, buf, len);
+
+	pthread_mutex_lock(&sc->send_lock);
+	ret = segment_drain(conn, sc, false);
+	if (ret == 0)
+		ret = writev_all(conn, iov, n);
+	if (ret >= 0)
+		ret = raw(conn, arg);
+	if (ret < 0)
+		sc->broken = true;
+	pthread_mutex_unlock(&sc->send_lock);
+	segment_kick(conn, sc);
+
+	return ret;
+}
+
+/**
+ * alloc a shared payload with a single reference held by the caller
+ * @len: payload length
+ */
+struct segment_buf *segment_buf_alloc(int len)
+{
+	struct segment_buf *sb = malloc(sizeof(struct segment_buf) + len);
+
+	if (sb == NULL) {
+		_error("segment buf alloc failed\n");
+		return NULL;
+	}
+	sb->ref = 1;
+	sb->len = len;
+
+	return sb;
+}
+
+inline void segment_buf_get(struct segment_buf *sb)
+{
+	__sync_fetch_and_add(&sb->ref, 1);
+}
+
+/**
+ * drop a reference, the buffer is freed with the last one
+ */
+void segment_buf_put(struct segment_buf *sb)
+{
+	if (__sync_sub_and_fetch(&sb->ref, 1) == 0)
+		free(sb);
+}
+
+/**
+ * the flusher thread writes the queues the senders left behind
+ * because the socket buffer was full, so that senders never wait
+ * for a slow peer
+ */
+static void *segment_flusher_task(void *arg)
+{
+	struct pollfd fds[MAX_CONNECTIONS + 1];
+	struct list_head *pos;
+	char junk[64];
+	int i, n, busy;
+
+	while (1) {
+		fds[0].fd = seg_wakeup[0];
+		fds[0].events = POLLIN;
+		n = 1;
+		pthread_mutex_lock(&seg_pending_mutex);
+		list_for_each(pos, &seg_pending) {
+			struct segment_conn *sc =
+				list_entry(pos, struct segment_conn, pl);
+			if (n == MAX_CONNECTIONS + 1)
+				break;
+			fds[n].fd = sc->fd;
+			fds[n].events = POLLOUT;
+			n++;
+		}
+		pthread_mutex_unlock(&seg_pending_mutex);
+
+		if (poll(fds, n, -1) < 0 && errno != EINTR) {
+			perror("poll() error");
+			continue;
+		}
+		if (fds[0].revents & POLLIN)
+			while (read(seg_wakeup[0], junk, sizeof(junk)) ==
+					sizeof(junk))
+				;
+
+		for (i = 1, busy = 0; i < n; i++) {
+			struct segment_conn *sc;
+
+			if (fds[i].revents == 0)
+				continue;
+
+			/* seg_conns_mutex keeps the connection from being
+			   closed under us */
+			pthread_mutex_lock(&seg_conns_mutex);
+			sc = seg_conns[fds[i].fd];
+			if (sc == NULL || !sc->pending) {
+				pthread_mutex_unlock(&seg_conns_mutex);
+				continue;
+			}
+			if (pthread_mutex_trylock(&sc->send_lock) == 0) {
+				segment_drain(sc->fd, sc, true);
+				pthread_mutex_unlock(&sc->send_lock);
+			} else
+				busy++;
+
+			/* a sender may queue more right after the drain,
+			   so only an empty queue leaves the list */
+			pthread_mutex_lock(&seg_pending_mutex);
+			if (segment_queue_empty(sc)) {
+				list_del(&sc->pl);
+				sc->pending = false;
 			}
+			pthread_mutex_unlock(&seg_pending_mutex);
+			pthread_mutex_unlock(&seg_conns_mutex);
 		}
+
+		/* another thread is writing, don't spin on POLLOUT */
+		if (busy > 0)
+			usleep(1000);
+	}
+
+	return NULL;
+}
+
+static void segment_flusher_start(void)
+{
+	pthread_t tid;
+
+	if (pipe(seg_wakeup) < 0) {
+		perror("pipe() error");
+		return;
+	}
+	fcntl(seg_wakeup[0], F_SETFL, O_NONBLOCK);
+	fcntl(seg_wakeup[1], F_SETFL, O_NONBLOCK);
+	if (pthread_create(&tid, NULL, segment_flusher_task, NULL) != 0)
+		_error("segment flusher create failed\n");
+	else
+		pthread_detach(tid);
+}
+
+/**
+ * hand the queue of a connection over to the flusher thread
+ */
+static void segment_defer(struct segment_conn *sc)
+{
+	char c = 0;
+
+	pthread_once(&seg_flusher_once, segment_flusher_start);
+
+	pthread_mutex_lock(&seg_pending_mutex);
+	if (!sc->pending) {
+		list_add_tail(&seg_pending, &sc->pl);
+		sc->pending = true;
+	}
+	pthread_mutex_unlock(&seg_pending_mutex);
+
+	if (write(seg_wakeup[1], &c, 1) < 0 && errno != EAGAIN)
+		perror("write() error");
+}
+
+/**
+ * queue a shared payload as a segment on a connection without
+ * waiting for the peer. The connection takes its own reference of
+ * the buffer, and whatever can't be written right away is left to
+ * the flusher thread. A peer whose backlog grows beyond
+ * SEGMENT_MAX_BACKLOG is considered dead and its connection is shut
+ * down, the receiver of the connection cleans it up then
+ * @conn: connection fd
+ * @sb: the payload, the caller keeps its reference
+ * @return: -1, failed. Otherwise indicates how many bytes have been
+ *          queued
+ */
+int send_segment_buf(int conn, struct segment_buf *sb)
+{
+	struct segment_conn *sc = segment_conn_get(conn);
+	struct segment_msg *msg;
+	int len, ret = 1;
+
+	if (sc == NULL || sc->broken)
+		return -1;
+
+	msg = malloc(sizeof(struct segment_msg));
+	if (msg == NULL) {
+		_error("segment msg alloc failed\n");
+		return -1;
+	}
+	INIT_LIST_ELM(&msg->l);
+	msg->nvec = segment_frame(sc->mode, msg->vec, msg->hdr,
+				  sb->data, sb->len);
+	msg->len = len = iov_total(msg->vec, msg->nvec);
+	msg->sent = 0;
+	segment_buf_get(sb);
+	msg->sb = sb;
+
+	pthread_mutex_lock(&sc->qlock);
+	if (sc->queued + len > SEGMENT_MAX_BACKLOG) {
+		pthread_mutex_unlock(&sc->qlock);
+		_error("peer on %d doesn't keep up, drop it\n", conn);
+		segment_msg_free(msg);
+		sc->broken = true;
+		shutdown(conn, SHUT_RDWR);
+		return -1;
+	}
+	list_add_tail(&sc->sendq, &msg->l);
+	sc->queued += len;
+	pthread_mutex_unlock(&sc->qlock);
+
+	if (pthread_mutex_trylock(&sc->send_lock) == 0) {
+		ret = segment_drain(conn, sc, true);
+		pthread_mutex_unlock(&sc->send_lock);
+	}
+	if (ret == 1)
+		segment_defer(sc);
+
+	return ret < 0 ? -1 : len;
+}
+
+/**
+ * set the TCP options of a connection according to its role.
+ * Control connections carry small latency sensitive segments and
+ * disable Nagle. Bulk connections are corked, so that piece data
+ * goes out in full-sized TCP segments until segment_push()
+ * @conn: connection fd
+ * @role: SEGMENT_CONTROL or SEGMENT_BULK
+ */
+void segment_set_role(int conn, enum segment_role role)
+{
+	int nodelay = role == SEGMENT_CONTROL;
+	int cork = role == SEGMENT_BULK;
+
+	if (setsockopt(conn, IPPROTO_TCP, TCP_NODELAY,
+				&nodelay, sizeof(nodelay)) < 0)
+		perror("setsockopt(TCP_NODELAY) error");
+	if (setsockopt(conn, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork)) < 0)
+		perror("setsockopt(TCP_CORK) error");
+}
+
+/**
+ * push out the partial TCP segment held back on a bulk connection,
+ * You SHOULD call it at the end of each burst, e.g. a whole piece
+ */
+void segment_push(int conn)
+{
+	int cork = 0;
+
+	setsockopt(conn, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+	cork = 1;
+	setsockopt(conn, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+}
+
+/**
+ * read more bytes from the connection into the receive buffer.
+ * The unconsumed bytes are moved to the head of the buffer first,
+ * so a whole segment always fits
+ * @nonblock: fail with EAGAIN instead of waiting for bytes
+ * @return: number of bytes read, 0 or -1 if the connection is gone.
+ *          A segment which doesn't fit fails it with ENOBUFS, never
+ *          with a stale EAGAIN, so that the connection is closed
+ */
+static int segment_fill(int conn, struct segment_conn *sc, bool nonblock)
+{
+	int ret;
+
+	if (sc->rstart > 0) {
+		memmove(sc->rbuf, sc->rbuf + sc->rstart, sc->rend - sc->rstart);
+		sc->rend -= sc->rstart;
+		sc->rstart = 0;
+	}
+	if (sc->rend == SEGMENT_BUF_LEN) {
+		_error("segment exceeds %d bytes\n", SEGMENT_BUF_LEN);
+		errno = ENOBUFS;
+		return -1;
+	}
+
+	do {
+		ret = recv(conn, sc->rbuf + sc->rend,
+				SEGMENT_BUF_LEN - sc->rend,
+				nonblock ? MSG_DONTWAIT : 0);
+	} while (ret < 0 && errno == EINTR);
+	if (ret > 0)
+		sc->rend += ret;
+
+	return ret;
+}
+
+/**
+ * parse a framed segment at the head of the receive buffer
+ * @return: payload length, 0 if it is not complete yet, -1 if it is
+ *          malformed
+ */
+static int parse_framed_segment(struct segment_conn *sc, char **data)
+{
+	struct segment_header *hdr;
+	int avail = sc->rend - sc->rstart;
+	int offset = sc->rstart & ~(SEGMENT_ALIGN - 1);
+	uint32_t len;
+
+	if (avail < sizeof(struct segment_header))
+		return 0;
+
+	/* only happens right after a legacy segment or raw bytes */
+	if (offset != sc->rstart) {
+		memmove(sc->rbuf + offset, sc->rbuf + sc->rstart, avail);
+		sc->rstart = offset;
+		sc->rend = offset + avail;
+	}
+
+	hdr = (struct segment_header *)(sc->rbuf + sc->rstart);
+	if (hdr->version != SEGMENT_VERSION) {
+		_error("unknown segment version %d\n", hdr->version);
+		return -1;
+	}
+	len = ntohl(hdr->len);
+	if (len == 0 || len > SEGMENT_BUF_LEN - sizeof(*hdr) - SEGMENT_ALIGN) {
+		_error("bad segment length %u\n", len);
+		return -1;
+	}
+	if (avail < sizeof(*hdr) + segment_align(len))
+		return 0;
+
+	*data = sc->rbuf + sc->rstart + sizeof(*hdr);
+	sc->rstart += sizeof(*hdr) + segment_align(len);
+
+	return len;
+}
+
+/**
+ * parse a legacy '!&' ... '!#' segment at the head of the receive
+ * buffer. The payload is moved down to an aligned address, which only
+ * overwrites bytes that have been consumed already
+ * @return: payload length, 0 if it is not complete yet
+ */
+static int parse_sentinel_segment(struct segment_conn *sc, char **data)
+{
+	char *start = sc->rbuf + sc->rstart;
+	char *end = sc->rbuf + sc->rend;
+	char *payload, *p;
+	int len, offset;
+
+	if (end - start < 2)
+		return 0;
+	if (start[1] != '&') {
+		/* not a segment start, skip the '!' */
+		sc->rstart++;
+		return 0;
+	}
+
+	payload = start + 2;
+	for (p = payload; (p = memchr(p, '!', end - p)) != NULL; p++)
+		if (p + 1 < end && p[1] == '#')
+			break;
+	if (p == NULL || p + 1 >= end)
+		return 0;
+
+	len = p - payload;
+	if (len == 0) {
+		sc->rstart = p + 2 - sc->rbuf;
+		return 0;
+	}
+	offset = (payload - sc->rbuf) & ~(SEGMENT_ALIGN - 1);
+	memmove(sc->rbuf + offset, payload, len);
+	*data = sc->rbuf + offset;
+	sc->rstart = p + 2 - sc->rbuf;
+
+	return len;
+}
+
+static int segment_recv(int conn, char **data, bool nonblock)
+{
+	struct segment_conn *sc = segment_conn_get(conn);
+	int start, ret = 0;
+
+	if (sc == NULL)
+		return -1;
+
+	while (1) {
+		/* skip garbage until a segment start */
+		while (sc->rstart < sc->rend &&
+				sc->rbuf[sc->rstart] != SEGMENT_MAGIC &&
+				sc->rbuf[sc->rstart] != '!')
+			sc->rstart++;
+
+		if (sc->rstart < sc->rend) {
+			start = sc->rstart;
+			if (sc->rbuf[sc->rstart] == SEGMENT_MAGIC)
+				ret = parse_framed_segment(sc, data);
+			else
+				ret = parse_sentinel_segment(sc, data);
+			if (ret != 0)
+				return ret;
+			/* skipped a stray '!' or an empty segment */
+			if (sc->rstart != start)
+				continue;
+		}
+
+		if (sc->rstart == sc->rend)
+			sc->rstart = sc->rend = 0;
+		ret = segment_fill(conn, sc, nonblock);
+		if (ret < 0 && nonblock &&
+				(errno == EAGAIN || errno == EWOULDBLOCK))
+			return 0;
+		if (ret <= 0)
+			return -1;
+	}
+}
+
+/**
+ * receive a segment and hand out a view of its payload inside the
+ * per-connection receive buffer, no matter in which mode the peer
+ * sends it. The payload is aligned to SEGMENT_ALIGN
+ * You MUST NOT use the view after the next call on the same
+ * connection, and only one thread may receive on a connection
+ * @conn: connection fd
+ * @data: set to the payload of the segment
+ * @return: payload length, -1 if failed
+ */
+int recv_segment_view(int conn, char **data)
+{
+	return segment_recv(conn, data, false);
+}
+
+/**
+ * the same as recv_segment_view(), but never waits for the peer.
+ * It is meant for event loops, which call it until it returns 0
+ * whenever the connection becomes readable
+ * @return: payload length, 0 if no whole segment has arrived yet, -1
+ *          if the connection is gone
+ */
+int recv_segment_try(int conn, char **data)
+{
+	return segment_recv(conn, data, true);
+}
+
+/**
+ * receive raw bytes which follow a segment, see send_segment_raw().
+ * The bytes read ahead into the receive buffer are taken first
+ * @buf: filled with exactly len bytes
+ * @return: len, -1 if the connection is gone
+ */
+int recv_segment_raw(int conn, char *buf, int len)
+{
+	struct segment_conn *sc = segment_conn_get(conn);
+	int n, ret;
+
+	if (sc == NULL)
+		return -1;
+
+	n = sc->rend - sc->rstart;
+	if (n > len)
+		n = len;
+	memcpy(buf, sc->rbuf + sc->rstart, n);
+	sc->rstart += n;
+	if (sc->rstart == sc->rend)
+		sc->rstart = sc->rend = 0;
+
+	while (n < len) {
+		ret = recv(conn, buf + n, len - n, MSG_WAITALL);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		n += ret;
 	}
 
-	return -1;
+	return len;
 }
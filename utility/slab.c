@@ -0,0 +1,224 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <debug.h>
+#include <utility/slab.h>
+
+/* objects cached by a thread for a pool */
+struct slab_cache {
+	struct slab_pool *pool;
+	void *free;			/* linked by their first word */
+	int n;
+	struct slab_cache *next;	/* in the caches of the pool */
+};
+
+#define slab_next(obj) (*(void **)(obj))
+
+/**
+ * carve a new slab into free objects
+ * You MUST lock the mutex of the pool before calling it
+ */
+static int __slab_pool_grow(struct slab_pool *pool)
+{
+	char *slab, *obj;
+	int i;
+
+	slab = malloc(SLAB_SIZE);
+	if (slab == NULL) {
+		_error("slab alloc failed\n");
+		return -1;
+	}
+	slab_next(slab) = pool->slabs;
+	pool->slabs = slab;
+
+	obj = slab + SLAB_ALIGN;
+	for (i = 0; i < pool->obj_per_slab; i++, obj += pool->obj_size) {
+		slab_next(obj) = pool->free;
+		pool->free = obj;
+	}
+
+	return 0;
+}
+
+/**
+ * take an object from the pool
+ * You MUST lock the mutex of the pool before calling it
+ */
+static void *__slab_pool_pop(struct slab_pool *pool)
+{
+	void *obj;
+
+	if (pool->free == NULL && __slab_pool_grow(pool) < 0)
+		return NULL;
+	obj = pool->free;
+	pool->free = slab_next(obj);
+
+	return obj;
+}
+
+/* return the cached objects when their thread exits */
+static void slab_cache_release(void *arg)
+{
+	struct slab_cache *c = arg;
+	struct slab_pool *pool = c->pool;
+	struct slab_cache **pp;
+	void *obj;
+
+	pthread_mutex_lock(&pool->mutex);
+	while ((obj = c->free) != NULL) {
+		c->free = slab_next(obj);
+		slab_next(obj) = pool->free;
+		pool->free = obj;
+	}
+	for (pp = &pool->caches; *pp != NULL; pp = &(*pp)->next)
+		if (*pp == c) {
+			*pp = c->next;
+			break;
+		}
+	pthread_mutex_unlock(&pool->mutex);
+
+	free(c);
+}
+
+static struct slab_cache *slab_cache_get(struct slab_pool *pool)
+{
+	struct slab_cache *c = pthread_getspecific(pool->key);
+
+	if (c != NULL)
+		return c;
+
+	c = calloc(1, sizeof(struct slab_cache));
+	if (c == NULL)
+		return NULL;
+	c->pool = pool;
+	pthread_mutex_lock(&pool->mutex);
+	c->next = pool->caches;
+	pool->caches = c;
+	pthread_mutex_unlock(&pool->mutex);
+	pthread_setspecific(pool->key, c);
+
+	return c;
+}
+
+/**
+ * init a pool of objects
+ * @obj_size: size of every object
+ * @return: 0 if succeeds, -1 otherwise
+ */
+int slab_pool_init(struct slab_pool *pool, size_t obj_size)
+{
+	if (obj_size < sizeof(void *))
+		obj_size = sizeof(void *);
+	obj_size = (obj_size + SLAB_ALIGN - 1) & ~(size_t)(SLAB_ALIGN - 1);
+	if (obj_size > SLAB_SIZE - SLAB_ALIGN) {
+		_error("slab object of %lu bytes is too big\n", obj_size);
+		return -1;
+	}
+
+	pthread_mutex_init(&pool->mutex, NULL);
+	pool->obj_size = obj_size;
+	pool->obj_per_slab = (SLAB_SIZE - SLAB_ALIGN) / obj_size;
+	pool->slabs = NULL;
+	pool->free = NULL;
+	pool->caches = NULL;
+	if (pthread_key_create(&pool->key, slab_cache_release) != 0) {
+		_error("slab cache key create failed\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * release all the slabs of the pool at once
+ * You MUST NOT use any object of the pool after it
+ */
+void slab_pool_destroy(struct slab_pool *pool)
+{
+	struct slab_cache *c;
+	void *slab;
+
+	pthread_key_delete(pool->key);
+
+	pthread_mutex_lock(&pool->mutex);
+	while ((c = pool->caches) != NULL) {
+		pool->caches = c->next;
+		free(c);
+	}
+	while ((slab = pool->slabs) != NULL) {
+		pool->slabs = slab_next(slab);
+		free(slab);
+	}
+	pool->free = NULL;
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+/**
+ * allocate an object from the pool, it is not zeroed
+ */
+void *slab_alloc(struct slab_pool *pool)
+{
+	struct slab_cache *c = slab_cache_get(pool);
+	void *obj;
+
+	if (c == NULL) {
+		pthread_mutex_lock(&pool->mutex);
+		obj = __slab_pool_pop(pool);
+		pthread_mutex_unlock(&pool->mutex);
+		return obj;
+	}
+
+	if (c->n == 0) {
+		pthread_mutex_lock(&pool->mutex);
+		while (c->n < SLAB_CACHE_BATCH) {
+			obj = __slab_pool_pop(pool);
+			if (obj == NULL)
+				break;
+			slab_next(obj) = c->free;
+			c->free = obj;
+			c->n++;
+		}
+		pthread_mutex_unlock(&pool->mutex);
+		if (c->n == 0)
+			return NULL;
+	}
+
+	obj = c->free;
+	c->free = slab_next(obj);
+	c->n--;
+
+	return obj;
+}
+
+void slab_free(struct slab_pool *pool, void *obj)
+{
+	struct slab_cache *c = slab_cache_get(pool);
+
+	if (obj == NULL)
+		return;
+
+	if (c == NULL) {
+		pthread_mutex_lock(&pool->mutex);
+		slab_next(obj) = pool->free;
+		pool->free = obj;
+		pthread_mutex_unlock(&pool->mutex);
+		return;
+	}
+
+	slab_next(obj) = c->free;
+	c->free = obj;
+	if (++c->n < SLAB_CACHE_MAX)
+		return;
+
+	/* give a batch back, so that a thread which only frees doesn't
+	   hoard the objects */
+	pthread_mutex_lock(&pool->mutex);
+	while (c->n > SLAB_CACHE_MAX - SLAB_CACHE_BATCH) {
+		obj = c->free;
+		c->free = slab_next(obj);
+		c->n--;
+		slab_next(obj) = pool->free;
+		pool->free = obj;
+	}
+	pthread_mutex_unlock(&pool->mutex);
+}
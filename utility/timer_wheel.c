@@ -0,0 +1,115 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <debug.h>
+#include <utility/timer_wheel.h>
+
+/**
+ * current time of a monotonic clock in micro sec, the time base of
+ * every timer wheel
+ */
+uint64_t timer_wheel_clock()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * init an empty timer wheel
+ * @slot_n: number of slots, timers further than slot_n ticks away
+ *          share the slots with nearer ones
+ * @tick_us: length of a tick in micro sec
+ * @return: 0 if succeeds, -1 otherwise
+ */
+int timer_wheel_init(struct timer_wheel *tw, int slot_n, uint64_t tick_us)
+{
+	int i;
+
+	tw->slots = calloc(slot_n, sizeof(struct list_head));
+	if (tw->slots == NULL) {
+		_error("timer wheel slots alloc failed\n");
+		return -1;
+	}
+	for (i = 0; i < slot_n; i++)
+		INIT_LIST_HEAD(tw->slots + i);
+	tw->slot_n = slot_n;
+	tw->tick_us = tick_us;
+	tw->now = timer_wheel_clock() / tick_us;
+
+	return 0;
+}
+
+void timer_wheel_destroy(struct timer_wheel *tw)
+{
+	free(tw->slots);
+	tw->slots = NULL;
+}
+
+/**
+ * arm a timer or move an armed one to a new expiry time in O(1)
+ * @delay_us: the timer expires this long from now
+ */
+void timer_wheel_arm(struct timer_wheel *tw, struct timer_entry *t,
+		     uint64_t delay_us)
+{
+	uint64_t expires;
+
+	/* round up, a timer never expires early */
+	expires = (timer_wheel_clock() + delay_us + tw->tick_us - 1) /
+		tw->tick_us;
+	if (expires <= tw->now)
+		expires = tw->now + 1;
+
+	if (timer_pending(t))
+		list_del(&t->l);
+	t->expires = expires;
+	list_add_tail(tw->slots + expires % tw->slot_n, &t->l);
+}
+
+void timer_wheel_cancel(struct timer_wheel *tw, struct timer_entry *t)
+{
+	if (timer_pending(t))
+		list_del(&t->l);
+}
+
+/**
+ * advance the wheel to a time and move all the timers expired by
+ * then onto a list, so that they can be handled in a batch. The moved
+ * timers stay on the list until the caller takes them off with
+ * timer_wheel_cancel()
+ * @now_us: current time of timer_wheel_clock()
+ * @expired: the list the expired timers are appended to
+ * @return: number of expired timers
+ */
+int timer_wheel_advance(struct timer_wheel *tw, uint64_t now_us,
+			struct list_head *expired)
+{
+	uint64_t target = now_us / tw->tick_us;
+	struct list_head *pos, *tmp;
+	int i, n = 0;
+
+	/* every slot is visited once at most, however far the wheel
+	   falls behind */
+	for (i = 0; tw->now < target && i < tw->slot_n; i++) {
+		struct list_head *slot;
+
+		tw->now++;
+		slot = tw->slots + tw->now % tw->slot_n;
+		list_for_each_safe(pos, tmp, slot) {
+			struct timer_entry *t =
+				list_entry(pos, struct timer_entry, l);
+			if (t->expires > target)
+				continue;
+			list_del(&t->l);
+			list_add_tail(expired, &t->l);
+			n++;
+		}
+	}
+	if (tw->now < target)
+		tw->now = target;
+
+	return n;
+}
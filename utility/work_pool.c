@@ -0,0 +1,93 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <debug.h>
+#include <utility/work_pool.h>
+
+static void *work_pool_task(void *arg)
+{
+	struct work_pool *wp = arg;
+	struct work_strand *ws;
+	struct work *w;
+
+	pthread_mutex_lock(&wp->mutex);
+	while (1) {
+		while (list_empty(&wp->ready))
+			pthread_cond_wait(&wp->cond, &wp->mutex);
+
+		ws = list_entry(list_first(&wp->ready), struct work_strand, l);
+		list_del(&ws->l);
+		w = list_entry(list_first(&ws->works), struct work, l);
+		list_del(&w->l);
+		pthread_mutex_unlock(&wp->mutex);
+
+		/* nobody else touches the strand after its final work */
+		if (w->final) {
+			w->fn(w);
+			pthread_mutex_lock(&wp->mutex);
+			continue;
+		}
+		w->fn(w);
+
+		pthread_mutex_lock(&wp->mutex);
+		if (list_empty(&ws->works))
+			ws->scheduled = false;
+		else
+			list_add_tail(&wp->ready, &ws->l);
+	}
+
+	return NULL;
+}
+
+/**
+ * init a work pool and start its worker threads
+ * @thread_n: number of worker threads
+ * @return: 0 if succeeds, -1 otherwise
+ */
+int work_pool_init(struct work_pool *wp, int thread_n)
+{
+	int i;
+
+	pthread_mutex_init(&wp->mutex, NULL);
+	pthread_cond_init(&wp->cond, NULL);
+	INIT_LIST_HEAD(&wp->ready);
+	wp->thread_n = thread_n;
+	wp->tids = calloc(thread_n, sizeof(pthread_t));
+	if (wp->tids == NULL) {
+		_error("work pool threads alloc failed\n");
+		return -1;
+	}
+
+	for (i = 0; i < thread_n; i++)
+		if (pthread_create(wp->tids + i, NULL,
+					work_pool_task, wp) != 0) {
+			_error("work pool thread %d create failed\n", i);
+			return -1;
+		}
+
+	return 0;
+}
+
+void work_strand_init(struct work_strand *ws)
+{
+	INIT_LIST_HEAD(&ws->works);
+	INIT_LIST_ELM(&ws->l);
+	ws->scheduled = false;
+}
+
+/**
+ * queue a work on a strand, it runs after all the works queued on
+ * the strand before it
+ * You MUST NOT queue anything on the strand after a final work
+ */
+void work_queue(struct work_pool *wp, struct work_strand *ws, struct work *w)
+{
+	pthread_mutex_lock(&wp->mutex);
+	list_add_tail(&ws->works, &w->l);
+	if (!ws->scheduled) {
+		ws->scheduled = true;
+		list_add_tail(&wp->ready, &ws->l);
+		pthread_cond_signal(&wp->cond);
+	}
+	pthread_mutex_unlock(&wp->mutex);
+}